@@ -0,0 +1,60 @@
+#!/bin/sh
+# Compares switch and computed goto dispatch on the bench/*.vtex programs.
+#
+# Builds three Release configurations next to each other: "switch", "threaded"
+# and "count" (threaded with VTEX_COUNT_OPS, only used to get the number of
+# executed bytecode instructions). When perf is available it reports hardware
+# instructions and branch misses per bytecode instruction, otherwise only time.
+#
+#   sh bench/run.sh [build dir]
+
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+out=${1:-"$root/_bench"}
+
+configure()
+{
+    cmake -S "$root" -B "$out/$1" -DCMAKE_BUILD_TYPE=Release $2 > /dev/null
+    cmake --build "$out/$1" > /dev/null
+}
+configure switch "-DVTEX_COMPUTED_GOTO=OFF -DVTEX_COUNT_OPS=OFF"
+configure threaded "-DVTEX_COMPUTED_GOTO=ON -DVTEX_COUNT_OPS=OFF"
+configure count "-DVTEX_COMPUTED_GOTO=ON -DVTEX_COUNT_OPS=ON"
+
+useperf=0
+if command -v perf > /dev/null 2>&1 && perf stat -e instructions true > /dev/null 2>&1; then
+    useperf=1
+fi
+
+# Run time in microseconds as reported by Vnew, best of three
+runtime()
+{
+    best=""
+    for n in 1 2 3; do
+        t=$("$1" "$2" 2>&1 >/dev/null | sed -n 's/^Run time took \([0-9.]*\)us$/\1/p')
+        if [ -z "$best" ] || awk "BEGIN {exit !($t < $best)}"; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+printf "%-14s %-9s %12s %12s %10s %10s %10s\n" program dispatch ops us ns/op instr/op miss/kop
+for f in "$root"/bench/*.vtex; do
+    name=$(basename "$f" .vtex)
+    ops=$("$out/count/Vnew" "$f" 2>&1 >/dev/null | sed -n 's/^Executed \([0-9]*\) instructions$/\1/p')
+    for mode in switch threaded; do
+        us=$(runtime "$out/$mode/Vnew" "$f")
+        nsop=$(awk "BEGIN {printf \"%.2f\", $us * 1000 / $ops}")
+        ipo="-"
+        mpk="-"
+        if [ $useperf = 1 ]; then
+            stats=$(perf stat -x, -e instructions,branch-misses "$out/$mode/Vnew" "$f" 2>&1 >/dev/null)
+            instr=$(echo "$stats" | grep ',instructions' | cut -d, -f1)
+            miss=$(echo "$stats" | grep ',branch-misses' | cut -d, -f1)
+            ipo=$(awk "BEGIN {printf \"%.2f\", $instr / $ops}")
+            mpk=$(awk "BEGIN {printf \"%.2f\", $miss * 1000 / $ops}")
+        fi
+        printf "%-14s %-9s %12s %12s %10s %10s %10s\n" "$name" "$mode" "$ops" "$us" "$nsop" "$ipo" "$mpk"
+    done
+done
@@ -1,7 +1,434 @@
 #pragma once
 
+#include "runtime.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 namespace vtex
 {
-    
-}
\ No newline at end of file
+    // Register based bytecode. Every instruction is 32 bits:
+    //  op:8 A:8 B:8 C:8, or op:8 A:8 Bx:16, where sBx is Bx biased by MAXSBX.
+    // R[x] is a register of the current frame, K[x] a constant of the function.
+    #define VTEX_OPCODES(X) \
+        X(MOVE)      /* A B     R[A] = R[B] */ \
+        X(LOADK)     /* A Bx    R[A] = K[Bx] */ \
+        X(LOADNIL)   /* A       R[A] = nil */ \
+        X(LOADBOOL)  /* A B     R[A] = B != 0 */ \
+        X(GETGLOBAL) /* A Bx    R[A] = G[Bx], the global variable in slot Bx */ \
+        X(SETGLOBAL) /* A Bx    G[Bx] = R[A] */ \
+        X(GETFUNC)   /* A Bx    R[A] = F[Bx], the global function in slot Bx */ \
+        X(SETFUNC)   /* A Bx    F[Bx] = R[A] */ \
+        X(ADD)       /* A B C   R[A] = R[B] + R[C] */ \
+        X(SUB)       /* A B C   R[A] = R[B] - R[C] */ \
+        X(MUL)       /* A B C   R[A] = R[B] * R[C] */ \
+        X(DIV)       /* A B C   R[A] = R[B] / R[C] */ \
+        X(MOD)       /* A B C   R[A] = R[B] % R[C] */ \
+        X(EQ)        /* A B C   R[A] = R[B] == R[C] */ \
+        X(NE)        /* A B C   R[A] = R[B] != R[C] */ \
+        X(LT)        /* A B C   R[A] = R[B] < R[C] */ \
+        X(LE)        /* A B C   R[A] = R[B] <= R[C] */ \
+        X(GT)        /* A B C   R[A] = R[B] > R[C] */ \
+        X(GE)        /* A B C   R[A] = R[B] >= R[C] */ \
+        X(NOT)       /* A B     R[A] = !R[B] */ \
+        X(NEG)       /* A B     R[A] = -R[B] */ \
+        X(JMP)       /* sBx     pc += sBx */ \
+        X(JMPIF)     /* A sBx   if R[A] then pc += sBx */ \
+        X(JMPIFNOT)  /* A sBx   if !R[A] then pc += sBx */ \
+        X(CLOSURE)   /* A Bx    R[A] = function(P[Bx]), with the upvalues P[Bx] lists copied in */ \
+        X(GETUPVAL)  /* A B     R[A] = U[B] */ \
+        X(GETUPBOX)  /* A B     R[A] = U[B].box */ \
+        X(SETUPBOX)  /* A B     U[B].box = R[A] */ \
+        X(NEWBOX)    /* A       R[A] = box(R[A]) */ \
+        X(GETBOX)    /* A B     R[A] = R[B].box */ \
+        X(SETBOX)    /* A B     R[B].box = R[A] */ \
+        X(CALL)      /* A B     R[A] = R[A](R[A+1], ..., R[A+B]) */ \
+        X(RET)       /* A B     return B ? R[A] : nil */ \
+        X(TAILCALL)  /* A B     return R[A](R[A+1], ..., R[A+B]), the callee takes over the frame */ \
+        X(NEWARRAY)  /* A B C   R[A] = [R[A+1], ..., R[A+B]], with room for C elements */ \
+        X(APPEND)    /* A B     R[A] gets R[A+1], ..., R[A+B] appended, for long array literals */ \
+        X(GETINDEX)  /* A B C   R[A] = R[B][R[C]] */ \
+        X(SETINDEX)  /* A B C   R[A][R[B]] = R[C] */ \
+        X(NEWRECORD) /* A B C   R[A] = a record of type C with the fields R[A+1], ..., R[A+B] */ \
+        X(GETFIELD)  /* A B C   R[A] = R[B].FK[C], the field of key C */ \
+        X(SETFIELD)  /* A B C   R[A].FK[B] = R[C] */ \
+        /* Superinstructions, fusing the hottest pairs of a VTEX_PROFILE_PAIRS run over bench/. */ \
+        /* The K forms keep the order of ADD..MOD, the compare and jumps are followed by a JMP */ \
+        /* whose offset they take when the comparison equals C, and skip otherwise. */ \
+        X(ADDK)      /* A B C   R[A] = R[B] + K[C] */ \
+        X(SUBK)      /* A B C   R[A] = R[B] - K[C] */ \
+        X(MULK)      /* A B C   R[A] = R[B] * K[C] */ \
+        X(DIVK)      /* A B C   R[A] = R[B] / K[C] */ \
+        X(MODK)      /* A B C   R[A] = R[B] % K[C] */ \
+        X(JEQ)       /* A B C   if (R[A] == R[B]) == C then jump */ \
+        X(JLT)       /* A B C   if (R[A] < R[B]) == C then jump */ \
+        X(JLE)       /* A B C   if (R[A] <= R[B]) == C then jump */ \
+        X(JEQK)      /* A B C   if (R[A] == K[B]) == C then jump */ \
+        X(JLTK)      /* A B C   if (R[A] < K[B]) == C then jump */ \
+        X(JLEK)      /* A B C   if (R[A] <= K[B]) == C then jump */ \
+        X(JGTK)      /* A B C   if (R[A] > K[B]) == C then jump */ \
+        X(JGEK)      /* A B C   if (R[A] >= K[B]) == C then jump */ \
+        X(CALLG)     /* A B C   R[A] = F[C](R[A+1], ..., R[A+B]) */ \
+        /* Counting loops: R[A] counts the trips up to R[A+1], R[A+4] is the loop variable */ \
+        /* R[A+2] + R[A]*R[A+3], see ForExpr in generator.cpp. */ \
+        X(FORPREP)   /* A sBx   R[A+1] = trips from R[A+2] to R[A+1] by R[A+3], R[A] = 0, R[A+4] = R[A+2]; jump if none */ \
+        X(FORLOOP)   /* A sBx   R[A] += 1; if R[A] < R[A+1] then R[A+4] = R[A+2] + R[A]*R[A+3] and jump back */ \
+        X(GETELEM)   /* A B C   R[A] = R[B][R[C]], R[C] is a whole number >= 0, only compared with the length of an array */ \
+        X(SETELEM)   /* A B C   R[A][R[B]] = R[C], R[B] is a whole number >= 0, only compared with the length of an array */ \
+        /* x += y statements on variables that are not in a register, see BinopExpr::update in generator.cpp */ \
+        X(ADDGLOBAL) /* A Bx    G[Bx] += R[A], a string or array only the slot holds is updated in place */ \
+        X(ADDBOX)    /* A B     R[B].box += R[A], the same for the box */ \
+        X(ADDUPBOX)  /* A B     U[B].box += R[A], the same for the box */
+
+    // The list above is the single source of truth for the enum, the names and the
+    // interpreters jump table, so they can not go out of order
+    #define VTEX_OPENUM(name) OP_##name,
+    #define VTEX_OPNAME(name) #name,
+
+    enum OpCode : uint8_t
+    {
+        VTEX_OPCODES(VTEX_OPENUM)
+        OP_COUNT
+    };
+
+    const inline char* opnames[OP_COUNT] =
+    {
+        VTEX_OPCODES(VTEX_OPNAME)
+    };
+
+    typedef uint32_t Instr;
+
+    const int MAXREGS = 255;
+    const int MAXBX = 0xffff;
+    const int MAXSBX = 0x7fff;
+    const int MAXC = 0xff; // Largest constant index a superinstruction can encode
+
+    inline Instr MakeABC(OpCode op, int a, int b, int c) {return op | (Instr)a << 8 | (Instr)b << 16 | (Instr)c << 24;}
+    inline Instr MakeABx(OpCode op, int a, int bx) {return op | (Instr)a << 8 | (Instr)bx << 16;}
+    inline Instr MakeAsBx(OpCode op, int a, int sbx) {return MakeABx(op, a, sbx + MAXSBX);}
+
+    inline OpCode GetOp(Instr i) {return (OpCode)(i & 0xff);}
+    inline int GetA(Instr i) {return (i >> 8) & 0xff;}
+    inline int GetB(Instr i) {return (i >> 16) & 0xff;}
+    inline int GetC(Instr i) {return i >> 24;}
+    inline int GetBx(Instr i) {return i >> 16;}
+    inline int GetsBx(Instr i) {return (int)(i >> 16) - MAXSBX;}
+
+    // Type feedback bits, which kinds of values a parameter or operand has been seen with
+    enum FeedbackBits : uint8_t
+    {
+        fb_number = 1,
+        fb_boolean = 2,
+        fb_nil = 4,
+        fb_string = 8,
+        fb_function = 16, // Script functions and natives
+        fb_other = 32
+    };
+
+    inline uint8_t typebit(const Val &v)
+    {
+        switch(v.tag)
+        {
+            case number: return fb_number;
+            case boolean: return fb_boolean;
+            case nil: return fb_nil;
+            case string: return fb_string;
+            case function:
+            case native: return fb_function;
+            default: return fb_other;
+        }
+    }
+
+    // Feedback slot of an arithmetic, compare or call instruction: the left operand or the called
+    // value in the low byte, the right operand or the result of the call in the high byte
+    inline uint16_t typepair(const Val &b, const Val &c) {return typebit(b) | typebit(c) << 8;}
+    const uint16_t fb_numbers = fb_number | fb_number << 8;
+
+    // Native code of a compiled function, called with the frames registers and the pc to start at,
+    // 0 or a loop header. Returns -1 once the function returned, -2 on a runtime error, -3 after a
+    // tail call put another function into the frame, or the pc the interpreter continues at.
+    typedef int64_t(*jitfn)(VM*, Val*, int64_t);
+
+    // Where a closure copies an upvalue from when it is created: a register of the
+    // enclosing function, or one of its upvalues. Boxed ones are a VBox to go through.
+    struct Upval
+    {
+        bool local = true;
+        uint8_t index = 0;
+        bool boxed = false;
+    };
+
+    // A compiled function
+    struct Proto
+    {
+        std::string name = "__anon_function";
+        int nparams = 0;
+        int nregs = 0;
+        std::vector<Instr> code;
+        std::vector<Val> k;
+        std::vector<size_t> lines; // Source line of every instruction
+        std::vector<uint16_t> slots; // Type feedback of every instruction, see typepair()
+        std::vector<Proto*> protos; // Functions created by OP_CLOSURE
+        std::vector<Upval> upvals;
+        std::vector<int> selfcalls; // Calls of the function itself that are no tail calls
+        uint64_t calls = 0;
+
+        // Tiering state of the native tiers
+        uint32_t hotness = 0; // Calls plus loop back edges
+        uint32_t tierup = UINT32_MAX; // Hotness at which loops leave for better code, right behind hotness
+        std::vector<uint8_t> feedback; // FeedbackBits seen for every parameter
+        std::vector<uint8_t> loopfeedback; // And for every register when a loop tiered up
+        jitfn jit = nullptr; // Best native code so far
+        jitfn baseline = nullptr; // Template code, see baseline.h
+        int tier = 0; // 0 interpreted, 1 template code, 2 optimized code
+        int deopts = 0; // Optimized code thrown away after a failed guard
+        bool nobaseline = false; // Template compiling failed
+        bool nojit = false; // Optimizing failed or deoptimized too often
+    };
+
+    // Targets of backward jumps, native code can be entered there in the middle of a function
+    inline std::vector<int> LoopHeaders(const Proto* p)
+    {
+        std::vector<int> headers;
+        for (size_t pc = 0; pc < p->code.size(); ++pc)
+        {
+            auto i = p->code[pc];
+            int to = (int)pc + 1 + GetsBx(i);
+            if ((GetOp(i) == OP_JMP && to <= (int)pc && (pc == 0 || GetOp(p->code[pc-1]) < OP_JEQ || GetOp(p->code[pc-1]) > OP_JGEK)) ||
+                GetOp(i) == OP_FORLOOP)
+                headers.push_back(to);
+        }
+        std::sort(headers.begin(), headers.end());
+        headers.erase(std::unique(headers.begin(), headers.end()), headers.end());
+        return headers;
+    }
+
+    inline void Disassemble(Proto* f, FILE* out = stderr)
+    {
+        fprintf(out, "function <%s> params %i, registers %i, constants %zu, upvalues %zu\n", f->name.c_str(), f->nparams, f->nregs, f->k.size(), f->upvals.size());
+        for (size_t pc = 0; pc < f->code.size(); ++pc)
+        {
+            auto i = f->code[pc];
+            auto op = GetOp(i);
+            fprintf(out, "\t%4zu [%zu]\t%-10s", pc, f->lines[pc], opnames[op]);
+            switch(op)
+            {
+                case OP_LOADK:
+                    fprintf(out, "%i %i\t; %s", GetA(i), GetBx(i), tostring(f->k[GetBx(i)]).c_str());
+                    break;
+                case OP_ADDK:
+                case OP_SUBK:
+                case OP_MULK:
+                case OP_DIVK:
+                case OP_MODK:
+                    fprintf(out, "%i %i %i\t; %s", GetA(i), GetB(i), GetC(i), tostring(f->k[GetC(i)]).c_str());
+                    break;
+                case OP_CALLG:
+                    fprintf(out, "%i %i %i\t; F[%i]", GetA(i), GetB(i), GetC(i), GetC(i));
+                    break;
+                case OP_JEQK:
+                case OP_JLTK:
+                case OP_JLEK:
+                case OP_JGTK:
+                case OP_JGEK:
+                    fprintf(out, "%i %i %i\t; %s", GetA(i), GetB(i), GetC(i), tostring(f->k[GetB(i)]).c_str());
+                    break;
+                case OP_CLOSURE:
+                    fprintf(out, "%i %i\t; %s", GetA(i), GetBx(i), f->protos[GetBx(i)]->name.c_str());
+                    break;
+                case OP_GETGLOBAL:
+                case OP_SETGLOBAL:
+                case OP_ADDGLOBAL:
+                    fprintf(out, "%i %i\t; G[%i]", GetA(i), GetBx(i), GetBx(i));
+                    break;
+                case OP_GETFUNC:
+                case OP_SETFUNC:
+                    fprintf(out, "%i %i\t; F[%i]", GetA(i), GetBx(i), GetBx(i));
+                    break;
+                case OP_JMP:
+                case OP_JMPIF:
+                case OP_JMPIFNOT:
+                case OP_FORPREP:
+                case OP_FORLOOP:
+                    fprintf(out, "%i %i\t; to %zu", GetA(i), GetsBx(i), pc + 1 + GetsBx(i));
+                    break;
+                case OP_GETUPVAL:
+                case OP_GETUPBOX:
+                case OP_SETUPBOX:
+                case OP_ADDUPBOX:
+                    fprintf(out, "%i %i\t; U[%i]", GetA(i), GetB(i), GetB(i));
+                    break;
+                default:
+                    fprintf(out, "%i %i %i", GetA(i), GetB(i), GetC(i));
+                    break;
+            }
+            fprintf(out, "\n");
+        }
+        for (auto p : f->protos)
+            Disassemble(p, out);
+    }
+
+    // Compiler state of the function being generated
+    struct FuncState
+    {
+        Proto* f = nullptr;
+        FuncState* parent = nullptr;
+        Heap &heap;
+        std::vector<std::pair<std::string, int>> locals; // Active locals, a locals register is its index
+        std::vector<size_t> blocks; // Number of locals when each open block started
+        std::vector<std::vector<int>> breaks; // Pending "break" jumps of every open loop
+        std::vector<std::pair<int, int>> inside; // Array and index registers of open "for" loops that count through the array
+        std::vector<std::string> upnames; // Name of every upvalue in f->upvals
+        std::unordered_set<std::string> boxed; // Locals that closures capture and something assigns, they live in a VBox
+        std::unordered_map<std::string, int> kstrings;
+        std::unordered_map<uint64_t, int> knumbers;
+        int freereg = 0;
+        size_t line = 0;
+        bool failed = false;
+
+        FuncState(Proto* f, FuncState* parent, Heap &heap) : f(f), parent(parent), heap(heap) {}
+
+        int emit(Instr i)
+        {
+            f->code.push_back(i);
+            f->lines.push_back(line);
+            f->slots.push_back(0);
+            return (int)f->code.size()-1;
+        }
+        int emitABC(OpCode op, int a, int b = 0, int c = 0) {return emit(MakeABC(op, a, b, c));}
+        int emitABx(OpCode op, int a, int bx) {return emit(MakeABx(op, a, bx));}
+        // Emits a jump to be patched later
+        int emitjump(OpCode op, int a = 0) {return emit(MakeAsBx(op, a, 0));}
+
+        int here() {return (int)f->code.size();}
+        void patch(int at, int target)
+        {
+            int offset = target - (at+1);
+            if (offset > MAXSBX || -offset > MAXSBX)
+            {
+                fprintf(stderr, "ERROR [Ln %zu]: Jump is too long\n", line);
+                failed = true;
+                return;
+            }
+            auto &i = f->code[at];
+            i = MakeAsBx(GetOp(i), GetA(i), offset);
+        }
+        void patchhere(int at) {patch(at, here());}
+        void patchhere(std::vector<int> &jumps)
+        {
+            for (auto j : jumps)
+                patchhere(j);
+            jumps.clear();
+        }
+        // Jumps backwards to target
+        void emitloop(int target)
+        {
+            patch(emitjump(OP_JMP), target);
+        }
+
+        int allocreg()
+        {
+            if (freereg >= MAXREGS)
+            {
+                fprintf(stderr, "ERROR [Ln %zu]: Function \"%s\" needs too many registers\n", line, f->name.c_str());
+                failed = true;
+                return freereg;
+            }
+            int r = freereg++;
+            if (freereg > f->nregs)
+                f->nregs = freereg;
+            return r;
+        }
+        int nactive() {return (int)locals.size();}
+
+        int addk(Val v)
+        {
+            if (f->k.size() > MAXBX)
+            {
+                fprintf(stderr, "ERROR [Ln %zu]: Function \"%s\" has too many constants\n", line, f->name.c_str());
+                failed = true;
+                return 0;
+            }
+            f->k.push_back(v);
+            return (int)f->k.size()-1;
+        }
+        int numberk(double n)
+        {
+            uint64_t bits;
+            memcpy(&bits, &n, sizeof(bits));
+            auto itr = knumbers.find(bits);
+            if (itr != knumbers.end())
+                return itr->second;
+            return knumbers[bits] = addk(Val(n));
+        }
+        int stringk(const std::string &str)
+        {
+            auto itr = kstrings.find(str);
+            if (itr != kstrings.end())
+                return itr->second;
+            auto v = heap.string(str);
+            v.o->shared = true; // Constants are never appended to in place
+            return kstrings[str] = addk(v);
+        }
+
+        int findlocal(const std::string &name)
+        {
+            for (auto i = locals.rbegin(); i != locals.rend(); ++i)
+            {
+                if (i->first == name)
+                    return i->second;
+            }
+            return -1;
+        }
+        int addlocal(const std::string &name, int reg)
+        {
+            locals.push_back({name, reg});
+            return reg;
+        }
+        // Upvalue of a local of an enclosing function, added to every function in between. -1 if there is none.
+        int findupval(const std::string &name)
+        {
+            for (size_t u = 0; u < upnames.size(); ++u)
+                if (upnames[u] == name)
+                    return (int)u;
+            if (!parent)
+                return -1;
+            Upval uv;
+            int l = parent->findlocal(name);
+            if (l >= 0)
+                uv = {true, (uint8_t)l, parent->boxed.count(name) > 0};
+            else
+            {
+                int u = parent->findupval(name);
+                if (u < 0)
+                    return -1;
+                uv = {false, (uint8_t)u, parent->f->upvals[u].boxed};
+            }
+            if (upnames.size() > MAXC)
+            {
+                fprintf(stderr, "ERROR [Ln %zu]: Function \"%s\" captures too many variables\n", line, f->name.c_str());
+                failed = true;
+                return -1;
+            }
+            f->upvals.push_back(uv);
+            upnames.push_back(name);
+            return (int)upnames.size()-1;
+        }
+        // Top level declarations outside of any block are globals
+        bool toplevel() {return !parent && blocks.empty();}
+
+        void openblock() {blocks.push_back(locals.size());}
+        void closeblock()
+        {
+            locals.resize(blocks.back());
+            blocks.pop_back();
+            freereg = nactive();
+        }
+    };
+}
@@ -0,0 +1,833 @@
+#pragma once
+
+// Template JIT, the first native tier. Every bytecode op has a fixed x86-64 machine code template
+// that gets copied into executable memory with its register offsets and constants patched in.
+// Registers stay in the frame, so nothing has to be recovered when leaving the code: numbers take
+// the inline fast paths and everything else calls back into the runtime for one instruction.
+// Loop headers are entry points as well, for loops that got hot in the interpreter.
+
+#include "IR.h"
+#include "runtime.h"
+#include "vm.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace vtex
+{
+    namespace baseline
+    {
+        static_assert(sizeof(Val) == 16 && offsetof(Val, tag) == 0 && offsetof(Val, n) == 8, "Unexpected Val layout");
+
+        enum Reg : uint8_t {RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RSI = 6, RDI = 7, R8 = 8, R12 = 12, R13 = 13};
+        enum Cond : uint8_t {CB = 0x2, CAE = 0x3, CE = 0x4, CNE = 0x5, CBE = 0x6, CA = 0x7, CGE = 0xd};
+        // Second opcode byte of the scalar double SSE2 instructions behind an F2 prefix
+        enum SSEOp : uint8_t {MOVSD_LOAD = 0x10, MOVSD_STORE = 0x11, ADDSD = 0x58, MULSD = 0x59, SUBSD = 0x5c, DIVSD = 0x5e};
+
+        // Just the handful of encodings the templates need, memory operands are always [base + disp32]
+        class Assembler
+        {
+            public:
+                std::vector<uint8_t> code;
+                std::vector<int> labels; // Offset of every bound label
+                std::vector<std::pair<int, int>> fixups; // rel32 field at an offset, jumping to a label
+
+                int label()
+                {
+                    labels.push_back(-1);
+                    return (int)labels.size()-1;
+                }
+                void bind(int l) {labels[l] = (int)code.size();}
+
+                void byte(uint8_t b) {code.push_back(b);}
+                void dword(uint32_t d)
+                {
+                    for (int s = 0; s < 32; s += 8)
+                        byte(d >> s);
+                }
+                void qword(uint64_t q)
+                {
+                    for (int s = 0; s < 64; s += 8)
+                        byte(q >> s);
+                }
+
+                void rex(bool w, int reg, int base)
+                {
+                    uint8_t r = 0x40 | w << 3 | (reg >> 3) << 2 | (base >> 3);
+                    if (r != 0x40)
+                        byte(r);
+                }
+                void mem(int reg, int base, int32_t disp)
+                {
+                    byte(0x80 | (reg & 7) << 3 | (base & 7));
+                    if ((base & 7) == RSP)
+                        byte(0x24);
+                    dword(disp);
+                }
+
+                void load64(int reg, int base, int32_t d) {rex(1, reg, base); byte(0x8b); mem(reg, base, d);}
+                void load32(int reg, int base, int32_t d) {rex(0, reg, base); byte(0x8b); mem(reg, base, d);}
+                void store64(int base, int32_t d, int reg) {rex(1, reg, base); byte(0x89); mem(reg, base, d);}
+                void lea(int reg, int base, int32_t d) {rex(1, reg, base); byte(0x8d); mem(reg, base, d);}
+                void store32(int base, int32_t d, int32_t imm) {rex(0, 0, base); byte(0xc7); mem(0, base, d); dword(imm);}
+                void store64i(int base, int32_t d, int32_t imm) {rex(1, 0, base); byte(0xc7); mem(0, base, d); dword(imm);}
+                void cmp32(int base, int32_t d, int32_t imm) {rex(0, 7, base); byte(0x81); mem(7, base, d); dword(imm);}
+                void cmp8(int base, int32_t d, int8_t imm) {rex(0, 7, base); byte(0x80); mem(7, base, d); byte(imm);}
+                void cmpmem32(int reg, int base, int32_t d) {rex(0, reg, base); byte(0x3b); mem(reg, base, d);}
+                void cmpmem64(int reg, int base, int32_t d) {rex(1, reg, base); byte(0x3b); mem(reg, base, d);}
+                void cmpreg(int reg, int32_t imm) {rex(1, 0, reg); byte(0x81); byte(0xf8 | (reg & 7)); dword(imm);}
+                void or16(int base, int32_t d, uint16_t imm) {byte(0x66); rex(0, 1, base); byte(0x81); mem(1, base, d); byte(imm); byte(imm >> 8);}
+                void add32(int base, int32_t d, int8_t imm) {rex(0, 0, base); byte(0x83); mem(0, base, d); byte(imm);}
+                void cmpeax(int32_t imm) {byte(0x3d); dword(imm);}
+                void testeax() {byte(0x85); byte(0xc0);}
+                void mov(int dst, int src) {rex(1, src, dst); byte(0x89); byte(0xc0 | (src & 7) << 3 | (dst & 7));}
+                void sub(int dst, int src) {rex(1, src, dst); byte(0x29); byte(0xc0 | (src & 7) << 3 | (dst & 7));}
+                void cmp(int x, int y) {rex(1, y, x); byte(0x39); byte(0xc0 | (y & 7) << 3 | (x & 7));}
+                void shr(int reg, uint8_t n) {rex(1, 0, reg); byte(0xc1); byte(0xe8 | (reg & 7)); byte(n);}
+                void mov(int reg, uint64_t imm) {rex(1, 0, reg); byte(0xb8 | (reg & 7)); qword(imm);}
+                void mov32(int reg, uint32_t imm) {rex(0, 0, reg); byte(0xb8 | (reg & 7)); dword(imm);}
+
+                void sse(SSEOp op, int x, int base, int32_t d) {byte(0xf2); rex(0, x, base); byte(0x0f); byte(op); mem(x, base, d);}
+                void sse(SSEOp op, int x, int y) {byte(0xf2); byte(0x0f); byte(op); byte(0xc0 | x << 3 | y);}
+                // Memory operand [base + index*8], for the low registers only
+                void sseindexed(SSEOp op, int x, int base, int index) {byte(0xf2); byte(0x0f); byte(op); byte(0x04 | x << 3); byte(0xc0 | index << 3 | base);}
+                void cvttsd2si(int reg, int base, int32_t d) {byte(0xf2); rex(1, reg, base); byte(0x0f); byte(0x2c); mem(reg, base, d);}
+                void ucomisd(int x, int y) {byte(0x66); byte(0x0f); byte(0x2e); byte(0xc0 | x << 3 | y);}
+                void movapd(int x, int y) {byte(0x66); byte(0x0f); byte(0x28); byte(0xc0 | x << 3 | y);}
+                void movq(int x, int reg) {byte(0x66); rex(1, x, reg); byte(0x0f); byte(0x6e); byte(0xc0 | x << 3 | (reg & 7));}
+
+                void call(const void* fn) {mov(RAX, (uint64_t)fn); byte(0xff); byte(0xd0);}
+                void jmp(int l) {byte(0xe9); fixup(l);}
+                void jcc(Cond c, int l) {byte(0x0f); byte(0x80 | c); fixup(l);}
+                void fixup(int l)
+                {
+                    fixups.push_back({(int)code.size(), l});
+                    dword(0);
+                }
+                void push(int reg) {rex(0, 0, reg); byte(0x50 | (reg & 7));}
+                void pop(int reg) {rex(0, 0, reg); byte(0x58 | (reg & 7));}
+                void ret() {byte(0xc3);}
+
+                void link()
+                {
+                    for (auto &f : fixups)
+                    {
+                        int32_t rel = labels[f.second] - (f.first + 4);
+                        memcpy(&code[f.first], &rel, sizeof(rel));
+                    }
+                }
+        };
+
+        // Executable memory, every function gets its own pages so nothing that may be running is ever writable
+        class CodeHeap
+        {
+            std::vector<std::pair<void*, size_t>> blocks;
+            public:
+                ~CodeHeap()
+                {
+                    for (auto &b : blocks)
+                        munmap(b.first, b.second);
+                }
+                void* place(const std::vector<uint8_t> &code)
+                {
+                    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+                    size_t size = (code.size() + page-1) / page * page;
+                    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if (mem == MAP_FAILED)
+                        return nullptr;
+                    memcpy(mem, code.data(), code.size());
+                    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+                    {
+                        munmap(mem, size);
+                        return nullptr;
+                    }
+                    blocks.push_back({mem, size});
+                    return mem;
+                }
+        };
+
+        inline CodeHeap &codeheap()
+        {
+            static CodeHeap heap;
+            return heap;
+        }
+
+        // Where a record keeps its layout, offsetof does not take types with virtual functions
+        inline int32_t layoutoffset()
+        {
+            static const int32_t offset = []
+            {
+                Layout none;
+                VRecord r(&none);
+                return (int32_t)((char*)&r.layout - (char*)&r);
+            }();
+            return offset;
+        }
+
+        // Code layout: rbx holds the frames base and r12 the VM for the whole function
+        class Compiler
+        {
+            VM &vm;
+            Proto* p;
+            Assembler a;
+            std::vector<int> pcs; // Label of every instruction
+            int epilogue = 0;
+            int error = 0;
+
+            // Out of line calls into step, emitted after the function body
+            struct Stub
+            {
+                int entry;
+                int back; // Where the fast path continues, or -1 for a compare and jump
+                int pc;
+                int taken, next; // Targets of a compare and jump
+                bool fails = false; // Goes through arrayop, which can raise an error
+            };
+            std::vector<Stub> stubs;
+            // Out of line collections at loop back edges
+            struct Safepoint
+            {
+                int entry, back, pc;
+            };
+            std::vector<Safepoint> safepoints;
+
+            static int32_t tag(int r) {return r * (int32_t)sizeof(Val);}
+            static int32_t val(int r) {return r * (int32_t)sizeof(Val) + 8;}
+
+            int slowpath(int pc, int taken = -1, int next = -1)
+            {
+                int entry = a.label();
+                stubs.push_back({entry, taken < 0 ? a.label() : -1, pc, taken, next});
+                return entry;
+            }
+            int arrayslowpath(int pc)
+            {
+                int entry = slowpath(pc);
+                stubs.back().fails = true;
+                return entry;
+            }
+            void resume()
+            {
+                if (stubs.back().back >= 0)
+                    a.bind(stubs.back().back);
+            }
+            void callstep(int pc)
+            {
+                a.mov(RDI, R12);
+                a.mov(RSI, RBX);
+                a.mov32(RDX, pc);
+                a.call((const void*)&step);
+            }
+            void arraycall(int pc)
+            {
+                a.mov(RDI, R12);
+                a.mov(RSI, RBX);
+                a.mov32(RDX, pc);
+                a.call((const void*)&nativearrayop);
+                a.testeax();
+                a.jcc(CE, error);
+            }
+            // Jumps to slow unless the value at base + d is a plain value, which copies without the collector
+            void guardplain(int base, int32_t d, int slow)
+            {
+                a.load64(RAX, base, d);
+                a.cmpeax(string);
+                a.jcc(CE, slow);
+                a.cmpeax(function);
+                a.jcc(CGE, slow);
+            }
+            // Leaves the record in R[r] in reg, or jumps to slow unless it has the layout l
+            void guardrecord(int r, const Layout* l, int reg, int slow)
+            {
+                a.cmp32(RBX, tag(r), record);
+                a.jcc(CNE, slow);
+                a.load64(reg, RBX, val(r));
+                a.mov(RCX, (uint64_t)l);
+                a.cmpmem64(RCX, reg, layoutoffset());
+                a.jcc(CNE, slow);
+            }
+            // The first record type with the field of key k where the compiler expected it, its records take the inline path
+            const Layout* expected(const FieldKey &k)
+            {
+                for (auto &l : vm.layouts)
+                    if ((size_t)k.offset < l->ids.size() && l->ids[k.offset] == k.name)
+                        return l.get();
+                return nullptr;
+            }
+            static int32_t fieldat(const FieldKey &k) {return (int32_t)(sizeof(VRecord) + k.offset*sizeof(Val));}
+            // Type feedback for the optimizing tier, the slow paths record theirs in step
+            void numbers(int pc)
+            {
+                #if defined(VTEX_JIT)
+                a.mov(RAX, (uint64_t)&p->slots[pc]);
+                a.or16(RAX, 0, fb_numbers);
+                #endif
+            }
+            void guardnum(int r, int slow)
+            {
+                a.cmp32(RBX, tag(r), number);
+                a.jcc(CNE, slow);
+            }
+            void constant(int x, double n)
+            {
+                uint64_t bits;
+                memcpy(&bits, &n, sizeof(bits));
+                a.mov(RAX, bits);
+                a.movq(x, RAX);
+            }
+            void setnum(int r, int x)
+            {
+                a.sse(MOVSD_STORE, x, RBX, val(r));
+                a.store32(RBX, tag(r), number);
+            }
+
+            // Branches on xmm0 op xmm1, with the same tolerance for equality as vtex::equals
+            void compare(OpCode op, int iftrue, int iffalse)
+            {
+                switch(op)
+                {
+                    case OP_LT:
+                        a.ucomisd(1, 0);
+                        a.jcc(CA, iftrue);
+                        a.jmp(iffalse);
+                        return;
+                    case OP_GT:
+                        a.ucomisd(0, 1);
+                        a.jcc(CA, iftrue);
+                        a.jmp(iffalse);
+                        return;
+                    case OP_NE:
+                        std::swap(iftrue, iffalse);
+                        break;
+                    case OP_LE:
+                        a.ucomisd(1, 0);
+                        a.jcc(CA, iftrue);
+                        break;
+                    case OP_GE:
+                        a.ucomisd(0, 1);
+                        a.jcc(CA, iftrue);
+                        break;
+                    default:
+                        break;
+                }
+                // c > b - 0.0001 && c < b + 0.0001, unordered compares fail both
+                constant(3, 0.0001);
+                a.movapd(2, 0);
+                a.sse(SUBSD, 2, 3);
+                a.ucomisd(1, 2);
+                a.jcc(CBE, iffalse);
+                a.sse(ADDSD, 0, 3);
+                a.ucomisd(0, 1);
+                a.jcc(CA, iftrue);
+                a.jmp(iffalse);
+            }
+
+            void truthy(int r, int iftrue, int iffalse)
+            {
+                int notbool = a.label();
+                a.load64(RAX, RBX, tag(r));
+                a.cmpeax(boolean);
+                a.jcc(CNE, notbool);
+                a.cmp8(RBX, val(r), 0);
+                a.jcc(CNE, iftrue);
+                a.jmp(iffalse);
+                a.bind(notbool);
+                a.cmpeax(nil);
+                a.jcc(CE, iffalse);
+                a.cmpeax(null);
+                a.jcc(CE, iffalse);
+                a.jmp(iftrue);
+            }
+
+            // Jumps back to the loop header at to
+            void backedge(int pc, int to)
+            {
+                // Safepoint, collects out of line when the heap asks for it
+                int collect = a.label(), back = a.label();
+                a.mov(RAX, (uint64_t)&vm.heap.wantgc);
+                a.cmp8(RAX, 0, 0);
+                a.jcc(CNE, collect);
+                a.bind(back);
+                safepoints.push_back({collect, back, pc});
+                #if defined(VTEX_JIT)
+                // Count the back edge, a hot loop returns its header to go on in the optimizing tier
+                a.mov(RAX, (uint64_t)&p->hotness);
+                a.add32(RAX, 0, 1);
+                a.load32(RCX, RAX, 0);
+                a.cmpmem32(RCX, RAX, (int32_t)((char*)&p->tierup - (char*)&p->hotness));
+                a.jcc(CB, pcs[to]);
+                a.mov32(RAX, to);
+                a.jmp(epilogue);
+                #else
+                a.jmp(pcs[to]);
+                #endif
+            }
+
+            void emit(int pc)
+            {
+                auto i = p->code[pc];
+                auto op = GetOp(i);
+                int ra = GetA(i), rb = GetB(i), rc = GetC(i);
+                switch(op)
+                {
+                    case OP_MOVE:
+                    {
+                        // Objects get marked as shared by step
+                        int slow = slowpath(pc);
+                        a.load64(RAX, RBX, tag(rb));
+                        a.cmpeax(string);
+                        a.jcc(CE, slow);
+                        a.cmpeax(function);
+                        a.jcc(CGE, slow);
+                        a.load64(RCX, RBX, val(rb));
+                        a.store64(RBX, tag(ra), RAX);
+                        a.store64(RBX, val(ra), RCX);
+                        resume();
+                        break;
+                    }
+                    case OP_GETGLOBAL:
+                    case OP_SETGLOBAL:
+                    {
+                        // Loads and stores of plain values copy between the frame and the global slot,
+                        // objects get marked as shared by step
+                        int slow = slowpath(pc);
+                        bool get = op == OP_GETGLOBAL;
+                        a.mov(RDX, (uint64_t)&vm.globals[GetBx(i)]);
+                        if (get)
+                            a.load64(RAX, RDX, 0);
+                        else
+                            a.load64(RAX, RBX, tag(ra));
+                        a.cmpeax(string);
+                        a.jcc(CE, slow);
+                        a.cmpeax(function);
+                        a.jcc(CGE, slow);
+                        if (get)
+                        {
+                            a.load64(RCX, RDX, 8);
+                            a.store64(RBX, tag(ra), RAX);
+                            a.store64(RBX, val(ra), RCX);
+                        } else
+                        {
+                            a.load64(RCX, RBX, val(ra));
+                            a.store64(RDX, 0, RAX);
+                            a.store64(RDX, 8, RCX);
+                        }
+                        resume();
+                        break;
+                    }
+                    case OP_ADDGLOBAL:
+                    {
+                        // Numbers add in the slot, strings and arrays are updated by step
+                        int slow = slowpath(pc);
+                        a.mov(RDX, (uint64_t)&vm.globals[GetBx(i)]);
+                        a.cmp32(RDX, 0, number);
+                        a.jcc(CNE, slow);
+                        guardnum(ra, slow);
+                        a.sse(MOVSD_LOAD, 0, RDX, 8);
+                        a.sse(ADDSD, 0, RBX, val(ra));
+                        a.sse(MOVSD_STORE, 0, RDX, 8);
+                        resume();
+                        break;
+                    }
+                    case OP_LOADK:
+                    {
+                        auto &kv = p->k[GetBx(i)];
+                        uint64_t bits;
+                        memcpy(&bits, &kv.n, sizeof(bits));
+                        a.store32(RBX, tag(ra), kv.tag);
+                        a.mov(RAX, bits);
+                        a.store64(RBX, val(ra), RAX);
+                        break;
+                    }
+                    case OP_LOADNIL:
+                        a.store32(RBX, tag(ra), nil);
+                        a.store64i(RBX, val(ra), 0);
+                        break;
+                    case OP_LOADBOOL:
+                        a.store32(RBX, tag(ra), boolean);
+                        a.store64i(RBX, val(ra), rb != 0);
+                        break;
+                    case OP_ADD:
+                    case OP_SUB:
+                    case OP_MUL:
+                    case OP_DIV:
+                    {
+                        static const SSEOp ops[] = {ADDSD, SUBSD, MULSD, DIVSD};
+                        int slow = slowpath(pc);
+                        guardnum(rb, slow);
+                        guardnum(rc, slow);
+                        numbers(pc);
+                        a.sse(MOVSD_LOAD, 0, RBX, val(rb));
+                        a.sse(ops[op - OP_ADD], 0, RBX, val(rc));
+                        setnum(ra, 0);
+                        resume();
+                        break;
+                    }
+                    case OP_MOD:
+                    {
+                        int slow = slowpath(pc);
+                        guardnum(rb, slow);
+                        guardnum(rc, slow);
+                        numbers(pc);
+                        a.sse(MOVSD_LOAD, 0, RBX, val(rb));
+                        a.sse(MOVSD_LOAD, 1, RBX, val(rc));
+                        a.call((const void*)&modulo);
+                        setnum(ra, 0);
+                        resume();
+                        break;
+                    }
+                    case OP_ADDK:
+                    case OP_SUBK:
+                    case OP_MULK:
+                    case OP_DIVK:
+                    case OP_MODK:
+                    {
+                        static const SSEOp ops[] = {ADDSD, SUBSD, MULSD, DIVSD};
+                        auto &kc = p->k[rc];
+                        if (kc.tag != number)
+                        {
+                            callstep(pc);
+                            break;
+                        }
+                        int slow = slowpath(pc);
+                        guardnum(rb, slow);
+                        numbers(pc);
+                        a.sse(MOVSD_LOAD, 0, RBX, val(rb));
+                        constant(1, kc.n);
+                        if (op == OP_MODK)
+                            a.call((const void*)&modulo);
+                        else
+                            a.sse(ops[op - OP_ADDK], 0, 1);
+                        setnum(ra, 0);
+                        resume();
+                        break;
+                    }
+                    case OP_EQ:
+                    case OP_NE:
+                    case OP_LT:
+                    case OP_LE:
+                    case OP_GT:
+                    case OP_GE:
+                    {
+                        int slow = slowpath(pc);
+                        int yes = a.label(), no = a.label(), done = stubs.back().back;
+                        guardnum(rb, slow);
+                        guardnum(rc, slow);
+                        numbers(pc);
+                        a.sse(MOVSD_LOAD, 0, RBX, val(rb));
+                        a.sse(MOVSD_LOAD, 1, RBX, val(rc));
+                        compare(op, yes, no);
+                        a.bind(yes);
+                        a.store64i(RBX, val(ra), 1);
+                        a.store32(RBX, tag(ra), boolean);
+                        a.jmp(done);
+                        a.bind(no);
+                        a.store64i(RBX, val(ra), 0);
+                        a.store32(RBX, tag(ra), boolean);
+                        resume();
+                        break;
+                    }
+                    case OP_JMP:
+                    {
+                        int to = pc + 1 + GetsBx(i);
+                        if (to <= pc)
+                            backedge(pc, to);
+                        else
+                            a.jmp(pcs[to]);
+                        break;
+                    }
+                    case OP_JMPIF:
+                        truthy(ra, pcs[pc + 1 + GetsBx(i)], pcs[pc + 1]);
+                        break;
+                    case OP_JMPIFNOT:
+                        truthy(ra, pcs[pc + 1], pcs[pc + 1 + GetsBx(i)]);
+                        break;
+                    case OP_JEQ:
+                    case OP_JLT:
+                    case OP_JLE:
+                    case OP_JEQK:
+                    case OP_JLTK:
+                    case OP_JLEK:
+                    case OP_JGTK:
+                    case OP_JGEK:
+                    {
+                        static const OpCode cmp[] = {OP_EQ, OP_LT, OP_LE, OP_EQ, OP_LT, OP_LE, OP_GT, OP_GE};
+                        int taken = pcs[pc + 2 + GetsBx(p->code[pc+1])], next = pcs[pc + 2];
+                        bool konst = op >= OP_JEQK;
+                        int slow = slowpath(pc, taken, next);
+                        if (konst && p->k[rb].tag != number)
+                        {
+                            a.jmp(slow);
+                            break;
+                        }
+                        guardnum(ra, slow);
+                        a.sse(MOVSD_LOAD, 0, RBX, val(ra));
+                        if (konst)
+                            constant(1, p->k[rb].n);
+                        else
+                        {
+                            guardnum(rb, slow);
+                            a.sse(MOVSD_LOAD, 1, RBX, val(rb));
+                        }
+                        numbers(pc);
+                        if (rc)
+                            compare(cmp[op - OP_JEQ], taken, next);
+                        else
+                            compare(cmp[op - OP_JEQ], next, taken);
+                        break;
+                    }
+                    case OP_CALL:
+                    case OP_CALLG:
+                        a.mov(RDI, R12);
+                        a.lea(RSI, RBX, tag(ra));
+                        a.mov32(RDX, rb);
+                        a.mov32(RCX, pc);
+                        if (op == OP_CALLG)
+                        {
+                            a.mov32(R8, rc);
+                            a.call((const void*)&nativecallfunction);
+                        } else
+                            a.call((const void*)&nativecall);
+                        a.testeax();
+                        a.jcc(CE, error);
+                        break;
+                    case OP_RET:
+                        if (rb)
+                        {
+                            a.load64(RAX, RBX, tag(ra));
+                            a.load64(RCX, RBX, val(ra));
+                            a.store64(RBX, tag(-1), RAX);
+                            a.store64(RBX, val(-1), RCX);
+                        } else
+                        {
+                            a.store32(RBX, tag(-1), nil);
+                            a.store64i(RBX, val(-1), 0);
+                        }
+                        a.mov(RAX, (uint64_t)-1);
+                        a.jmp(epilogue);
+                        break;
+                    case OP_TAILCALL:
+                        // The runtime moves the callee into this frame, runnative() goes on with it
+                        a.mov(RDI, R12);
+                        a.lea(RSI, RBX, tag(ra));
+                        a.mov32(RDX, rb);
+                        a.mov32(RCX, pc);
+                        a.call((const void*)&nativetailcall);
+                        a.jmp(epilogue);
+                        break;
+                    case OP_GETFIELD:
+                    {
+                        // Plain values in a record of the expected type are one load, everything else goes through arrayop
+                        auto &k = vm.fieldkeys[rc];
+                        auto l = expected(k);
+                        if (!l)
+                        {
+                            arraycall(pc);
+                            break;
+                        }
+                        int slow = arrayslowpath(pc);
+                        guardrecord(rb, l, RDX, slow);
+                        guardplain(RDX, fieldat(k), slow);
+                        a.load64(RCX, RDX, fieldat(k) + 8);
+                        a.store64(RBX, tag(ra), RAX);
+                        a.store64(RBX, val(ra), RCX);
+                        resume();
+                        break;
+                    }
+                    case OP_SETFIELD:
+                    {
+                        // Only plain values over plain values, the collector needs to see the others
+                        auto &k = vm.fieldkeys[rb];
+                        auto l = expected(k);
+                        if (!l)
+                        {
+                            arraycall(pc);
+                            break;
+                        }
+                        int slow = arrayslowpath(pc);
+                        guardrecord(ra, l, RDX, slow);
+                        guardplain(RDX, fieldat(k), slow);
+                        guardplain(RBX, tag(rc), slow);
+                        a.load64(RCX, RBX, val(rc));
+                        a.store64(RDX, fieldat(k), RAX);
+                        a.store64(RDX, fieldat(k) + 8, RCX);
+                        resume();
+                        break;
+                    }
+                    case OP_FORPREP:
+                        // Checks the bounds and counts the trips in the runtime
+                        a.mov(RDI, R12);
+                        a.mov(RSI, RBX);
+                        a.mov32(RDX, pc);
+                        a.call((const void*)&nativeforprep);
+                        a.testeax();
+                        a.jcc(CE, error);
+                        a.cmpeax(1);
+                        a.jcc(CE, pcs[pc + 1 + GetsBx(i)]);
+                        break;
+                    case OP_FORLOOP:
+                    {
+                        // The counter and its bounds are numbers since OP_FORPREP
+                        a.sse(MOVSD_LOAD, 0, RBX, val(ra));
+                        constant(1, 1.0);
+                        a.sse(ADDSD, 0, 1);
+                        a.sse(MOVSD_LOAD, 1, RBX, val(ra + 1));
+                        a.ucomisd(1, 0);
+                        a.jcc(CBE, pcs[pc + 1]);
+                        a.sse(MOVSD_STORE, 0, RBX, val(ra));
+                        a.sse(MULSD, 0, RBX, val(ra + 3));
+                        a.sse(ADDSD, 0, RBX, val(ra + 2));
+                        setnum(ra + 4, 0);
+                        backedge(pc, pc + 1 + GetsBx(i));
+                        break;
+                    }
+                    case OP_GETELEM:
+                    case OP_SETELEM:
+                    {
+                        // Numbers of an unboxed array are read and written in place. The index is compared with
+                        // the length anyway, a script may have taken len() over.
+                        auto &l = arraylayout();
+                        if (l.nums < 0)
+                        {
+                            arraycall(pc);
+                            break;
+                        }
+                        bool get = op == OP_GETELEM;
+                        int arr = get ? rb : ra, index = get ? rc : rb;
+                        int slow = arrayslowpath(pc);
+                        a.cmp32(RBX, tag(arr), array);
+                        a.jcc(CNE, slow);
+                        if (!get)
+                            guardnum(rc, slow);
+                        a.load64(RDX, RBX, val(arr));
+                        a.cmp8(RDX, l.boxed, 0);
+                        a.jcc(CNE, slow);
+                        a.load64(RCX, RDX, l.end);
+                        a.load64(RDX, RDX, l.nums);
+                        a.sub(RCX, RDX);
+                        a.shr(RCX, 3);
+                        a.cvttsd2si(RAX, RBX, val(index));
+                        a.cmp(RAX, RCX);
+                        a.jcc(CAE, slow);
+                        if (get)
+                        {
+                            a.sseindexed(MOVSD_LOAD, 0, RDX, RAX);
+                            setnum(ra, 0);
+                        } else
+                        {
+                            a.sse(MOVSD_LOAD, 0, RBX, val(rc));
+                            a.sseindexed(MOVSD_STORE, 0, RDX, RAX);
+                        }
+                        resume();
+                        break;
+                    }
+                    case OP_NEWARRAY:
+                    case OP_APPEND:
+                    case OP_GETINDEX:
+                    case OP_SETINDEX:
+                    case OP_NEWRECORD:
+                        // Array and record instructions can fail, bad indices and fields are runtime errors
+                        arraycall(pc);
+                        break;
+                    default:
+                        // Closures, ! and unary minus always take the runtime path
+                        callstep(pc);
+                        break;
+                }
+            }
+
+        public:
+            Compiler(VM &vm, Proto* p) : vm(vm), p(p) {}
+
+            jitfn compile()
+            {
+                for (size_t pc = 0; pc < p->code.size(); ++pc)
+                    pcs.push_back(a.label());
+                epilogue = a.label();
+                error = a.label();
+                int osr = a.label();
+
+                // Three pushes keep the stack 16 byte aligned for the calls
+                a.push(RBX);
+                a.push(R12);
+                a.push(R13);
+                a.mov(R12, RDI);
+                a.mov(RBX, RSI);
+                a.cmpreg(RDX, 0);
+                a.jcc(CNE, osr);
+                for (size_t pc = 0; pc < p->code.size(); ++pc)
+                {
+                    a.bind(pcs[pc]);
+                    // The JMP behind a compare and jump is its operand and never runs by itself
+                    if (pc > 0 && GetOp(p->code[pc-1]) >= OP_JEQ && GetOp(p->code[pc-1]) <= OP_JGEK)
+                        continue;
+                    emit((int)pc);
+                }
+
+                for (auto &s : stubs)
+                {
+                    a.bind(s.entry);
+                    if (s.fails)
+                    {
+                        arraycall(s.pc);
+                        a.jmp(s.back);
+                        continue;
+                    }
+                    callstep(s.pc);
+                    if (s.back >= 0)
+                        a.jmp(s.back);
+                    else
+                    {
+                        bool c = GetC(p->code[s.pc]) != 0;
+                        a.testeax();
+                        a.jcc(CNE, c ? s.taken : s.next);
+                        a.jmp(c ? s.next : s.taken);
+                    }
+                }
+                for (auto &s : safepoints)
+                {
+                    a.bind(s.entry);
+                    a.mov(RDI, R12);
+                    a.mov32(RSI, s.pc);
+                    a.call((const void*)&nativesafepoint);
+                    a.testeax();
+                    a.jcc(CE, error);
+                    a.jmp(s.back);
+                }
+                // Entered in the middle of a loop, anything else goes back to the interpreter
+                a.bind(osr);
+                for (int pc : LoopHeaders(p))
+                {
+                    a.cmpreg(RDX, pc);
+                    a.jcc(CE, pcs[pc]);
+                }
+                a.mov(RAX, RDX);
+                a.jmp(epilogue);
+                a.bind(error);
+                a.mov(RAX, (uint64_t)-2);
+                a.bind(epilogue);
+                a.pop(R13);
+                a.pop(R12);
+                a.pop(RBX);
+                a.ret();
+                a.link();
+                return (jitfn)codeheap().place(a.code);
+            }
+        };
+    }
+
+    bool baselinecompile(VM &vm, Proto* p)
+    {
+        baseline::Compiler compiler(vm, p);
+        p->baseline = compiler.compile();
+        if (!p->baseline)
+            p->nobaseline = true;
+        return !!p->baseline;
+    }
+}
@@ -0,0 +1,777 @@
+#pragma once
+
+#include "runtime.h"
+#include "vm.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace vtex
+{
+    Val lib_print(VM &vm, Val* args, int nargs)
+    {
+        std::string out = "";
+        for (int a = 0; a < nargs; ++a)
+        {
+            if (a > 0)
+                out += " ";
+            out += tostring(args[a]);
+        }
+        printf("%s\n", out.c_str());
+        return Val();
+    }
+
+    // Seconds since an arbitrary point, for timing scripts
+    Val lib_clock(VM &vm, Val* args, int nargs)
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return Val(std::chrono::duration<double>(now).count());
+    }
+
+    // array(n, v) is an array of n copies of v, numbers by default
+    Val lib_array(VM &vm, Val* args, int nargs)
+    {
+        auto a = vm.heap.alloc<VArray>();
+        Val arr(a, array);
+        size_t n = nargs > 0 && args[0].tag == number && args[0].n > 0 ? (size_t)args[0].n : 0;
+        Val fill = nargs > 1 ? args[1] : Val(0.0);
+        a->reserve(vm.heap, n);
+        for (size_t i = 0; i < n; ++i)
+            a->push(vm.heap, fill);
+        return arr;
+    }
+
+    // push(a, v, ...) appends to a, an array or a transient vector, and returns its new length
+    Val lib_push(VM &vm, Val* args, int nargs)
+    {
+        if (nargs >= 1 && args[0].tag == pvector && ((VPVector*)args[0].o)->edit)
+        {
+            auto p = (VPVector*)args[0].o;
+            for (int i = 1; i < nargs; ++i)
+                p->push(vm.heap, args[i]);
+            return Val((double)p->length());
+        }
+        if (nargs < 1 || args[0].tag != array)
+            return Val();
+        auto a = (VArray*)args[0].o;
+        for (int i = 1; i < nargs; ++i)
+            a->push(vm.heap, args[i]);
+        return Val((double)a->length());
+    }
+
+    // pop(a) removes the last element of a and returns it, nil if there is none
+    Val lib_pop(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 1 || args[0].tag != array)
+            return Val();
+        return ((VArray*)args[0].o)->pop(vm.heap);
+    }
+
+    // Elements of an array or vector, entries of a map or bytes of a string
+    Val lib_len(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 1)
+            return Val();
+        if (args[0].tag == array)
+            return Val((double)((VArray*)args[0].o)->length());
+        if (args[0].tag == map)
+            return Val((double)((VMap*)args[0].o)->length());
+        if (args[0].tag == pvector)
+            return Val((double)((VPVector*)args[0].o)->length());
+        if (args[0].tag == pmap)
+            return Val((double)((VPMap*)args[0].o)->length());
+        if (args[0].tag == string)
+            return Val((double)tostr(args[0]).size());
+        return Val();
+    }
+
+    // reserve(c, n) makes room for n elements of an array or entries of a map and returns c
+    Val lib_reserve(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 2 || args[1].tag != number || !(args[1].n >= 0))
+            return Val();
+        size_t n = (size_t)args[1].n;
+        if (args[0].tag == array)
+            ((VArray*)args[0].o)->reserve(vm.heap, n);
+        else if (args[0].tag == map)
+            ((VMap*)args[0].o)->reserve(vm.heap, n);
+        else
+            return Val();
+        return args[0];
+    }
+
+    // Elements or entries c holds before it has to grow
+    Val lib_capacity(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 1)
+            return Val();
+        if (args[0].tag == array)
+        {
+            auto a = (VArray*)args[0].o;
+            return Val((double)(a->boxed ? a->vals.capacity() : a->nums.capacity()));
+        }
+        if (args[0].tag == map)
+            return Val((double)((VMap*)args[0].o)->capacity());
+        return Val();
+    }
+
+    // What map, filter, take, reduce and collect take elements from
+    bool iterable(const Val &v)
+    {
+        return v.tag == seq || v.tag == array || v.tag == pvector || v.tag == map || v.tag == pmap;
+    }
+
+    Val stage(VM &vm, VSeq::Kind kind, const Val &from, const Val &fn, double n = 0)
+    {
+        auto s = vm.heap.alloc<VSeq>(kind);
+        for (auto v : {&from, &fn})
+            if (v->isobj())
+                v->o->shared = true;
+        s->from = from;
+        s->fn = fn;
+        s->n = n;
+        vm.heap.barrier(s, from);
+        vm.heap.barrier(s, fn);
+        return Val(s, seq);
+    }
+
+    // map(k, v, ...) is a new map of the keys k to the values v, nil when a key is no number or string.
+    // map(s, f) of a sequence or collection and a function, which are no keys, is a lazy sequence instead.
+    Val lib_map(VM &vm, Val* args, int nargs)
+    {
+        if (nargs == 2 && iterable(args[0]) && (args[1].tag == function || args[1].tag == native))
+            return stage(vm, VSeq::mapped, args[0], args[1]);
+        auto m = vm.heap.alloc<VMap>();
+        Val v(m, map);
+        m->reserve(vm.heap, nargs / 2);
+        for (int a = 0; a + 1 < nargs; a += 2)
+        {
+            if (!VMap::iskey(args[a]))
+                return Val();
+            m->set(vm.heap, args[a], args[a+1]);
+        }
+        return v;
+    }
+
+    // has(m, k) tells whether map m has key k
+    Val lib_has(VM &vm, Val* args, int nargs)
+    {
+        if (nargs >= 2 && args[0].tag == pmap)
+            return Val(((VPMap*)args[0].o)->has(args[1]));
+        if (nargs < 2 || args[0].tag != map)
+            return Val();
+        return Val(((VMap*)args[0].o)->has(args[1]));
+    }
+
+    // remove(m, k) takes key k out of map m, or a transient persistent map, true when it was there
+    Val lib_remove(VM &vm, Val* args, int nargs)
+    {
+        if (nargs >= 2 && args[0].tag == pmap && ((VPMap*)args[0].o)->edit)
+            return Val(((VPMap*)args[0].o)->remove(vm.heap, args[1]));
+        if (nargs < 2 || args[0].tag != map)
+            return Val();
+        return Val(((VMap*)args[0].o)->remove(vm.heap, args[1]));
+    }
+
+    // The keys or values of a map as a new array, in the order they were first put in, or in hash order for a persistent map
+    Val entries(VM &vm, Val* args, int nargs, bool keys)
+    {
+        if (nargs < 1 || (args[0].tag != map && args[0].tag != pmap))
+            return Val();
+        auto a = vm.heap.alloc<VArray>();
+        Val arr(a, array);
+        if (args[0].tag == pmap)
+        {
+            auto m = (VPMap*)args[0].o;
+            a->reserve(vm.heap, m->length());
+            m->each([&](const Val &k, const Val &v) {a->push(vm.heap, keys ? k : v);});
+            return arr;
+        }
+        auto m = (VMap*)args[0].o;
+        a->reserve(vm.heap, m->length());
+        for (auto &e : m->entries)
+            if (!e.key.isnil())
+                a->push(vm.heap, keys ? e.key : e.value);
+        return arr;
+    }
+    Val lib_keys(VM &vm, Val* args, int nargs) {return entries(vm, args, nargs, true);}
+    Val lib_values(VM &vm, Val* args, int nargs) {return entries(vm, args, nargs, false);}
+
+    // pvector(v, ...) is a new persistent vector of its arguments
+    Val lib_pvector(VM &vm, Val* args, int nargs)
+    {
+        auto p = vm.heap.alloc<VPVector>();
+        Val v(p, pvector);
+        p->edit = vm.heap.newedit();
+        for (int a = 0; a < nargs; ++a)
+            p->push(vm.heap, args[a]);
+        p->edit = 0;
+        return v;
+    }
+
+    // pmap(k, v, ...) is a new persistent map of the keys k to the values v, nil when a key is no number or string
+    Val lib_pmap(VM &vm, Val* args, int nargs)
+    {
+        auto m = vm.heap.alloc<VPMap>();
+        Val v(m, pmap);
+        m->edit = vm.heap.newedit();
+        for (int a = 0; a + 1 < nargs; a += 2)
+        {
+            if (!VMap::iskey(args[a]))
+                return Val();
+            m->set(vm.heap, args[a], args[a+1]);
+        }
+        m->edit = 0;
+        return v;
+    }
+
+    // with(c, k, v) is a persistent vector or map c with k set to v, c itself stays as it was. Index len(c)
+    // appends to a vector. A transient c is changed and returned instead. Nil for a bad index or key.
+    Val lib_with(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 3)
+            return Val();
+        if (args[0].tag == pvector)
+        {
+            auto p = (VPVector*)args[0].o;
+            size_t n = p->length();
+            int64_t at = args[1].tag == number ? position(args[1].n, n + 1) : -1;
+            if (at < 0)
+                return Val();
+            if (!p->edit)
+                p = p->version(vm.heap, false);
+            Val v(p, pvector);
+            if ((size_t)at == n)
+                p->push(vm.heap, args[2]);
+            else
+                p->set(vm.heap, at, args[2]);
+            return v;
+        }
+        if (args[0].tag != pmap || !VMap::iskey(args[1]))
+            return Val();
+        auto m = (VPMap*)args[0].o;
+        if (!m->edit)
+            m = m->version(vm.heap, false);
+        Val v(m, pmap);
+        m->set(vm.heap, args[1], args[2]);
+        return v;
+    }
+
+    // without(m, k) is a persistent map m without key k, m itself stays as it was. A transient m loses the key instead.
+    Val lib_without(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 2 || args[0].tag != pmap)
+            return Val();
+        auto m = (VPMap*)args[0].o;
+        if (!m->edit)
+        {
+            if (!m->has(args[1]))
+                return args[0];
+            m = m->version(vm.heap, false);
+        }
+        Val v(m, pmap);
+        m->remove(vm.heap, args[1]);
+        return v;
+    }
+
+    // transient(c) is a version of a persistent vector or map that changes in place, see persistent()
+    Val lib_transient(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 1)
+            return Val();
+        // One transient may change its nodes in place, so a transient is not copied
+        if (args[0].tag == pvector)
+            return ((VPVector*)args[0].o)->edit ? args[0] : Val(((VPVector*)args[0].o)->version(vm.heap, true), pvector);
+        if (args[0].tag == pmap)
+            return ((VPMap*)args[0].o)->edit ? args[0] : Val(((VPMap*)args[0].o)->version(vm.heap, true), pmap);
+        return Val();
+    }
+
+    // persistent(c) ends a transient and returns it, now persistent, or makes a persistent vector of an
+    // array and a persistent map of a map
+    Val lib_persistent(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 1)
+            return Val();
+        auto &c = args[0];
+        if (c.tag == pvector || c.tag == pmap)
+        {
+            if (c.tag == pvector)
+                ((VPVector*)c.o)->edit = 0;
+            else
+                ((VPMap*)c.o)->edit = 0;
+            return c;
+        }
+        if (c.tag == array)
+        {
+            auto a = (VArray*)c.o;
+            auto p = vm.heap.alloc<VPVector>();
+            Val v(p, pvector);
+            p->edit = vm.heap.newedit();
+            for (size_t i = 0; i < a->length(); ++i)
+                p->push(vm.heap, a->get(i));
+            p->edit = 0;
+            return v;
+        }
+        if (c.tag == map)
+        {
+            auto m = vm.heap.alloc<VPMap>();
+            Val v(m, pmap);
+            m->edit = vm.heap.newedit();
+            for (auto &e : ((VMap*)c.o)->entries)
+                if (!e.key.isnil())
+                    m->set(vm.heap, e.key, e.value);
+            m->edit = 0;
+            return v;
+        }
+        return Val();
+    }
+
+    // Numbers of an array for the reductions, a boxed array qualifies when it holds only numbers and is copied to scratch
+    bool numbers(const Val &v, const double* &p, size_t &n, std::vector<double> &scratch)
+    {
+        if (v.tag != array)
+            return false;
+        auto a = (VArray*)v.o;
+        n = a->length();
+        if (!a->boxed)
+        {
+            p = a->nums.data();
+            return true;
+        }
+        for (auto &e : a->vals)
+        {
+            if (e.tag != number)
+                return false;
+            scratch.push_back(e.n);
+        }
+        p = scratch.data();
+        return true;
+    }
+
+    // Numbers of an array as the only argument, or the arguments themselves when they all are numbers
+    bool operands(Val* args, int nargs, const double* &p, size_t &n, std::vector<double> &scratch)
+    {
+        if (nargs == 1 && args[0].tag == array)
+            return numbers(args[0], p, n, scratch);
+        for (int i = 0; i < nargs; ++i)
+        {
+            if (args[i].tag != number)
+                return false;
+            scratch.push_back(args[i].n);
+        }
+        p = scratch.data();
+        n = scratch.size();
+        return true;
+    }
+
+    // Smallest or biggest number, NaN if there is one. -0 counts as smaller than 0, so the order of the numbers does not matter.
+    double extreme(const double* p, size_t n, bool greater)
+    {
+        double r = simd::extreme(p, n, greater);
+        if (r != r)
+            for (size_t i = 0; i < n; ++i)
+                if (p[i] != p[i])
+                    return p[i];
+        if (r == 0)
+            for (size_t i = 0; i < n; ++i)
+                if (p[i] == 0 && std::signbit(p[i]) != greater)
+                    return p[i];
+        return r;
+    }
+
+    // Index of the first of n >= 1 numbers that is the smallest or biggest
+    size_t extremeat(const double* p, size_t n, bool greater)
+    {
+        double r = extreme(p, n, greater);
+        for (size_t i = 0; i < n; ++i)
+            if (r != r ? p[i] != p[i] : p[i] == r && std::signbit(p[i]) == std::signbit(r))
+                return i;
+        return 0;
+    }
+
+    // sum(a) adds up an array of numbers, 0 when it is empty
+    Val lib_sum(VM &vm, Val* args, int nargs)
+    {
+        const double* p;
+        size_t n;
+        std::vector<double> scratch;
+        if (nargs < 1 || !numbers(args[0], p, n, scratch))
+            return Val();
+        return Val(simd::sum(p, nullptr, n));
+    }
+
+    Val lib_mean(VM &vm, Val* args, int nargs)
+    {
+        const double* p;
+        size_t n;
+        std::vector<double> scratch;
+        if (nargs < 1 || !numbers(args[0], p, n, scratch) || n == 0)
+            return Val();
+        return Val(simd::sum(p, nullptr, n) / (double)n);
+    }
+
+    // dot(a, b) is the sum of a[i]*b[i] over two arrays of numbers of the same length
+    Val lib_dot(VM &vm, Val* args, int nargs)
+    {
+        const double *p, *q;
+        size_t n, m;
+        std::vector<double> scratch, other;
+        if (nargs < 2 || !numbers(args[0], p, n, scratch) || !numbers(args[1], q, m, other) || n != m)
+            return Val();
+        return Val(simd::sum(p, q, n));
+    }
+
+    // min(a) and max(a) of an array, or min(x, y, ...) and max(x, y, ...) of numbers
+    Val lib_min(VM &vm, Val* args, int nargs)
+    {
+        const double* p;
+        size_t n;
+        std::vector<double> scratch;
+        if (!operands(args, nargs, p, n, scratch) || n == 0)
+            return Val();
+        return Val(extreme(p, n, false));
+    }
+
+    Val lib_max(VM &vm, Val* args, int nargs)
+    {
+        const double* p;
+        size_t n;
+        std::vector<double> scratch;
+        if (!operands(args, nargs, p, n, scratch) || n == 0)
+            return Val();
+        return Val(extreme(p, n, true));
+    }
+
+    // argmin(a) and argmax(a) are the index of the first smallest or biggest element
+    Val lib_argmin(VM &vm, Val* args, int nargs)
+    {
+        const double* p;
+        size_t n;
+        std::vector<double> scratch;
+        if (nargs < 1 || !numbers(args[0], p, n, scratch) || n == 0)
+            return Val();
+        return Val((double)extremeat(p, n, false));
+    }
+
+    Val lib_argmax(VM &vm, Val* args, int nargs)
+    {
+        const double* p;
+        size_t n;
+        std::vector<double> scratch;
+        if (nargs < 1 || !numbers(args[0], p, n, scratch) || n == 0)
+            return Val();
+        return Val((double)extremeat(p, n, true));
+    }
+
+    // cumsum(a) is a new array of the running totals of a, each one what adding up a loop would give
+    Val lib_cumsum(VM &vm, Val* args, int nargs)
+    {
+        const double* p;
+        size_t n;
+        std::vector<double> scratch;
+        if (nargs < 1 || !numbers(args[0], p, n, scratch))
+            return Val();
+        auto a = vm.heap.alloc<VArray>();
+        Val arr(a, array);
+        auto out = a->numbers(vm.heap, n);
+        double total = 0;
+        for (size_t i = 0; i < n; ++i)
+            out[i] = total += p[i];
+        return arr;
+    }
+
+    // range(n), range(a, b) or range(a, b, step) is a lazy sequence of the numbers from a, 0 by default, up to b
+    Val lib_range(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 1)
+            return Val();
+        Val a = nargs > 1 ? args[0] : Val(0.0), b = nargs > 1 ? args[1] : args[0], step = nargs > 2 ? args[2] : Val(1.0);
+        double n = trips(a, b, step);
+        if (n < 0)
+            return Val();
+        auto s = vm.heap.alloc<VSeq>(VSeq::range);
+        s->start = a.n;
+        s->step = step.n;
+        s->n = n;
+        return Val(s, seq);
+    }
+
+    // Runs a sequence or a collection element by element through its stages and hands what comes out to a sink.
+    // The values live in the stack behind the arguments of the native, script functions it calls may collect
+    // and move them.
+    class Pipeline
+    {
+        struct Stage
+        {
+            VSeq::Kind kind;
+            double n, taken;
+        };
+        VM &vm;
+        Val* slots; // The source, the function of every stage, two for the sink, the element and a call
+        std::vector<Stage> stages; // From the source on
+        bool range = false;
+        double start = 0, step = 1, count = 0; // Of a range, or the elements of the array or vector in slots[0]
+
+        public:
+            int sink = 0; // First slot of the sink
+
+            Pipeline(VM &vm, Val* slots) : vm(vm), slots(slots) {}
+
+            // False when v can not be iterated or there is no room for the slots, which is an error then
+            bool open(Val v)
+            {
+                std::vector<Val> fns;
+                while (v.tag == seq && ((VSeq*)v.o)->kind != VSeq::range)
+                {
+                    auto s = (VSeq*)v.o;
+                    stages.insert(stages.begin(), {s->kind, s->n, 0});
+                    fns.insert(fns.begin(), s->fn);
+                    v = s->from;
+                }
+                sink = 1 + (int)stages.size();
+                if (slots + sink + 6 > vm.stack.data() + vm.stack.size())
+                {
+                    vm.runtimeerror("Stack overflow");
+                    vm.nativefailed = true;
+                    return false;
+                }
+                std::copy(fns.begin(), fns.end(), slots + 1);
+                if (v.tag == seq)
+                {
+                    auto r = (VSeq*)v.o;
+                    range = true;
+                    start = r->start;
+                    step = r->step;
+                    count = r->n;
+                    return true;
+                }
+                if (v.tag == map || v.tag == pmap)
+                    v = entries(vm, &v, 1, true);
+                if (v.tag != array && v.tag != pvector)
+                    return false;
+                slots[0] = v;
+                count = (double)(v.tag == array ? ((VArray*)v.o)->length() : ((VPVector*)v.o)->length());
+                return true;
+            }
+
+            // Calls out(x) for every element that comes out, it returns false after an error and so does run
+            template<typename F> bool run(F &&out)
+            {
+                Val &x = slots[sink + 2];
+                Val* call = &x + 1;
+                for (double i = 0; i < count; ++i)
+                {
+                    for (auto &s : stages)
+                        if (s.kind == VSeq::taken && !(s.taken < s.n))
+                            return true;
+                    if (!element(i, x))
+                        return false;
+                    bool pass = true;
+                    for (size_t s = 0; s < stages.size() && pass; ++s)
+                    {
+                        if (stages[s].kind == VSeq::taken)
+                        {
+                            ++stages[s].taken;
+                            continue;
+                        }
+                        call[0] = slots[1 + s];
+                        call[1] = x;
+                        if (!invoke(call, 1))
+                            return false;
+                        if (stages[s].kind == VSeq::mapped)
+                            x = call[0];
+                        else
+                            pass = truthy(call[0]);
+                    }
+                    if (pass && !out(x))
+                        return false;
+                }
+                return true;
+            }
+
+            // Calls the function in at with the nargs values behind it, the result goes to at
+            bool invoke(Val* at, int nargs)
+            {
+                bool ok = vm.callbacks < vm.maxcallbacks;
+                if (!ok)
+                    vm.runtimeerror("Stack overflow");
+                else
+                {
+                    ++vm.callbacks;
+                    ok = vm.call(at, nargs);
+                    --vm.callbacks;
+                }
+                vm.nativefailed = !ok;
+                return ok;
+            }
+
+        private:
+            bool element(double i, Val &x)
+            {
+                if (range)
+                {
+                    x = Val(start + i*step);
+                    return true;
+                }
+                auto &c = slots[0];
+                size_t n = c.tag == array ? ((VArray*)c.o)->length() : ((VPVector*)c.o)->length();
+                if (i >= (double)n)
+                {
+                    vm.runtimeerror(stringf("%s index %s is out of range, the %s has %zu elements", c.tag == array ? "Array" : "Vector",
+                        tostring(Val(i)).c_str(), typname(c), n));
+                    vm.nativefailed = true;
+                    return false;
+                }
+                x = c.tag == array ? ((VArray*)c.o)->get((size_t)i) : ((VPVector*)c.o)->get((size_t)i);
+                if (x.isobj())
+                    x.o->shared = true;
+                return true;
+            }
+    };
+
+    // filter(s, f) is a lazy sequence of the elements x of s for which f(x) is true
+    Val lib_filter(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 2 || !iterable(args[0]))
+            return Val();
+        return stage(vm, VSeq::filtered, args[0], args[1]);
+    }
+
+    // take(s, n) is a lazy sequence of the first n elements of s
+    Val lib_take(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 2 || !iterable(args[0]) || args[1].tag != number)
+            return Val();
+        return stage(vm, VSeq::taken, args[0], Val(), args[1].n);
+    }
+
+    // reduce(s, f, init) is f(...f(f(init, x0), x1)..., xn) over the elements of s. Without init the first
+    // element starts, nil if there is none.
+    Val lib_reduce(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 2 || !iterable(args[0]))
+            return Val();
+        Pipeline p(vm, args + nargs);
+        if (!p.open(args[0]))
+            return Val();
+        Val* acc = args + nargs + p.sink;
+        acc[0] = nargs > 2 ? args[2] : Val();
+        acc[1] = args[1];
+        bool started = nargs > 2;
+        bool ok = p.run([&](const Val &x)
+        {
+            if (!started)
+            {
+                started = true;
+                acc[0] = x;
+                return true;
+            }
+            Val* call = acc + 3;
+            call[0] = acc[1];
+            call[1] = acc[0];
+            call[2] = x;
+            if (!p.invoke(call, 2))
+                return false;
+            acc[0] = call[0];
+            return true;
+        });
+        return ok ? acc[0] : Val();
+    }
+
+    // collect(s) is a new array of the elements of s
+    Val collect(VM &vm, Val* args, int nargs)
+    {
+        Pipeline p(vm, args + nargs);
+        if (nargs < 1 || !p.open(args[0]))
+            return Val();
+        Val &out = args[nargs + p.sink];
+        out = Val(vm.heap.alloc<VArray>(), array);
+        bool ok = p.run([&](const Val &x)
+        {
+            ((VArray*)out.o)->push(vm.heap, x);
+            return true;
+        });
+        return ok ? out : Val();
+    }
+    Val lib_collect(VM &vm, Val* args, int nargs) {return nargs > 0 && iterable(args[0]) ? collect(vm, args, nargs) : Val();}
+
+    // Hidden helpers of the loops the compiler fuses pipelines into, no script can take their names over. (elements)
+    // gives an array or vector to index, the keys of a map or a sequence collected, and nil for anything else.
+    Val lib_elements(VM &vm, Val* args, int nargs)
+    {
+        if (nargs < 1)
+            return Val();
+        if (args[0].tag == array || args[0].tag == pvector)
+            return args[0];
+        if (args[0].tag == map || args[0].tag == pmap)
+            return entries(vm, args, 1, true);
+        return args[0].tag == seq ? collect(vm, args, 1) : Val();
+    }
+
+    // (trips)(a, b, step) is the number of elements of range(a, b, step), nil when there is no such range
+    Val lib_trips(VM &vm, Val* args, int nargs)
+    {
+        double n = nargs == 3 ? trips(args[0], args[1], args[2]) : -1;
+        return n < 0 ? Val() : Val(n);
+    }
+
+    // (count)(n) is n when it is a number, the count of a take(), nil otherwise
+    Val lib_count(VM &vm, Val* args, int nargs)
+    {
+        return nargs > 0 && args[0].tag == number ? args[0] : Val();
+    }
+
+    // (natives)(f, ...) is whether every f is a native function, what a fused pipeline checks its built-ins with
+    Val lib_natives(VM &vm, Val* args, int nargs)
+    {
+        for (int i = 0; i < nargs; ++i)
+            if (args[i].tag != native)
+                return Val(false);
+        return Val(true);
+    }
+
+    void openlibs(VM &vm)
+    {
+        vm.defnative("print", lib_print);
+        vm.defnative("clock", lib_clock);
+        vm.defnative("array", lib_array);
+        vm.defnative("push", lib_push);
+        vm.defnative("pop", lib_pop);
+        vm.defnative("len", lib_len);
+        vm.defnative("reserve", lib_reserve);
+        vm.defnative("capacity", lib_capacity);
+        vm.defnative("map", lib_map);
+        vm.defnative("has", lib_has);
+        vm.defnative("remove", lib_remove);
+        vm.defnative("keys", lib_keys);
+        vm.defnative("values", lib_values);
+        vm.defnative("pvector", lib_pvector);
+        vm.defnative("pmap", lib_pmap);
+        vm.defnative("with", lib_with);
+        vm.defnative("without", lib_without);
+        vm.defnative("transient", lib_transient);
+        vm.defnative("persistent", lib_persistent);
+        vm.defnative("sum", lib_sum);
+        vm.defnative("mean", lib_mean);
+        vm.defnative("dot", lib_dot);
+        vm.defnative("min", lib_min);
+        vm.defnative("max", lib_max);
+        vm.defnative("argmin", lib_argmin);
+        vm.defnative("argmax", lib_argmax);
+        vm.defnative("cumsum", lib_cumsum);
+        vm.defnative("range", lib_range);
+        vm.defnative("filter", lib_filter);
+        vm.defnative("take", lib_take);
+        vm.defnative("reduce", lib_reduce);
+        vm.defnative("collect", lib_collect);
+        vm.defnative("(elements)", lib_elements);
+        vm.defnative("(trips)", lib_trips);
+        vm.defnative("(len)", lib_len);
+        vm.defnative("(count)", lib_count);
+        vm.defnative("(natives)", lib_natives);
+    }
+}
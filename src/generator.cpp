@@ -5,6 +5,15 @@
 #include "keywords.h"
 #include "value.h"
 #include "vstring.h"
+#include "IR.h"
+#include "vm.h"
+#include "builtins.h"
+#if defined(VTEX_BASELINE)
+#include "baseline.h"
+#endif
+#if defined(VTEX_JIT)
+#include "jitcompiler.h"
+#endif
 
 // C headers
 #include <cstdio>
@@ -24,6 +33,7 @@
 #include <sstream>
 #include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
@@ -257,12 +267,30 @@ static int reversetoken()
 
 #pragma region "Abstract Syntax Tree"
 
+// Names a function body uses, to find the locals closures capture and something assigns
+struct Scan
+{
+    std::unordered_set<std::string> declared; // Parameters and locals
+    std::unordered_set<std::string> used; // Read, called or assigned
+    std::unordered_set<std::string> assigned; // Assigned to, in nested functions too
+    std::unordered_set<std::string> captured; // Used by nested functions that dont declare them
+    bool calls = false; // Calls a function, which may run any code
+};
+
 class Expr
 {
     public:
+        size_t Line = line; // Source line the expression ended on
         virtual ~Expr() = default;
         virtual std::string tostring() {return "";};
-        virtual std::unique_ptr<vtex::Value> codegen() {return {};}
+        // Emits code leaving the value in dst, or in any register if dst is -1. Returns the register,
+        // or -1 for statements without a value.
+        virtual int codegen(vtex::FuncState &fs, int dst) {return -1;}
+        // Emits jumps, appended to jumps, that are taken when the truthiness of the expression equals cond
+        virtual void condjump(vtex::FuncState &fs, bool cond, std::vector<int> &jumps);
+        virtual vtex::Type* literal() {return nullptr;} // Compile time constant, if the expression is one
+        virtual std::unique_ptr<Expr> optimize() {return nullptr;} // Folded replacement, or nullptr to keep this
+        virtual void scan(Scan &s) {}
 };
 
 typedef unique_ptr<Expr> uExpr;
@@ -276,7 +304,7 @@ class StringExpr : public Expr
         {
             return stringf("\"%s\"", Val.tostring().c_str());
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
 };
 
 class NumberExpr : public Expr
@@ -288,7 +316,7 @@ class NumberExpr : public Expr
         {
             return Val.tostring();
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
 };
 
 class BooleanExpr : public Expr
@@ -300,7 +328,7 @@ class BooleanExpr : public Expr
         {
             return Val.tostring();
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
 };
 
 class VariableExpr : public Expr
@@ -317,23 +345,31 @@ class VariableExpr : public Expr
                 str+=":"+Val->tostring();
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        std::string name() {return Name;}
 };
 
 class VsetExpr : public Expr
 {
     uExpr Var = nullptr;
     uExpr E = nullptr;
+    bool Global = false;
     public:
-        VsetExpr(uExpr Var, uExpr E) : Var(std::move(Var)), E(std::move(E)) {}
+        VsetExpr(uExpr Var, uExpr E, bool Global = false) : Var(std::move(Var)), E(std::move(E)), Global(Global) {}
         std::string tostring() override
         {
-            if (!Var || !E)
+            if (!Var)
                 return "__null";
             
-            std::string str = Var->tostring()+" = "+E->tostring();
+            std::string str = "new "+std::string(Global ? "global " : "")+Var->tostring();
+            if (!!E)
+                str+=" = "+E->tostring();
             return str;
         }
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
 };
 
 class ValueExpr : public Expr
@@ -347,7 +383,27 @@ class ValueExpr : public Expr
             //    return "__null";
             return Val.tostring();
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        vtex::Type* literal() override {return Val.val.get();}
+};
+
+class UnopExpr : public Expr
+{
+    std::string Op = "__null";
+    uExpr E = nullptr;
+    public:
+        UnopExpr(std::string Op, uExpr E) : Op(Op), E(std::move(E)) {}
+        std::string tostring() override
+        {
+            if (!E)
+                return "__null";
+            return stringf("(%s%s)", Op.c_str(), E->tostring().c_str());
+        }
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        void condjump(vtex::FuncState &fs, bool cond, std::vector<int> &jumps) override;
+        uExpr optimize() override;
+        friend bool IsNumeric(Expr *E);
 };
 
 class BinopExpr : public Expr
@@ -363,7 +419,12 @@ class BinopExpr : public Expr
                 return "__null";
             return stringf("(%s %s %s)", LHS->tostring().c_str(), Op.c_str(), RHS->tostring().c_str());
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        void condjump(vtex::FuncState &fs, bool cond, std::vector<int> &jumps) override;
+        uExpr optimize() override;
+        bool update(vtex::FuncState &fs);
+        friend bool IsNumeric(Expr *E);
 };
 
 class ProtoExpr : public Expr
@@ -393,7 +454,15 @@ class ProtoExpr : public Expr
             }
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        std::string name() {return Name;}
+        // Argument names, without the "__void" placeholder of an empty list
+        std::vector<std::string> params()
+        {
+            if (Argnames.size() == 1 && Argnames[0] == "__void")
+                return {};
+            return Argnames;
+        }
 };
 
 class NullExpr : public Expr
@@ -401,7 +470,7 @@ class NullExpr : public Expr
     public:
         NullExpr() {}
         std::string tostring() override {return "__null";}
-        std::unique_ptr<vtex::Value> codegen() override {return {};}
+        int codegen(vtex::FuncState &fs, int dst) override {return -1;}
 };
 
 class BodyExpr : public Expr
@@ -429,7 +498,10 @@ class BodyExpr : public Expr
             }
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
+        std::vector<std::unique_ptr<Expr>> &statements() {return Body;}
 };
 
 class ReturnExpr : public Expr
@@ -444,7 +516,10 @@ class ReturnExpr : public Expr
             std::string str = "return "+Ret->tostring();
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
+        Expr* value() {return Ret.get();}
 };
 
 class IfExpr : public Expr
@@ -463,7 +538,9 @@ class IfExpr : public Expr
                 str+="\n"+Else->tostring();
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
 };
 
 class ElseExpr : public Expr
@@ -478,7 +555,9 @@ class ElseExpr : public Expr
             std::string str = "else:\n"+Next->tostring();
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
 };
 
 class BreakExpr : public Expr
@@ -489,7 +568,7 @@ class BreakExpr : public Expr
         {
             return "break";
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
 };
 
 class WhileExpr : public Expr
@@ -508,7 +587,9 @@ class WhileExpr : public Expr
             std::string str = "while ("+Condition->tostring()+"):\n"+Next->tostring();
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
 };
 
 class ForExpr : public Expr
@@ -530,7 +611,11 @@ class ForExpr : public Expr
             std::string str = "for ("+Var->tostring()+", "+Start->tostring()+", "+Iters->tostring()+", "+Iter->tostring()+"):\n"+Next->tostring();
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
+        // The array whose length the loop counts through, when every index of it the loop variable takes is inside it
+        int inside(vtex::FuncState &fs, const std::string &name);
 };
 
 class FunctionExpr : public Expr
@@ -558,7 +643,11 @@ class FunctionExpr : public Expr
             str+="\n}";
             return str;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
+        // The expression an anonymous function returns, if its body is nothing but that return
+        Expr* returned(std::vector<std::string> &params);
 };
 
 class CalleeExpr : public Expr
@@ -589,7 +678,89 @@ class CalleeExpr : public Expr
             }
             return out;
         }
-        std::unique_ptr<vtex::Value> codegen() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        int tailcall(vtex::FuncState &fs);
+        uExpr optimize() override;
+        std::vector<std::unique_ptr<Expr>> &args() {return Args;}
+        const std::string &name() {return Fname;}
+    private:
+        int call(vtex::FuncState &fs, bool tail, int at = -1);
+        friend int GenPipeline(vtex::FuncState &fs, CalleeExpr *T, int dst);
+};
+
+class ArrayExpr : public Expr
+{
+    std::vector<uExpr> Elements;
+    public:
+        ArrayExpr(std::vector<uExpr>&& elements) : Elements(std::move(elements)) {}
+        std::string tostring() override
+        {
+            std::string str = "[";
+            for (size_t e = 0; e < Elements.size(); ++e)
+            {
+                if (e > 0)
+                    str += ", ";
+                if (!!Elements[e])
+                    str += Elements[e]->tostring();
+            }
+            return str+"]";
+        }
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
+};
+
+class IndexExpr : public Expr
+{
+    uExpr E = nullptr;
+    uExpr I = nullptr;
+    public:
+        IndexExpr(uExpr E, uExpr I) : E(std::move(E)), I(std::move(I)) {}
+        std::string tostring() override
+        {
+            if (!E || !I)
+                return "__null";
+            return E->tostring()+"["+I->tostring()+"]";
+        }
+        int codegen(vtex::FuncState &fs, int dst) override;
+        // Stores RHS, or the element op RHS for a compound assignment, into the element
+        int assign(vtex::FuncState &fs, const std::string &op, Expr *RHS, int dst);
+        void scan(Scan &s) override;
+        uExpr optimize() override;
+};
+
+// r.name, the field is resolved to an offset when the code is generated
+class FieldExpr : public Expr
+{
+    uExpr E = nullptr;
+    std::string Name;
+    public:
+        FieldExpr(uExpr E, std::string Name) : E(std::move(E)), Name(std::move(Name)) {}
+        std::string tostring() override
+        {
+            if (!E)
+                return "__null";
+            return E->tostring()+"."+Name;
+        }
+        int codegen(vtex::FuncState &fs, int dst) override;
+        // Stores RHS, or the field op RHS for a compound assignment, into the field
+        int assign(vtex::FuncState &fs, const std::string &op, Expr *RHS, int dst);
+        void scan(Scan &s) override;
+        uExpr optimize() override;
+};
+
+// Type(a, b, ...) of a record type, fields without an argument are nil
+class RecordExpr : public Expr
+{
+    int Layout;
+    std::vector<uExpr> Args;
+    public:
+        RecordExpr(int Layout, std::vector<uExpr>&& args) : Layout(Layout), Args(std::move(args)) {}
+        std::string tostring() override;
+        int codegen(vtex::FuncState &fs, int dst) override;
+        void scan(Scan &s) override;
+        uExpr optimize() override;
 };
 
 #pragma endregion // End AST region
@@ -597,10 +768,12 @@ class CalleeExpr : public Expr
 
 #pragma region "Parser"
 
-std::unordered_map<std::string, int> usrvarmap;
+// Global names live in the VM's slot tables, the parser hands out their slots
+vtex::VM vm;
 std::vector<std::unordered_map<std::string, int>> ScopeMap;
 int scope = 0;
 bool ErrorOccurred = false;
+std::unordered_set<std::string> ScriptFunctions; // Names the script declared functions under, built-ins of these names are taken over
 
 int RaiseScope()
 {   
@@ -616,18 +789,6 @@ int LowerScope()
     return scope;
 }
 
-/*
-std::unique_ptr<Expr> getvar(std::string name)
-{
-    if (ScopeMap.size() == 0)
-    {
-        return std::move(usrvarmap.at(name));
-    } else
-    {
-
-    }
-}*/
-
 std::unordered_map<std::string, int> binopmap;
 
 std::unique_ptr<Expr> LogError(const char* str)
@@ -660,6 +821,11 @@ std::unique_ptr<Expr> LogNote(const char* str)
     return nullptr;
 }
 
+bool IsFunctionName(const std::string &name)
+{
+    return name.compare(0, 11, "__function:") == 0;
+}
+
 bool varexists(std::string str)
 {   
     if (ScopeMap.size() > 0)
@@ -670,7 +836,31 @@ bool varexists(std::string str)
             return true;
     }
 
-    return (usrvarmap.find(str) != usrvarmap.end());
+    if (IsFunctionName(str))
+        return vm.functionslots.count(str.substr(11)) != 0;
+    return vm.globalslots.count(str) != 0;
+}
+
+// Whether calling name calls a declared function rather than a variable that holds one. The innermost scope with
+// either decides, so parameters and locals hide functions of the same name outside them, globals hide the function table
+bool callsfunction(const std::string &name)
+{
+    for (auto i = ScopeMap.rbegin(); i != ScopeMap.rend(); ++i)
+    {
+        if (i->count(name))
+            return false;
+        if (i->count("__function:"+name))
+            return true;
+    }
+    return !vm.globalslots.count(name) && vm.functionslots.count(name);
+}
+
+void putglobvar(std::string name)
+{
+    if (IsFunctionName(name))
+        vm.functionslot(name.substr(11));
+    else
+        vm.globalslot(name);
 }
 
 void putvar(std::string name)
@@ -678,7 +868,7 @@ void putvar(std::string name)
     if (ScopeMap.size() == 0)
     {
         //LogStatus("Put in globmap");
-        usrvarmap[name] = 0;
+        putglobvar(name);
     } else
     {
         //LogStatus("Put in a scopemap");
@@ -686,15 +876,12 @@ void putvar(std::string name)
     }
 }
 
-void putglobvar(std::string name)
-{
-    usrvarmap[name] = 0;
-}
-
 std::unique_ptr<Expr> ParseScope();
+std::unique_ptr<Expr> ParseExpression();
 std::unique_ptr<Expr> ParseIdentity();
 std::unique_ptr<Expr> ParseIf();
 uExpr ParseWhile();
+uExpr ParseFor();
 
 vtex::Value ParseString()
 {
@@ -709,8 +896,8 @@ vtex::Value ParseString()
         return {};
     }
     
-    getnexttoken(); // Eat ending '"' and restore the lexer
-    lastchar = 0; // Fix the lexers last character so it doesnt go infinite
+    lastchar = getnext(); // Eat ending '"'
+    getnexttoken(); // Restore the lexer on the token after the literal
     return vtex::Value(std::make_unique<vtex::String>(stringstr));
 }
 
@@ -728,22 +915,34 @@ std::unique_ptr<Expr> ParseDefinition()
         LogStatus("Putting variable to global");
         getnexttoken();
     }
+    if (curtok != tok_ident)
+        return LogError("Expected an identifier after \"new global\"");
     std::string name = identstr;
     if (varexists(name))
     {
         LogNote(stringf("Redifinition of variable \"%s\"", name.c_str()).c_str());
     }
+
+    getnexttoken(); // Eat name
+
+    // Parse the initializer before the name exists, so "new x = x" reads the outer x
+    uExpr E = nullptr;
+    if (curtok == tok_op && opstr == "=")
+    {
+        getnexttoken(); // Eat '='
+        E = ParseExpression();
+        if (!E)
+            return LogError(stringf("Initializer of variable \"%s\" is null", name.c_str()).c_str());
+    }
+
     if (!useglob)
     putvar(name);
     else
     putglobvar(name);
 
-    //usrvarmap[name.c_str()] = 0;
     LogStatus(stringf("New variable \"%s\"", name.c_str()).c_str());
-
-    //getnexttoken(); // Eat name
     
-    return std::make_unique<VariableExpr>(name.c_str());
+    return std::make_unique<VsetExpr>(std::make_unique<VariableExpr>(name.c_str()), std::move(E), useglob);
 }
 
 std::unique_ptr<ProtoExpr> ParsePrototype()
@@ -755,6 +954,12 @@ std::unique_ptr<ProtoExpr> ParsePrototype()
     {
         LogStatus("Found function variable");
         name = identstr;
+        if (vm.layoutids.count(name))
+        {
+            LogError(stringf("Function \"%s\" has the name of a record", name.c_str()).c_str());
+            return nullptr;
+        }
+        ScriptFunctions.insert(name);
         getnexttoken();
     } else
     {
@@ -770,17 +975,23 @@ std::unique_ptr<ProtoExpr> ParsePrototype()
     getnexttoken();
     std::vector<std::string> argnames = {};
     std::unordered_map<std::string, int> map;
+
+    // The name goes in the enclosing scope so the body can recurse,
+    // parameters get a scope of their own that ParseFunction closes
+    putvar("__function:"+name);
+    ScopeMap.push_back(map);
     
     while(curtok != ')')
     {
         if (curtok != tok_ident)
         {
             LogError("Expected identifier in prototype argument definitions");
+            ScopeMap.pop_back();
             return nullptr;
         }
         LogStatus(stringf("Function parameter: \"%s\"", identstr.c_str()).c_str());
         putvar(identstr);
-        //argnames.push_back(identstr);
+        argnames.push_back(identstr);
         //map[identstr] = 0;//std::make_unique<VariableExpr>(identstr);
         getnexttoken();
         
@@ -790,12 +1001,11 @@ std::unique_ptr<ProtoExpr> ParsePrototype()
         } else if (curtok != ',' && curtok != ')')
         {
             LogError(stringf("Expected ',' or ')' in prototype argument definitions, but got %i", curtok).c_str());
+            ScopeMap.pop_back();
             return nullptr;
         }
         getnexttoken();
     }
-    putvar("__function:"+name);
-    //ScopeMap.push_back(map);
     return std::make_unique<ProtoExpr>(name, argnames);
 }
 
@@ -804,16 +1014,19 @@ std::unique_ptr<Expr> ParseFunction()
     std::unique_ptr<ProtoExpr> P = ParsePrototype();
     std::unique_ptr<Expr> B;
 
+    if (!P)
+        return LogError("Function prototype is invalid, cannot proceed with function creation");
+
     getnexttoken();
-    if (curtok != '{' && !!P)
+    if (curtok != '{')
     {
         LogNote("Function has no scope");
-        //ScopeMap.pop_back();
+        ScopeMap.pop_back();
         return std::make_unique<FunctionExpr>(std::move(P), (std::unique_ptr<Expr>)nullptr);
-    } else if (!!P)
+    } else
     {
         B = ParseScope();
-        //ScopeMap.pop_back();
+        ScopeMap.pop_back();
         //if (B.size() != 0)
         {
             return std::make_unique<FunctionExpr>(std::move(P), std::move(B));
@@ -821,8 +1034,66 @@ std::unique_ptr<Expr> ParseFunction()
         LogError("Scope body is nullptr, proceeding with proto only");
         return std::make_unique<FunctionExpr>(std::move(P), (std::unique_ptr<Expr>)nullptr);
     }
+}
+
+// "record Name(field, ...)" declares a record type for the rest of the program, it makes no code
+std::unique_ptr<Expr> ParseRecord()
+{
+    getnexttoken(); // Eat "record"
+    if (curtok != tok_ident)
+        return LogError("Expected a name after \"record\"");
+    std::string name = identstr;
+    getnexttoken(); // Eat name
+    if (curtok != '(')
+        return LogError("Expected '(' after the name of a record");
+    getnexttoken(); // Eat '('
+    std::vector<std::string> fields;
+    while (curtok != ')')
+    {
+        if (curtok != tok_ident)
+            return LogError("Expected a field name in record declaration");
+        if (std::find(fields.begin(), fields.end(), identstr) != fields.end())
+            return LogError(stringf("Record \"%s\" has field \"%s\" twice", name.c_str(), identstr.c_str()).c_str());
+        fields.push_back(identstr);
+        getnexttoken(); // Eat field name
+        if (curtok != ',' && curtok != ')')
+            return LogError(stringf("Expected ',' or ')' in record declaration, but got token %i", curtok).c_str());
+        if (curtok == ',')
+            getnexttoken();
+    }
+    getnexttoken(); // Eat ')'
+    if (varexists("__function:"+name))
+        return LogError(stringf("Record \"%s\" has the name of a function", name.c_str()).c_str());
+    if (fields.size() > vtex::MAXREGS)
+        return LogError(stringf("Record \"%s\" has too many fields", name.c_str()).c_str());
+    if (vm.layouts.size() > vtex::MAXC)
+        return LogError("Too many record types");
+    if (vm.deflayout(name, fields) < 0)
+        return LogError(stringf("Redefinition of record \"%s\"", name.c_str()).c_str());
+    LogStatus(stringf("New record \"%s\"", name.c_str()).c_str());
+    return std::make_unique<NullExpr>();
+}
 
-    return LogError("Function prototype is invalid, cannot proceed with function creation");
+std::unique_ptr<Expr> ParseArray()
+{
+    getnexttoken(); // Eat '['
+
+    std::vector<uExpr> elements;
+    while (curtok != ']')
+    {
+        if (curtok == EOF)
+            return LogError("Array literal extends to EOF");
+        auto E = ParseExpression();
+        if (!E)
+            return LogError("Array element is null");
+        if (curtok != ',' && curtok != ']')
+            return LogError(stringf("Expected ',' or ']' in array literal, but got token %i", curtok).c_str());
+        elements.push_back(std::move(E));
+        if (curtok == ',')
+            getnexttoken();
+    }
+    getnexttoken(); // Eat ']'
+    return std::make_unique<ArrayExpr>(std::move(elements));
 }
 
 std::unique_ptr<Expr> ParsePrimary()
@@ -832,13 +1103,13 @@ std::unique_ptr<Expr> ParsePrimary()
         case tok_number:
         {
             auto V = vtex::Value( std::make_unique<vtex::LFloat>(strtold(numstr.c_str(), nullptr)) );
+            getnexttoken(); // Eat number
             return std::make_unique<ValueExpr>(std::move(V));
         }
             //return std::make_unique<ValueExpr>(vtex::Value( std::make_unique<vtex::LFloat>(strtold(numstr.c_str(), nullptr)) ) );
         case tok_string:
             {
                 auto S = std::make_unique<ValueExpr>(ParseString());
-                getnexttoken();
                 return std::move(S);
             }
         
@@ -846,10 +1117,24 @@ std::unique_ptr<Expr> ParsePrimary()
             return ParseIf();
         case tok_true:
         case tok_false:
+        case tok_nil:
         case tok_ident:
             return ParseIdentity();
         case tok_func:
             return ParseFunction();
+        case '[':
+            return ParseArray();
+        case '(':
+        {
+            getnexttoken(); // Eat '('
+            auto E = ParseExpression();
+            if (!E)
+                return nullptr;
+            if (curtok != ')')
+                return LogError("Expected ')' after parenthesized expression");
+            getnexttoken(); // Eat ')'
+            return E;
+        }
         case EOF:
             return nullptr;
         default:
@@ -857,9 +1142,48 @@ std::unique_ptr<Expr> ParsePrimary()
     }
 }
 
+// Subscripts and fields behind a primary, "a[i][j]", "r.x"
+std::unique_ptr<Expr> ParsePostfix(std::unique_ptr<Expr> E)
+{
+    while (!!E && (curtok == '[' || curtok == '.'))
+    {
+        if (curtok == '.')
+        {
+            getnexttoken(); // Eat '.'
+            if (curtok != tok_ident)
+                return LogError("Expected a field name after '.'");
+            E = std::make_unique<FieldExpr>(std::move(E), identstr);
+            getnexttoken(); // Eat field name
+            continue;
+        }
+        getnexttoken(); // Eat '['
+        auto I = ParseExpression();
+        if (!I)
+            return LogError("Array index expression is null");
+        if (curtok != ']')
+            return LogError("Expected ']' after array index");
+        getnexttoken(); // Eat ']'
+        E = std::make_unique<IndexExpr>(std::move(E), std::move(I));
+    }
+    return E;
+}
+
+std::unique_ptr<Expr> ParseUnary()
+{
+    if (curtok != tok_op || (opstr != "!" && opstr != "-"))
+        return ParsePostfix(ParsePrimary());
+
+    auto op = opstr;
+    getnexttoken(); // Eat unary operator
+    auto E = ParseUnary();
+    if (!E)
+        return LogError(stringf("Expected an expression after unary '%s'", op.c_str()).c_str());
+    return std::make_unique<UnopExpr>(op, std::move(E));
+}
+
 int GetBinopPrec(std::string op = opstr)
 {
-    for (const auto& [name, prec, pfn] : vtex::stdops)
+    for (const auto& [name, prec] : vtex::stdops)
     {
         if (name == op)
         {
@@ -875,40 +1199,30 @@ std::unique_ptr<Expr> ParseRHS(int Expected, std::unique_ptr<Expr> LHS)
 {
     while(true)
     {
-        if (curtok>=tok_number && curtok<tok_ident) // If unexpected token, just get rid of it
-        {
-            //LogStatus("HH");
-            getnexttoken(); // hi
-        }
-        //LogStatus(opstr.c_str());
+        // Every primary eats its own tokens, so anything but an operator ends the expression
+        if (curtok != tok_op)
+            return LHS;
         auto op = opstr;
         int Prec = GetBinopPrec();
-        if (Prec < Expected || blacklisted(curtok))
+        if (Prec < Expected)
         {
             return LHS;
         }
         
-        //op = "";
-        if (curtok == tok_op)
         getnexttoken(); // Eat binop
-        auto RHS = ParsePrimary();
+        auto RHS = ParseUnary();
         if (!RHS)
         {
             return LogNote("Right hand symbol (RHS) is null");
         }
-        //LogStatus(stringf("BRO %i", curtok));
-        getnexttoken();
-        //if (getnexttoken() != tok_op) // Eat the primary... NOT GOOD, DO NOT USE PLEASE
-        //    LogStatus(stringf("BRUH %i", curtok).c_str());
-        //LogStatus(stringf("supposedly an op: %i", curtok).c_str());
-        //op = opstr;
 
-        // If the next binop has more precedence, give it RHS with a higher expected precedence
-        int Next = GetBinopPrec();
+        // If the next binop has more precedence, give it RHS with a higher expected precedence.
+        // Assignments group to the right, so they also take a following assignment.
+        int Next = curtok == tok_op ? GetBinopPrec() : -1;
 
-        if (Prec < Next)
+        if (Prec < Next || (Prec == Next && vtex::assigns(op)))
         {
-            RHS = ParseRHS(Prec+1, std::move(RHS));
+            RHS = ParseRHS(vtex::assigns(op) ? Prec : Prec+1, std::move(RHS));
             if (!RHS)
             {
                 return LogError("Right hand symbol (RHS) is null");
@@ -917,10 +1231,8 @@ std::unique_ptr<Expr> ParseRHS(int Expected, std::unique_ptr<Expr> LHS)
                 LogStatus(stringf("Higher level RHS = %s", RHS->tostring().c_str()).c_str());
             }
         }
-        //LogStatus(stringf("RHS end at token: %i", curtok).c_str());
         // Git branch merge
         LHS = std::make_unique<BinopExpr>(op, std::move(LHS), std::move(RHS));
-        opstr = "";
     }
 }
 
@@ -929,7 +1241,7 @@ std::unique_ptr<Expr> ParseExpression()
     std::unique_ptr<Expr> LHS;
     std::unique_ptr<Expr> RHS;
 
-    LHS = ParsePrimary();
+    LHS = ParseUnary();
 
     if (!LHS)
     {
@@ -1021,6 +1333,12 @@ std::unique_ptr<Expr> ParseIdentity()
                 getnexttoken();
                 return std::move(B);
             }
+        case tok_nil:
+            {
+                auto N = std::make_unique<ValueExpr>(vtex::Value(std::make_unique<vtex::Type>()));
+                getnexttoken();
+                return std::move(N);
+            }
         case tok_ident:
             getnexttoken();
             break;
@@ -1030,8 +1348,22 @@ std::unique_ptr<Expr> ParseIdentity()
     switch(curtok)
     {
         case '(':
-            if (!varexists(("__function:"+lident)))
+            if (vm.layoutids.count(lident) && !varexists(lident))
+            {
+                int layout = vm.layoutids[lident];
+                auto C = ParseFcall(lident);
+                auto F = dynamic_cast<CalleeExpr*>(C.get());
+                if (!F)
+                    return nullptr;
+                if (F->args().size() > vm.layouts[layout]->ids.size())
+                    return LogError(stringf("Record \"%s\" has only %zu fields", lident.c_str(), vm.layouts[layout]->ids.size()).c_str());
+                return std::make_unique<RecordExpr>(layout, std::move(F->args()));
+            }
+            if (!callsfunction(lident))
             {
+                // Calls a function value held in a variable
+                if (varexists(lident))
+                    return ParseFcall(lident);
                 return LogError(stringf("Function name \"%s\" does not exist", ("__function:"+lident).c_str()).c_str());
             }
             LogStatus(stringf("Function call on variable \"%s\"", ("__function:"+lident).c_str()).c_str());
@@ -1039,6 +1371,9 @@ std::unique_ptr<Expr> ParseIdentity()
 
         default:
         {
+            // A function name on its own is the function as a value
+            if (callsfunction(lident))
+                return std::make_unique<VariableExpr>("__function:"+lident);
             if (!varexists(lident))
                 return LogError(stringf("Unknown identity \"%s\" in expression", lident.c_str()).c_str());
             /*for (const auto op : vtex::SetOps)
@@ -1124,10 +1459,21 @@ std::unique_ptr<Expr> ParseAny()
             return ParseIf();
         case tok_while:
             return ParseWhile();
+        case tok_for:
+            return ParseFor();
+        case tok_record:
+            return ParseRecord();
         case tok_break:
             getnexttoken();
             return make_unique<BreakExpr>();
         case tok_ident:
+        case tok_number:
+        case tok_string:
+        case tok_true:
+        case tok_false:
+        case tok_nil:
+        case '(':
+        case '[':
             return ParseExpression();
             //break;
         case tok_ret:
@@ -1138,13 +1484,8 @@ std::unique_ptr<Expr> ParseAny()
             return nullptr;
         case tok_op:
             {
-                if (opstr == "=")
-                {
-                    getnexttoken(); // Eat '='
-                    auto E = ParseExpression();
-                    //getnexttoken();
-                    return std::move(E);
-                }
+                if (opstr == "!" || opstr == "-")
+                    return ParseExpression();
             }
             //break;
         default:
@@ -1186,6 +1527,58 @@ uExpr ParseWhile()
     return std::move(WHILE);
 }
 
+// for (i = a, b) or for (i = a, b, step), i counts from a up to b like range(a, b, step) and only exists in the loop
+uExpr ParseFor()
+{
+    getnexttoken(); // Eat "for"
+
+    if (curtok != '(')
+        return LogError("Expected '(' after \"for\"");
+    getnexttoken(); // Eat "("
+
+    if (curtok != tok_ident)
+        return LogError("Expected the loop variable after \"for (\"");
+    std::string name = identstr;
+    getnexttoken(); // Eat name
+
+    if (curtok != tok_op || opstr != "=")
+        return LogError(stringf("Expected '=' after for loop variable \"%s\"", name.c_str()).c_str());
+    getnexttoken(); // Eat '='
+
+    // The bounds are parsed before the variable exists, like the initializer of "new"
+    uExpr Bounds[3] = {};
+    int n = 0;
+    while (n < 3)
+    {
+        Bounds[n] = ParseExpression();
+        if (!Bounds[n++])
+            return LogError("For loop bound expression is null");
+        if (curtok != ',')
+            break;
+        getnexttoken(); // Eat ","
+    }
+    if (n < 2)
+        return LogError("Expected ',' and the end of the for loop after its start");
+    if (curtok != ')')
+        return LogError("Expected ')' after the for loop bounds");
+    getnexttoken(); // Eat ")"
+    if (!Bounds[2])
+        Bounds[2] = std::make_unique<ValueExpr>(vtex::Value(std::make_unique<vtex::LFloat>(1)));
+
+    std::unordered_map<std::string, int> map;
+    ScopeMap.push_back(map);
+    putvar(name);
+    auto A = ParseAny();
+    ScopeMap.pop_back();
+    if (!A)
+        return LogError("For loop body is null");
+
+    auto FOR = make_unique<ForExpr>(std::make_unique<VariableExpr>(name.c_str()), std::move(Bounds[0]), std::move(Bounds[1]),
+        std::move(Bounds[2]), std::move(A));
+    LogStatus(FOR->tostring().c_str());
+    return std::move(FOR);
+}
+
 std::unique_ptr<Expr> ParseIf()
 {
     getnexttoken(); // Eat "if"
@@ -1219,6 +1612,10 @@ std::unique_ptr<Expr> ParseIf()
 
     unique_ptr<Expr> ELSE = nullptr;
 
+    // A body without braces leaves its ';' behind, "if (c) x; else y;"
+    while (curtok == tok_op && opstr == ";")
+        getnexttoken();
+
     if (curtok == tok_else)
     {
         getnexttoken(); // Eat "else"
@@ -1280,141 +1677,1666 @@ std::unique_ptr<Expr> ParseScope()
 #pragma endregion
 
 
-#pragma region "IR generator"
-std::string IR = "";
+#pragma region "Optimizer"
+
+// Replaces E with its folded form, if it has one
+uExpr Optimize(uExpr E)
+{
+    if (!E)
+        return E;
+    auto R = E->optimize();
+    if (!!R)
+        return R;
+    return E;
+}
+
+// Variables of the for loops around the expression being optimized that their bodies never assign or declare
+// again, see ForExpr::optimize. They always hold numbers.
+std::unordered_set<std::string> NumericVars;
+void ScanNames(Expr *E, Scan &s);
+
+// True if E always produces a number, so numeric identities are safe to apply
+bool IsNumeric(Expr *E)
+{
+    if (!E)
+        return false;
+    if (auto L = E->literal())
+        return L->type() == vtex::number;
+    if (auto V = dynamic_cast<VariableExpr*>(E))
+        return NumericVars.count(V->name()) > 0;
+    if (auto U = dynamic_cast<UnopExpr*>(E))
+        return U->Op == "-" && IsNumeric(U->E.get());
+    if (auto B = dynamic_cast<BinopExpr*>(E))
+    {
+        auto &op = B->Op;
+        if (op == "+" || op == "-" || op == "*" || op == "/" || op == "%")
+            return IsNumeric(B->LHS.get()) && IsNumeric(B->RHS.get());
+    }
+    return false;
+}
 
-vtex::opfunc FindOpFunction(std::string str)
+int BinopCode(const std::string &op);
+
+// Compile time evaluation of an operator on two literals, through the VM's own arith so the result
+// is what running it gives. Returns nullptr when the result is not a plain value, so the operation
+// is left for run time.
+vtex::uType Fold(const std::string &op, vtex::Type &L, vtex::Type &R)
 {
-    for (const auto& [name, prec, pfn] : vtex::stdops)
+    if (vtex::shortcircuits(op))
+    {
+        if (L.type() != vtex::boolean || R.type() != vtex::boolean)
+            return nullptr;
+        auto l = *(bool*)L.get(), r = *(bool*)R.get();
+        return std::make_unique<vtex::Boolean>(op == "&&" ? l && r : l || r);
+    }
+    int code = BinopCode(op);
+    if (code < 0)
+        return nullptr;
+    vtex::Heap heap;
+    vtex::Val v[2];
+    vtex::Type* T[2] = {&L, &R};
+    for (int s = 0; s < 2; ++s)
     {
-        if (name == str)
+        switch(T[s]->type())
         {
-            return pfn;
+            case vtex::number: v[s] = vtex::Val((double)*(long double*)T[s]->get()); break;
+            case vtex::boolean: v[s] = vtex::Val(*(bool*)T[s]->get()); break;
+            case vtex::string: v[s] = heap.string(*(std::string*)T[s]->get()); break;
+            default: return nullptr;
         }
     }
+    auto ret = vtex::arith(heap, (vtex::OpCode)code, v[0], v[1]);
+    switch(ret.tag)
+    {
+        case vtex::number: return std::make_unique<vtex::LFloat>(ret.n);
+        case vtex::boolean: return std::make_unique<vtex::Boolean>(ret.b);
+        case vtex::string: return std::make_unique<vtex::String>(vtex::tostr(ret));
+        default: return nullptr;
+    }
+}
+
+bool IsNumber(Expr *E, long double num)
+{
+    auto L = !!E ? E->literal() : nullptr;
+    return !!L && L->type() == vtex::number && *(long double*)L->get() == num;
+}
+
+uExpr UnopExpr::optimize()
+{
+    E = Optimize(std::move(E));
+    auto L = E->literal();
+    if (!L)
+        return nullptr;
+    if (Op == "!" && L->type() == vtex::boolean)
+        return std::make_unique<ValueExpr>(vtex::Value(std::make_unique<vtex::Boolean>(!*(bool*)L->get())));
+    if (Op == "-" && L->type() == vtex::number)
+        return std::make_unique<ValueExpr>(vtex::Value(std::make_unique<vtex::LFloat>(-*(long double*)L->get())));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> StringExpr::codegen()
+uExpr BinopExpr::optimize()
 {
+    if (vtex::assigns(Op))
+    {
+        // Never fold away the target of an assignment
+        RHS = Optimize(std::move(RHS));
+        return nullptr;
+    }
+    LHS = Optimize(std::move(LHS));
+    RHS = Optimize(std::move(RHS));
+    auto L = LHS->literal();
+    auto R = RHS->literal();
+
+    if (!!L && vtex::shortcircuits(Op))
+    {
+        // "false && x" and "true || x" never evaluate x
+        bool lv = vtex::truthy(*L);
+        if (lv != (Op == "&&"))
+            return std::make_unique<ValueExpr>(vtex::Value(std::make_unique<vtex::Boolean>(lv)));
+    }
+    if (!!L && !!R)
+    {
+        auto F = Fold(Op, *L, *R);
+        if (!!F)
+            return std::make_unique<ValueExpr>(vtex::Value(std::move(F)));
+        return nullptr;
+    }
+
+    // Identities, only when the other side is known to be a number. x + 0 is not one, -0 + 0 is 0.
+    if (((Op == "*" || Op == "/") && IsNumber(RHS.get(), 1)) || (Op == "-" && IsNumber(RHS.get(), 0)))
+    {
+        if (IsNumeric(LHS.get()))
+            return std::move(LHS);
+    }
+    if (Op == "*" && IsNumber(LHS.get(), 1) && IsNumeric(RHS.get()))
+        return std::move(RHS);
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> NumberExpr::codegen()
+uExpr VsetExpr::optimize()
 {
+    E = Optimize(std::move(E));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> BooleanExpr::codegen()
+uExpr BodyExpr::optimize()
 {
+    for (auto& h : Body)
+        h = Optimize(std::move(h));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> VariableExpr::codegen()
+uExpr ReturnExpr::optimize()
 {
-    if (!Val)
-        Val = std::make_unique<vtex::Value>(std::make_unique<vtex::Type>());
-    return std::move(Val);
+    Ret = Optimize(std::move(Ret));
+    return nullptr;
 }
 
-std::unique_ptr<vtex::Value> ValueExpr::codegen()
+uExpr IfExpr::optimize()
 {
-    return std::make_unique<vtex::Value>(std::move(Val));
+    Condition = Optimize(std::move(Condition));
+    Next = Optimize(std::move(Next));
+    Else = Optimize(std::move(Else));
+    auto L = !!Condition ? Condition->literal() : nullptr;
+    if (!L)
+        return nullptr;
+    // Constant condition, keep only the branch that runs
+    if (vtex::truthy(*L))
+        return !!Next ? std::move(Next) : std::make_unique<NullExpr>();
+    if (!!Else)
+        return std::move(Else);
+    return std::make_unique<NullExpr>();
 }
 
-std::unique_ptr<vtex::Value> BinopExpr::codegen()
+uExpr ElseExpr::optimize()
 {
-    auto OP = FindOpFunction(Op);
-    if (!!OP && !!LHS && !!RHS)
-    {
-        //LogStatus(stringf("%s(%s, %s)", Op.c_str(), LHS->tostring().c_str(), RHS->tostring().c_str()));
-        //if (!!d)
-        auto OR = OP(std::move(LHS->codegen()->val), *RHS->codegen()->val);
-        LogStatus(OR.tostring());
-        auto R = std::make_unique<vtex::Value>(std::make_unique<vtex::Type>(std::move(OR)));
-        LogStatus(R->tostring());
-        return std::move(R);
-        //LogStatus((OP(std::move(LHS->codegen()->val), *RHS->codegen()->val)).tostring());
-    }
+    Next = Optimize(std::move(Next));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> ProtoExpr::codegen()
+uExpr WhileExpr::optimize()
 {
+    Condition = Optimize(std::move(Condition));
+    Next = Optimize(std::move(Next));
+    auto L = !!Condition ? Condition->literal() : nullptr;
+    if (!!L && !vtex::truthy(*L))
+        return std::make_unique<NullExpr>();
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> BodyExpr::codegen()
-{
+uExpr ForExpr::optimize()
+{
+    Start = Optimize(std::move(Start));
+    Iters = Optimize(std::move(Iters));
+    Iter = Optimize(std::move(Iter));
+    auto name = ((VariableExpr*)Var.get())->name();
+    Scan s;
+    ScanNames(Next.get(), s);
+    bool numeric = !s.assigned.count(name) && !s.declared.count(name) && NumericVars.insert(name).second;
+    Next = Optimize(std::move(Next));
+    if (numeric)
+        NumericVars.erase(name);
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> FunctionExpr::codegen()
+uExpr FunctionExpr::optimize()
 {
+    // Parameters and locals of the function may take the names over
+    auto outer = std::move(NumericVars);
+    NumericVars.clear();
+    Body = Optimize(std::move(Body));
+    NumericVars = std::move(outer);
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> CalleeExpr::codegen()
+uExpr CalleeExpr::optimize()
 {
+    for (auto& uptr : Args)
+        uptr = Optimize(std::move(uptr));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> ReturnExpr::codegen()
+uExpr ArrayExpr::optimize()
 {
+    for (auto& E : Elements)
+        E = Optimize(std::move(E));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> IfExpr::codegen()
+uExpr IndexExpr::optimize()
 {
+    E = Optimize(std::move(E));
+    I = Optimize(std::move(I));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> ElseExpr::codegen()
+uExpr FieldExpr::optimize()
 {
+    E = Optimize(std::move(E));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> BreakExpr::codegen()
+uExpr RecordExpr::optimize()
 {
+    for (auto& E : Args)
+        E = Optimize(std::move(E));
     return nullptr;
 }
 
-std::unique_ptr<vtex::Value> WhileExpr::codegen()
+#pragma endregion // End optimizer region
+
+
+#pragma region "Capture analysis"
+
+void ScanNames(Expr *E, Scan &s)
 {
-    return nullptr;
+    if (!!E)
+        E->scan(s);
 }
 
-std::unique_ptr<vtex::Value> ForExpr::codegen()
+void VariableExpr::scan(Scan &s)
 {
-    return nullptr;
+    s.used.insert(Name);
+}
+
+void VsetExpr::scan(Scan &s)
+{
+    ScanNames(E.get(), s);
+    s.declared.insert(((VariableExpr*)Var.get())->name());
 }
 
+void UnopExpr::scan(Scan &s)
+{
+    ScanNames(E.get(), s);
+}
 
-#pragma endregion // End IR generator region
+void BinopExpr::scan(Scan &s)
+{
+    ScanNames(LHS.get(), s);
+    ScanNames(RHS.get(), s);
+    if (auto V = dynamic_cast<VariableExpr*>(LHS.get()); !!V && vtex::assigns(Op))
+        s.assigned.insert(V->name());
+}
+
+void BodyExpr::scan(Scan &s)
+{
+    for (auto& h : Body)
+        ScanNames(h.get(), s);
+}
 
+void ReturnExpr::scan(Scan &s)
+{
+    ScanNames(Ret.get(), s);
+}
 
-int compile()
+void IfExpr::scan(Scan &s)
 {
-    while(!BREAK)
+    ScanNames(Condition.get(), s);
+    ScanNames(Next.get(), s);
+    ScanNames(Else.get(), s);
+}
+
+void ElseExpr::scan(Scan &s)
+{
+    ScanNames(Next.get(), s);
+}
+
+void WhileExpr::scan(Scan &s)
+{
+    ScanNames(Condition.get(), s);
+    ScanNames(Next.get(), s);
+}
+
+void ForExpr::scan(Scan &s)
+{
+    for (auto E : {Start.get(), Iters.get(), Iter.get(), Next.get()})
+        ScanNames(E, s);
+    s.declared.insert(((VariableExpr*)Var.get())->name());
+}
+
+void FunctionExpr::scan(Scan &s)
+{
+    // Whatever the body uses and does not declare itself comes from the enclosing functions
+    Scan inner;
+    if (auto P = dynamic_cast<ProtoExpr*>(Proto.get()))
     {
-        auto U = ParseAny();
-        if (!!U)
-        U->codegen();
+        s.declared.insert("__function:"+P->name());
+        for (const auto& arg : P->params())
+            inner.declared.insert(arg);
     }
-    return 0;
+    ScanNames(Body.get(), inner);
+    for (auto names : {&inner.used, &inner.captured})
+        for (const auto& name : *names)
+            if (!inner.declared.count(name))
+                s.captured.insert(name);
+    for (const auto& name : inner.assigned)
+        if (!inner.declared.count(name))
+            s.assigned.insert(name);
 }
 
-int main(int argc, char* argv[])
+void CalleeExpr::scan(Scan &s)
 {
-    std::ifstream f("scripty.vtex");
-    std::stringstream stream;
-    stream << f.rdbuf();
+    s.used.insert(Fname);
+    s.calls = true;
+    for (auto& arg : Args)
+        ScanNames(arg.get(), s);
+}
 
-    newlevel(stream.str());
-    f.close();
+void ArrayExpr::scan(Scan &s)
+{
+    for (auto& E : Elements)
+        ScanNames(E.get(), s);
+}
+
+void IndexExpr::scan(Scan &s)
+{
+    ScanNames(E.get(), s);
+    ScanNames(I.get(), s);
+}
+
+void FieldExpr::scan(Scan &s)
+{
+    ScanNames(E.get(), s);
+}
+
+void RecordExpr::scan(Scan &s)
+{
+    for (auto& E : Args)
+        ScanNames(E.get(), s);
+}
+
+// Closures copy the variables they capture, only the ones something assigns get a box both sides share
+void FindBoxed(Expr *E, vtex::FuncState &fs)
+{
+    Scan s;
+    ScanNames(E, s);
+    for (const auto& name : s.captured)
+        if (s.assigned.count(name))
+            fs.boxed.insert(name);
+}
+
+#pragma endregion // End capture analysis region
+
+
+#pragma region "IR generator"
+// Fuse hot instruction pairs into superinstructions, off to profile the plain instruction stream
+#if defined(VTEX_SUPEROPS)
+const bool superops = true;
+#else
+const bool superops = false;
+#endif
+
+std::unique_ptr<Expr> LogError(vtex::FuncState &fs, const char* str)
+{
+    fprintf(stderr, "ERROR [Ln %zu]: %s\n", fs.line, str);
+    ErrorOccurred = true;
+    return nullptr;
+}
+
+// Slot of a global function in the VM's function table, resolved once here instead of by name at run time
+int FunctionSlot(vtex::FuncState &fs, const std::string &name)
+{
+    int slot = vm.functionslot(IsFunctionName(name) ? name.substr(11) : name);
+    if (slot > vtex::MAXBX)
+    {
+        LogError(fs, "Too many global functions");
+        return -1;
+    }
+    return slot;
+}
+
+// Key of a field name for GETFIELD and SETFIELD, it expects the offset the first record type
+// with the name has. Types that put the field elsewhere are searched at run time.
+int FieldKey(vtex::FuncState &fs, const std::string &name)
+{
+    auto id = vm.fieldids.find(name);
+    if (id == vm.fieldids.end())
+    {
+        LogError(fs, stringf("No record has a field \"%s\"", name.c_str()).c_str());
+        return 0;
+    }
+    int offset = 0;
+    for (auto &l : vm.layouts)
+    {
+        auto f = std::find(l->ids.begin(), l->ids.end(), id->second);
+        if (f != l->ids.end())
+        {
+            offset = (int)(f - l->ids.begin());
+            break;
+        }
+    }
+    int k = vm.fieldkey(id->second, offset);
+    if (k > vtex::MAXC)
+    {
+        LogError(fs, "Too many record fields");
+        return 0;
+    }
+    return k;
+}
+
+// Slot of a global variable, loads and stores index the VM's global table directly
+int GlobalSlot(vtex::FuncState &fs, const std::string &name)
+{
+    int slot = vm.globalslot(name);
+    if (slot > vtex::MAXBX)
+    {
+        LogError(fs, "Too many global variables");
+        return 0;
+    }
+    return slot;
+}
+
+// Generates E as a value. With dst set the value always ends up in dst.
+int Gen(Expr *E, vtex::FuncState &fs, int dst = -1)
+{
+    int r = !!E ? E->codegen(fs, dst) : -1;
+    if (r < 0)
+    {
+        // Statements used as values produce nil
+        r = dst >= 0 ? dst : fs.allocreg();
+        fs.emitABC(vtex::OP_LOADNIL, r);
+    } else if (dst >= 0 && r != dst)
+    {
+        fs.emitABC(vtex::OP_MOVE, dst, r);
+        r = dst;
+    }
+    return r;
+}
+
+// Generates E for its side effects, temporaries are released afterwards
+void GenStatement(Expr *E, vtex::FuncState &fs)
+{
+    if (!E)
+        return;
+    fs.line = E->Line;
+    auto B = dynamic_cast<BinopExpr*>(E);
+    if (!B || !B->update(fs))
+        E->codegen(fs, -1);
+    fs.freereg = fs.nactive();
+}
+
+// Register for the result of an operation, dst if the caller asked for one
+int Target(vtex::FuncState &fs, int dst)
+{
+    return dst >= 0 ? dst : fs.allocreg();
+}
+
+// dst when it is the newest register above the locals, which holds nothing yet. A call or an array
+// is built right in it then, without the MOVE that would mark the result as shared.
+int Scratch(vtex::FuncState &fs, int dst)
+{
+    return dst >= fs.nactive() && dst == fs.freereg - 1 ? dst : -1;
+}
+
+int BinopCode(const std::string &op)
+{
+    if (op == "+" || op == "+=") return vtex::OP_ADD;
+    if (op == "-" || op == "-=") return vtex::OP_SUB;
+    if (op == "*" || op == "*=") return vtex::OP_MUL;
+    if (op == "/" || op == "/=") return vtex::OP_DIV;
+    if (op == "%") return vtex::OP_MOD;
+    if (op == "==") return vtex::OP_EQ;
+    if (op == "!=") return vtex::OP_NE;
+    if (op == "<") return vtex::OP_LT;
+    if (op == "<=") return vtex::OP_LE;
+    if (op == ">") return vtex::OP_GT;
+    if (op == ">=") return vtex::OP_GE;
+    return -1;
+}
+
+// Constant index of a number or string literal, if it fits the C field of a superinstruction
+int ConstOperand(Expr *E, vtex::FuncState &fs)
+{
+    auto L = !!E && superops ? E->literal() : nullptr;
+    int k = -1;
+    if (!L)
+        return -1;
+    if (L->type() == vtex::number)
+        k = fs.numberk((double)*(long double*)L->get());
+    else if (L->type() == vtex::string)
+        k = fs.stringk(*(std::string*)L->get());
+    return k <= vtex::MAXC ? k : -1;
+}
+
+// Emits op a, b for ops with a constant second operand, falling back to a register op
+int GenBinop(vtex::FuncState &fs, int op, int dst, int l, Expr *RHS)
+{
+    int k = op <= vtex::OP_MOD ? ConstOperand(RHS, fs) : -1;
+    if (k >= 0)
+        return fs.emitABC((vtex::OpCode)(op - vtex::OP_ADD + vtex::OP_ADDK), dst, l, k);
+    auto save = fs.freereg;
+    int r = Gen(RHS, fs);
+    fs.freereg = save;
+    return fs.emitABC((vtex::OpCode)op, dst, l, r);
+}
+
+void Expr::condjump(vtex::FuncState &fs, bool cond, std::vector<int> &jumps)
+{
+    auto save = fs.freereg;
+    if (auto L = literal())
+    {
+        if (vtex::truthy(*L) == cond)
+            jumps.push_back(fs.emitjump(vtex::OP_JMP));
+        return;
+    }
+    int r = Gen(this, fs);
+    fs.freereg = save;
+    jumps.push_back(fs.emitjump(cond ? vtex::OP_JMPIF : vtex::OP_JMPIFNOT, r));
+}
+
+int StringExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int r = Target(fs, dst);
+    fs.emitABx(vtex::OP_LOADK, r, fs.stringk(Val.tostring()));
+    return r;
+}
+
+int NumberExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int r = Target(fs, dst);
+    fs.emitABx(vtex::OP_LOADK, r, fs.numberk((double)*(long double*)Val.get()));
+    return r;
+}
+
+int BooleanExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int r = Target(fs, dst);
+    fs.emitABC(vtex::OP_LOADBOOL, r, *(bool*)Val.get());
+    return r;
+}
+
+int VariableExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int l = fs.findlocal(Name);
+    if (l >= 0 && !fs.boxed.count(Name))
+    {
+        if (dst >= 0 && dst != l)
+            fs.emitABC(vtex::OP_MOVE, dst, l);
+        return dst >= 0 ? dst : l;
+    }
+    int r = Target(fs, dst);
+    if (l >= 0)
+    {
+        fs.emitABC(vtex::OP_GETBOX, r, l);
+        return r;
+    }
+    int u = fs.findupval(Name);
+    if (u >= 0)
+        fs.emitABC(fs.f->upvals[u].boxed ? vtex::OP_GETUPBOX : vtex::OP_GETUPVAL, r, u);
+    else if (IsFunctionName(Name))
+        fs.emitABx(vtex::OP_GETFUNC, r, std::max(FunctionSlot(fs, Name), 0));
+    else
+        fs.emitABx(vtex::OP_GETGLOBAL, r, GlobalSlot(fs, Name));
+    return r;
+}
+
+int VsetExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    auto name = ((VariableExpr*)Var.get())->name();
+    if (Global || fs.toplevel())
+    {
+        int r = !!E ? Gen(E.get(), fs) : Gen(nullptr, fs);
+        fs.emitABx(vtex::OP_SETGLOBAL, r, GlobalSlot(fs, name));
+        return r;
+    }
+    int r = fs.allocreg();
+    Gen(E.get(), fs, r);
+    if (fs.boxed.count(name))
+        fs.emitABC(vtex::OP_NEWBOX, r);
+    fs.addlocal(name, r);
+    return r;
+}
+
+int ValueExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    auto L = Val.val.get();
+    int r = Target(fs, dst);
+    switch(!!L ? L->type() : vtex::null)
+    {
+        case vtex::number:
+            fs.emitABx(vtex::OP_LOADK, r, fs.numberk((double)*(long double*)L->get()));
+            break;
+        case vtex::string:
+            fs.emitABx(vtex::OP_LOADK, r, fs.stringk(*(std::string*)L->get()));
+            break;
+        case vtex::boolean:
+            fs.emitABC(vtex::OP_LOADBOOL, r, *(bool*)L->get());
+            break;
+        default:
+            fs.emitABC(vtex::OP_LOADNIL, r);
+            break;
+    }
+    return r;
+}
+
+int UnopExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    auto save = fs.freereg;
+    int v = Gen(E.get(), fs);
+    fs.freereg = save;
+    int r = Target(fs, dst);
+    fs.emitABC(Op == "!" ? vtex::OP_NOT : vtex::OP_NEG, r, v);
+    return r;
+}
+
+void UnopExpr::condjump(vtex::FuncState &fs, bool cond, std::vector<int> &jumps)
+{
+    if (Op == "!" && !!E)
+        return E->condjump(fs, !cond, jumps);
+    Expr::condjump(fs, cond, jumps);
+}
+
+int BinopExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    if (!LHS || !RHS)
+        return -1;
+
+    if (vtex::shortcircuits(Op))
+    {
+        // Materialize the condition: the right hand side only runs when the left one doesnt decide it
+        std::vector<int> F;
+        condjump(fs, false, F);
+        int r = Target(fs, dst);
+        fs.emitABC(vtex::OP_LOADBOOL, r, 1);
+        int J = fs.emitjump(vtex::OP_JMP);
+        fs.patchhere(F);
+        fs.emitABC(vtex::OP_LOADBOOL, r, 0);
+        fs.patchhere(J);
+        return r;
+    }
+
+    if (vtex::assigns(Op))
+    {
+        if (auto I = dynamic_cast<IndexExpr*>(LHS.get()))
+            return I->assign(fs, Op, RHS.get(), dst);
+        if (auto F = dynamic_cast<FieldExpr*>(LHS.get()))
+            return F->assign(fs, Op, RHS.get(), dst);
+        auto V = dynamic_cast<VariableExpr*>(LHS.get());
+        if (!V)
+        {
+            LogError(fs, "Left side of an assignment must be a variable, an array element or a record field");
+            return -1;
+        }
+        auto name = V->name();
+        int l = fs.findlocal(name);
+        int u = l < 0 ? fs.findupval(name) : -1;
+        if ((l >= 0 && fs.boxed.count(name)) || u >= 0)
+        {
+            // Captured variables that get assigned live in a box shared with the closures
+            if (u >= 0 && !fs.f->upvals[u].boxed)
+            {
+                LogError(fs, stringf("Cannot assign captured variable \"%s\"", name.c_str()).c_str());
+                return -1;
+            }
+            int r;
+            if (Op == "=")
+                r = Gen(RHS.get(), fs, dst);
+            else
+            {
+                r = Target(fs, dst);
+                if (l >= 0)
+                    fs.emitABC(vtex::OP_GETBOX, r, l);
+                else
+                    fs.emitABC(vtex::OP_GETUPBOX, r, u);
+                GenBinop(fs, BinopCode(Op), r, r, RHS.get());
+            }
+            if (l >= 0)
+                fs.emitABC(vtex::OP_SETBOX, r, l);
+            else
+                fs.emitABC(vtex::OP_SETUPBOX, r, u);
+            return r;
+        }
+        if (Op == "=")
+        {
+            if (l >= 0)
+                return Gen(RHS.get(), fs, l);
+            int r = Gen(RHS.get(), fs, dst);
+            fs.emitABx(vtex::OP_SETGLOBAL, r, GlobalSlot(fs, name));
+            return r;
+        }
+        // Compound assignment updates the target register in place
+        if (l >= 0)
+        {
+            GenBinop(fs, BinopCode(Op), l, l, RHS.get());
+            return l;
+        }
+        int r = Target(fs, dst);
+        fs.emitABx(vtex::OP_GETGLOBAL, r, GlobalSlot(fs, name));
+        GenBinop(fs, BinopCode(Op), r, r, RHS.get());
+        fs.emitABx(vtex::OP_SETGLOBAL, r, GlobalSlot(fs, name));
+        return r;
+    }
+
+    int op = BinopCode(Op);
+    if (op < 0)
+    {
+        LogError(fs, stringf("Unknown operator \"%s\"", Op.c_str()).c_str());
+        return -1;
+    }
+    auto save = fs.freereg;
+    int l = Gen(LHS.get(), fs);
+    if (ConstOperand(RHS.get(), fs) >= 0 && op <= vtex::OP_MOD)
+    {
+        fs.freereg = save;
+        int t = Target(fs, dst);
+        GenBinop(fs, op, t, l, RHS.get());
+        return t;
+    }
+    int r = Gen(RHS.get(), fs);
+    fs.freereg = save;
+    int t = Target(fs, dst);
+    fs.emitABC((vtex::OpCode)op, t, l, r);
+    return t;
+}
+
+// x += e as a statement, on a global or a boxed variable. Its slot is updated by one instruction, which appends in
+// place to a string or array nothing else holds, instead of reading it into a register that shares it. Only when e
+// runs no code that could see x, since x is read after e then. Returns false for anything else.
+bool BinopExpr::update(vtex::FuncState &fs)
+{
+    auto V = dynamic_cast<VariableExpr*>(LHS.get());
+    if (Op != "+=" || !V || !RHS)
+        return false;
+    Scan s;
+    ScanNames(RHS.get(), s);
+    if (s.calls || !s.assigned.empty())
+        return false;
+    auto name = V->name();
+    int l = fs.findlocal(name);
+    int u = l < 0 ? fs.findupval(name) : -1;
+    if ((l >= 0 && !fs.boxed.count(name)) || (u >= 0 && !fs.f->upvals[u].boxed))
+        return false;
+    int r = Gen(RHS.get(), fs);
+    if (l >= 0)
+        fs.emitABC(vtex::OP_ADDBOX, r, l);
+    else if (u >= 0)
+        fs.emitABC(vtex::OP_ADDUPBOX, r, u);
+    else
+        fs.emitABx(vtex::OP_ADDGLOBAL, r, GlobalSlot(fs, name));
+    return true;
+}
+
+// Emits a fused compare and jump for a comparison, returns false for any other operator
+bool GenCompareJump(vtex::FuncState &fs, const std::string &Op, Expr *LHS, Expr *RHS, bool cond, std::vector<int> &jumps)
+{
+    int op = BinopCode(Op);
+    if (!superops || op < vtex::OP_EQ || op > vtex::OP_GE)
+        return false;
+    // a != b jumps when a == b does not
+    if (op == vtex::OP_NE)
+    {
+        op = vtex::OP_EQ;
+        cond = !cond;
+    }
+
+    auto save = fs.freereg;
+    int kr = ConstOperand(RHS, fs), kl = ConstOperand(LHS, fs);
+    if (kr >= 0 || kl >= 0)
+    {
+        // A constant on the left compares the other way round, k < x is x > k
+        static const vtex::OpCode right[] = {vtex::OP_JEQK, vtex::OP_JEQK, vtex::OP_JLTK, vtex::OP_JLEK, vtex::OP_JGTK, vtex::OP_JGEK};
+        static const vtex::OpCode left[] = {vtex::OP_JEQK, vtex::OP_JEQK, vtex::OP_JGTK, vtex::OP_JGEK, vtex::OP_JLTK, vtex::OP_JLEK};
+        int r = Gen(kr >= 0 ? LHS : RHS, fs);
+        fs.freereg = save;
+        fs.emitABC((kr >= 0 ? right : left)[op - vtex::OP_EQ], r, kr >= 0 ? kr : kl, cond);
+    } else
+    {
+        int l = Gen(LHS, fs);
+        int r = Gen(RHS, fs);
+        fs.freereg = save;
+        // a > b is b < a, a >= b is b <= a
+        if (op == vtex::OP_GT || op == vtex::OP_GE)
+        {
+            std::swap(l, r);
+            op = op == vtex::OP_GT ? vtex::OP_LT : vtex::OP_LE;
+        }
+        fs.emitABC(op == vtex::OP_EQ ? vtex::OP_JEQ : op == vtex::OP_LT ? vtex::OP_JLT : vtex::OP_JLE, l, r, cond);
+    }
+    jumps.push_back(fs.emitjump(vtex::OP_JMP));
+    return true;
+}
+
+void BinopExpr::condjump(vtex::FuncState &fs, bool cond, std::vector<int> &jumps)
+{
+    if (!LHS || !RHS)
+        return Expr::condjump(fs, cond, jumps);
+    if (!vtex::shortcircuits(Op))
+    {
+        if (!GenCompareJump(fs, Op, LHS.get(), RHS.get(), cond, jumps))
+            Expr::condjump(fs, cond, jumps);
+        return;
+    }
+
+    // "&&" jumping on false and "||" jumping on true jump straight from either side,
+    // the other two forms skip the right hand side when the left one decides
+    bool isand = Op == "&&";
+    if (isand != cond)
+    {
+        LHS->condjump(fs, cond, jumps);
+        RHS->condjump(fs, cond, jumps);
+    } else
+    {
+        std::vector<int> skip;
+        LHS->condjump(fs, !cond, skip);
+        RHS->condjump(fs, cond, jumps);
+        fs.patchhere(skip);
+    }
+}
+
+int ProtoExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    return -1;
+}
+
+int BodyExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    fs.openblock();
+    for (auto& h : Body)
+        GenStatement(h.get(), fs);
+    fs.closeblock();
+    return -1;
+}
+
+int FunctionExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    auto P = dynamic_cast<ProtoExpr*>(Proto.get());
+    if (!P)
+        return -1;
+    auto name = P->name();
+
+    // Named functions are bound like variables, into the function table at the top level. A local
+    // one exists before its body, the closure captures the register it is created in to recurse.
+    bool local = name != "__anon_function" && !fs.toplevel() && dst < 0 && fs.freereg == fs.nactive();
+    int r = Target(fs, dst);
+    if (local)
+        fs.addlocal("__function:"+name, r);
+
+    auto f = vm.newproto(name);
+    vtex::FuncState child(f, &fs, vm.heap);
+    child.line = Line;
+    FindBoxed(Body.get(), child);
+    for (const auto& arg : P->params())
+        child.addlocal(arg, child.allocreg());
+    f->nparams = child.nactive();
+    for (const auto& [arg, reg] : child.locals)
+        if (child.boxed.count(arg))
+            child.emitABC(vtex::OP_NEWBOX, reg);
+    if (!!Body)
+        GenStatement(Body.get(), child);
+    child.line = Line;
+    child.emitABC(vtex::OP_RET, 0, 0);
+    if (child.failed)
+        ErrorOccurred = true;
+
+    fs.f->protos.push_back(f);
+    fs.emitABx(vtex::OP_CLOSURE, r, (int)fs.f->protos.size()-1);
+    if (name != "__anon_function" && fs.toplevel())
+    {
+        int slot = FunctionSlot(fs, name);
+        if (slot >= 0)
+            fs.emitABx(vtex::OP_SETFUNC, r, slot);
+    }
+    return r;
+}
+
+Expr* FunctionExpr::returned(std::vector<std::string> &params)
+{
+    auto P = dynamic_cast<ProtoExpr*>(Proto.get());
+    auto B = dynamic_cast<BodyExpr*>(Body.get());
+    if (!P || !B || P->name() != "__anon_function" || B->statements().size() != 1)
+        return nullptr;
+    auto R = dynamic_cast<ReturnExpr*>(B->statements()[0].get());
+    if (!R || !R->value())
+        return nullptr;
+    params = P->params();
+    return R->value();
+}
+
+// Elements of an array literal that go in registers at once before they get appended
+const int ArrayChunk = 50;
+
+// The elements go in consecutive registers behind the array, returns the arrays register
+int ArrayExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int base = Scratch(fs, dst) >= 0 ? dst : fs.allocreg();
+    size_t n = Elements.size();
+    size_t e = 0;
+    do
+    {
+        size_t chunk = std::min(n - e, (size_t)ArrayChunk);
+        for (size_t c = 0; c < chunk; ++c)
+            Gen(Elements[e + c].get(), fs, fs.allocreg());
+        if (e == 0)
+            fs.emitABC(vtex::OP_NEWARRAY, base, (int)chunk, (int)std::min(n, (size_t)vtex::MAXC));
+        else
+            fs.emitABC(vtex::OP_APPEND, base, (int)chunk);
+        fs.freereg = base+1;
+        e += chunk;
+    } while (e < n);
+    if (dst >= 0 && dst != base)
+    {
+        fs.emitABC(vtex::OP_MOVE, dst, base);
+        fs.freereg = base;
+        return dst;
+    }
+    return base;
+}
+
+// An array local subscripted with the variable of a for loop counting through it
+bool Inside(vtex::FuncState &fs, int a, int i)
+{
+    return std::find(fs.inside.begin(), fs.inside.end(), std::make_pair(a, i)) != fs.inside.end();
+}
+
+int IndexExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    auto save = fs.freereg;
+    int a = Gen(E.get(), fs);
+    int i = Gen(I.get(), fs);
+    fs.freereg = save;
+    int r = Target(fs, dst);
+    fs.emitABC(Inside(fs, a, i) ? vtex::OP_GETELEM : vtex::OP_GETINDEX, r, a, i);
+    return r;
+}
+
+int IndexExpr::assign(vtex::FuncState &fs, const std::string &op, Expr *RHS, int dst)
+{
+    // The value goes through a fresh register, dst may be a local the array or index reads
+    int r = fs.allocreg();
+    auto save = fs.freereg;
+    int a = Gen(E.get(), fs);
+    int i = Gen(I.get(), fs);
+    bool inside = Inside(fs, a, i);
+    if (op == "=")
+        Gen(RHS, fs, r);
+    else
+    {
+        fs.emitABC(inside ? vtex::OP_GETELEM : vtex::OP_GETINDEX, r, a, i);
+        GenBinop(fs, BinopCode(op), r, r, RHS);
+    }
+    fs.emitABC(inside ? vtex::OP_SETELEM : vtex::OP_SETINDEX, a, i, r);
+    fs.freereg = save;
+    if (dst >= 0)
+    {
+        fs.emitABC(vtex::OP_MOVE, dst, r);
+        fs.freereg = r;
+        return dst;
+    }
+    return r;
+}
+
+std::string RecordExpr::tostring()
+{
+    std::string str = vm.layouts[Layout]->name+"(";
+    for (size_t a = 0; a < Args.size(); ++a)
+    {
+        if (a > 0)
+            str += ", ";
+        if (!!Args[a])
+            str += Args[a]->tostring();
+    }
+    return str+")";
+}
+
+// The fields go in consecutive registers behind the record like the elements of an array literal
+int RecordExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int base = Scratch(fs, dst) >= 0 ? dst : fs.allocreg();
+    size_t n = vm.layouts[Layout]->ids.size();
+    for (size_t f = 0; f < n; ++f)
+    {
+        int r = fs.allocreg();
+        if (f < Args.size())
+            Gen(Args[f].get(), fs, r);
+        else
+            fs.emitABC(vtex::OP_LOADNIL, r);
+    }
+    fs.emitABC(vtex::OP_NEWRECORD, base, (int)n, Layout);
+    fs.freereg = base+1;
+    if (dst >= 0 && dst != base)
+    {
+        fs.emitABC(vtex::OP_MOVE, dst, base);
+        fs.freereg = base;
+        return dst;
+    }
+    return base;
+}
+
+int FieldExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int k = FieldKey(fs, Name);
+    auto save = fs.freereg;
+    int a = Gen(E.get(), fs);
+    fs.freereg = save;
+    int r = Target(fs, dst);
+    fs.emitABC(vtex::OP_GETFIELD, r, a, k);
+    return r;
+}
+
+int FieldExpr::assign(vtex::FuncState &fs, const std::string &op, Expr *RHS, int dst)
+{
+    int k = FieldKey(fs, Name);
+    // The value goes through a fresh register, dst may be a local the record comes from
+    int r = fs.allocreg();
+    auto save = fs.freereg;
+    int a = Gen(E.get(), fs);
+    if (op == "=")
+        Gen(RHS, fs, r);
+    else
+    {
+        fs.emitABC(vtex::OP_GETFIELD, r, a, k);
+        GenBinop(fs, BinopCode(op), r, r, RHS);
+    }
+    fs.emitABC(vtex::OP_SETFIELD, a, k, r);
+    fs.freereg = save;
+    if (dst >= 0)
+    {
+        fs.emitABC(vtex::OP_MOVE, dst, r);
+        fs.freereg = r;
+        return dst;
+    }
+    return r;
+}
+
+// Pipelines: reduce() or collect() over a chain of map(), filter() and take() calls on range() or a collection
+// compile to one loop, without the sequences in between. Anonymous functions that return one expression are
+// inlined into the loop, other functions get called from it.
+
+// Whether a call goes to the built-in name, which nothing the script declared took over and no variable hides
+bool IsBuiltin(vtex::FuncState &fs, CalleeExpr *C, const char* name)
+{
+    if (C->name() != std::string("__function:") + name || ScriptFunctions.count(name) || vm.globalslots.count(name))
+        return false;
+    for (auto f = &fs; !!f; f = f->parent)
+        if (f->findlocal(name) >= 0)
+            return false;
+    return true;
+}
+
+bool IsRange(vtex::FuncState &fs, Expr *E)
+{
+    auto C = dynamic_cast<CalleeExpr*>(E);
+    return !!C && C->args().size() >= 1 && C->args().size() <= 3 && IsBuiltin(fs, C, "range");
+}
+
+// map(s, f) is a stage rather than a map of one key when f is a function or s a sequence
+bool IsStage(vtex::FuncState &fs, Expr *E)
+{
+    auto C = dynamic_cast<CalleeExpr*>(E);
+    if (!C || C->args().size() != 2)
+        return false;
+    if (IsBuiltin(fs, C, "filter") || IsBuiltin(fs, C, "take"))
+        return true;
+    if (!IsBuiltin(fs, C, "map"))
+        return false;
+    auto F = C->args()[1].get();
+    auto V = dynamic_cast<VariableExpr*>(F);
+    return !!dynamic_cast<FunctionExpr*>(F) || (!!V && IsFunctionName(V->name())) ||
+        IsStage(fs, C->args()[0].get()) || IsRange(fs, C->args()[0].get());
+}
+
+// reduce(s, f), reduce(s, f, init) or collect(s)
+bool IsPipeline(vtex::FuncState &fs, CalleeExpr *C)
+{
+    size_t n = C->args().size();
+    return ((n == 2 || n == 3) && IsBuiltin(fs, C, "reduce")) || (n == 1 && IsBuiltin(fs, C, "collect"));
+}
+
+// A function a pipeline applies, inlined or a value in a register
+struct Callback
+{
+    Expr* body = nullptr; // What it returns, with the parameters bound to registers
+    std::vector<std::string> params;
+    int reg = -1;
+};
+
+// Inlines E if it is an anonymous function returning an expression that assigns no variable, whose parameters
+// shadow no boxed local. Anything else is generated into a register.
+Callback GenCallback(vtex::FuncState &fs, Expr *E)
+{
+    Callback c;
+    auto F = dynamic_cast<FunctionExpr*>(E);
+    if (auto R = !!F ? F->returned(c.params) : nullptr)
+    {
+        Scan s;
+        ScanNames(R, s);
+        bool boxed = false;
+        for (const auto& p : c.params)
+            boxed |= fs.boxed.count(p) > 0;
+        if (s.assigned.empty() && !boxed)
+        {
+            c.body = R;
+            return c;
+        }
+    }
+    c.reg = Gen(E, fs, fs.allocreg());
+    return c;
+}
+
+// Applies c to the values of args and returns the register of the result. With jumps set a filter emits
+// jumps taken when the result is false instead and returns -1.
+int GenApply(vtex::FuncState &fs, Callback &c, std::vector<int> args, std::vector<int>* jumps = nullptr)
+{
+    if (!c.body)
+    {
+        int base = fs.allocreg();
+        fs.emitABC(vtex::OP_MOVE, base, c.reg);
+        for (int a : args)
+            fs.emitABC(vtex::OP_MOVE, fs.allocreg(), a);
+        fs.emitABC(vtex::OP_CALL, base, (int)args.size());
+        fs.freereg = base + 1;
+        if (!jumps)
+            return base;
+        jumps->push_back(fs.emitjump(vtex::OP_JMPIFNOT, base));
+        return -1;
+    }
+    // The parameters are locals in the registers of the arguments, the body assigns none of them
+    size_t n = fs.locals.size();
+    for (size_t p = 0; p < c.params.size(); ++p)
+    {
+        int r = p < args.size() ? args[p] : fs.allocreg();
+        if (p >= args.size())
+            fs.emitABC(vtex::OP_LOADNIL, r);
+        fs.addlocal(c.params[p], r);
+    }
+    int r = -1;
+    if (jumps)
+        c.body->condjump(fs, false, *jumps);
+    else
+        r = Gen(c.body, fs);
+    fs.locals.resize(n);
+    return r;
+}
+
+// Calls the hidden built-in name with the values of args, see lib_elements()
+int GenHidden(vtex::FuncState &fs, const std::string &name, std::vector<int> args)
+{
+    int slot = vm.functionslot(name);
+    int base = fs.allocreg();
+    bool g = superops && slot <= vtex::MAXC;
+    if (!g)
+        fs.emitABx(vtex::OP_GETFUNC, base, slot);
+    for (int a : args)
+        fs.emitABC(vtex::OP_MOVE, fs.allocreg(), a);
+    if (g)
+        fs.emitABC(vtex::OP_CALLG, base, (int)args.size(), slot);
+    else
+        fs.emitABC(vtex::OP_CALL, base, (int)args.size());
+    fs.freereg = base + 1;
+    return base;
+}
+
+// A register that is true while the calls still go to native functions. Only the library makes those, a function the
+// script declares after the calls were compiled takes their slot over.
+int GenNatives(vtex::FuncState &fs, const std::vector<CalleeExpr*> &calls)
+{
+    int slot = vm.functionslot("(natives)");
+    int base = fs.allocreg();
+    bool g = superops && slot <= vtex::MAXC;
+    if (!g)
+        fs.emitABx(vtex::OP_GETFUNC, base, slot);
+    for (auto C : calls)
+        fs.emitABx(vtex::OP_GETFUNC, fs.allocreg(), std::max(FunctionSlot(fs, C->name()), 0));
+    if (g)
+        fs.emitABC(vtex::OP_CALLG, base, (int)calls.size(), slot);
+    else
+        fs.emitABC(vtex::OP_CALL, base, (int)calls.size());
+    fs.freereg = base + 1;
+    return base;
+}
+
+// Jumps, appended to jumps, that are taken unless R[l] < R[r]
+void GenLessJump(vtex::FuncState &fs, int l, int r, std::vector<int> &jumps)
+{
+    if (superops)
+    {
+        fs.emitABC(vtex::OP_JLT, l, r, 0);
+        jumps.push_back(fs.emitjump(vtex::OP_JMP));
+        return;
+    }
+    int t = fs.allocreg();
+    fs.freereg = t;
+    fs.emitABC(vtex::OP_LT, t, l, r);
+    jumps.push_back(fs.emitjump(vtex::OP_JMPIFNOT, t));
+}
+
+void GenIncrement(vtex::FuncState &fs, int r)
+{
+    ValueExpr one(vtex::Value(std::make_unique<vtex::LFloat>(1)));
+    GenBinop(fs, vtex::OP_ADD, r, r, &one);
+}
+
+// The loop of a pipeline ending in T. Its result is built right in its register, which is nil when the
+// source can not be iterated or a take() count is not a number, like the built-ins return. When one of the
+// built-ins was declared over since, T is called for real instead.
+int GenPipeline(vtex::FuncState &fs, CalleeExpr *T, int dst)
+{
+    std::vector<CalleeExpr*> stages; // From the source on
+    Expr* src = T->args()[0].get();
+    while (IsStage(fs, src))
+    {
+        stages.insert(stages.begin(), (CalleeExpr*)src);
+        src = ((CalleeExpr*)src)->args()[0].get();
+    }
+    bool collect = T->args().size() == 1;
+    int r = Scratch(fs, dst) >= 0 ? dst : fs.allocreg();
+    std::vector<CalleeExpr*> calls = stages;
+    calls.push_back(T);
+    if (IsRange(fs, src))
+        calls.push_back((CalleeExpr*)src);
+    int declared = fs.emitjump(vtex::OP_JMPIFNOT, GenNatives(fs, calls));
+    fs.freereg = r + 1;
+    int slot = collect ? fs.allocreg() : -1; // Appended elements go right behind the array
+
+    // The elements are start + i*step for a range and es[i] of the array or vector a collection gives, i < n
+    int start = -1, step = -1, es = -1, n;
+    if (IsRange(fs, src))
+    {
+        auto &a = ((CalleeExpr*)src)->args();
+        start = fs.allocreg();
+        if (a.size() > 1)
+            Gen(a[0].get(), fs, start);
+        else
+            fs.emitABx(vtex::OP_LOADK, start, fs.numberk(0));
+        int end = Gen(a[a.size() > 1 ? 1 : 0].get(), fs, fs.allocreg());
+        step = fs.allocreg();
+        if (a.size() > 2)
+            Gen(a[2].get(), fs, step);
+        else
+            fs.emitABx(vtex::OP_LOADK, step, fs.numberk(1));
+        n = GenHidden(fs, "(trips)", {start, end, step});
+        if (a.size() < 3)
+            step = -1;
+    } else
+    {
+        int c = Gen(src, fs, fs.allocreg());
+        es = GenHidden(fs, "(elements)", {c});
+        n = GenHidden(fs, "(len)", {es});
+    }
+
+    // The functions and counts of the stages and the reduction, in the order the calls would evaluate them
+    std::vector<Callback> fns(stages.size());
+    std::vector<int> counts(stages.size(), -1), taken(stages.size(), -1);
+    for (size_t s = 0; s < stages.size(); ++s)
+    {
+        auto &a = stages[s]->args();
+        if (IsBuiltin(fs, stages[s], "take"))
+        {
+            counts[s] = Gen(a[1].get(), fs, fs.allocreg());
+            taken[s] = fs.allocreg();
+            fs.emitABx(vtex::OP_LOADK, taken[s], fs.numberk(0));
+        } else
+            fns[s] = GenCallback(fs, a[1].get());
+    }
+    Callback f;
+    int started = -1; // Set once the first element started a reduce() without init
+    if (collect)
+        fs.emitABC(vtex::OP_NEWARRAY, r, 0, 0);
+    else
+    {
+        f = GenCallback(fs, T->args()[1].get());
+        if (T->args().size() == 3)
+            Gen(T->args()[2].get(), fs, r);
+        else
+        {
+            started = fs.allocreg();
+            fs.emitABC(vtex::OP_LOADNIL, r);
+            fs.emitABC(vtex::OP_LOADBOOL, started, 0);
+        }
+    }
+    int i = fs.allocreg();
+    fs.emitABx(vtex::OP_LOADK, i, fs.numberk(0));
+    std::vector<int> bad = {fs.emitjump(vtex::OP_JMPIFNOT, n)};
+    // take() of a count that is not a number is nil as well
+    for (size_t s = 0; s < stages.size(); ++s)
+        if (counts[s] >= 0)
+        {
+            bad.push_back(fs.emitjump(vtex::OP_JMPIFNOT, GenHidden(fs, "(count)", {counts[s]})));
+            fs.freereg = i + 1;
+        }
+    int x = fs.allocreg();
+    int temps = fs.freereg;
+
+    // Every take still lets elements through and there is one more, x
+    int top = fs.here();
+    std::vector<int> exits, next;
+    for (size_t s = 0; s < stages.size(); ++s)
+        if (counts[s] >= 0)
+            GenLessJump(fs, taken[s], counts[s], exits);
+    GenLessJump(fs, i, n, exits);
+    if (es >= 0)
+        fs.emitABC(vtex::OP_GETINDEX, x, es, i);
+    else if (step < 0)
+        fs.emitABC(vtex::OP_ADD, x, start, i);
+    else
+    {
+        fs.emitABC(vtex::OP_MUL, x, i, step);
+        fs.emitABC(vtex::OP_ADD, x, start, x);
+    }
+    GenIncrement(fs, i);
+
+    int e = x;
+    for (size_t s = 0; s < stages.size(); ++s)
+    {
+        if (counts[s] >= 0)
+            GenIncrement(fs, taken[s]);
+        else if (IsBuiltin(fs, stages[s], "map"))
+            e = GenApply(fs, fns[s], {e});
+        else
+        {
+            GenApply(fs, fns[s], {e}, &next);
+            fs.freereg = std::max(e + 1, temps);
+        }
+    }
+    if (collect)
+    {
+        if (e != slot)
+            fs.emitABC(vtex::OP_MOVE, slot, e);
+        fs.emitABC(vtex::OP_APPEND, r, 1);
+    } else
+    {
+        if (started >= 0)
+        {
+            // The first element is where a reduce() without init starts
+            int later = fs.emitjump(vtex::OP_JMPIF, started);
+            fs.emitABC(vtex::OP_MOVE, r, e);
+            fs.emitABC(vtex::OP_LOADBOOL, started, 1);
+            next.push_back(fs.emitjump(vtex::OP_JMP));
+            fs.patchhere(later);
+        }
+        int v = GenApply(fs, f, {r, e});
+        if (v != r)
+            fs.emitABC(vtex::OP_MOVE, r, v);
+    }
+    fs.patchhere(next);
+    fs.freereg = temps;
+    fs.emitloop(top);
+    fs.patchhere(exits);
+    std::vector<int> done = {fs.emitjump(vtex::OP_JMP)};
+    fs.patchhere(bad);
+    fs.emitABC(vtex::OP_LOADNIL, r);
+    done.push_back(fs.emitjump(vtex::OP_JMP));
+    fs.patchhere(declared);
+    fs.freereg = r + 1;
+    T->call(fs, false, r);
+    fs.patchhere(done);
+
+    fs.freereg = r+1;
+    if (dst >= 0 && dst != r)
+    {
+        fs.emitABC(vtex::OP_MOVE, dst, r);
+        fs.freereg = r;
+        return dst;
+    }
+    return r;
+}
+
+// Callee and arguments go in consecutive registers at the top of the frame, returns the callees register
+int CalleeExpr::call(vtex::FuncState &fs, bool tail, int at)
+{
+    int base = at >= 0 ? at : fs.allocreg();
+    int l = fs.findlocal(Fname);
+    int u = l < 0 ? fs.findupval(Fname) : -1;
+    bool global = l < 0 && u < 0;
+    int slot = global && IsFunctionName(Fname) ? FunctionSlot(fs, Fname) : -1;
+    // A global function in a slot small enough to encode is loaded by CALLG itself
+    int g = superops && !tail && slot <= vtex::MAXC ? slot : -1;
+    if (l >= 0)
+        fs.emitABC(fs.boxed.count(Fname) ? vtex::OP_GETBOX : vtex::OP_MOVE, base, l);
+    else if (u >= 0)
+        fs.emitABC(fs.f->upvals[u].boxed ? vtex::OP_GETUPBOX : vtex::OP_GETUPVAL, base, u);
+    else if (!IsFunctionName(Fname))
+        fs.emitABx(vtex::OP_GETGLOBAL, base, GlobalSlot(fs, Fname));
+    else if (g < 0)
+        fs.emitABx(vtex::OP_GETFUNC, base, std::max(slot, 0));
+    for (auto& arg : Args)
+        Gen(arg.get(), fs, fs.allocreg());
+    if (Args.size() > vtex::MAXREGS)
+    {
+        LogError(fs, "Too many arguments in function call");
+        return -1;
+    }
+    if (!tail && !fs.toplevel() && Fname == "__function:"+fs.f->name)
+        fs.f->selfcalls.push_back((int)fs.f->code.size());
+    if (tail)
+        fs.emitABC(vtex::OP_TAILCALL, base, (int)Args.size());
+    else if (g >= 0)
+        fs.emitABC(vtex::OP_CALLG, base, (int)Args.size(), g);
+    else
+        fs.emitABC(vtex::OP_CALL, base, (int)Args.size());
+    fs.freereg = base+1;
+    return base;
+}
+
+int CalleeExpr::tailcall(vtex::FuncState &fs)
+{
+    // A pipeline is a loop, not a call
+    if (IsPipeline(fs, this))
+    {
+        int r = GenPipeline(fs, this, -1);
+        fs.emitABC(vtex::OP_RET, r, 1);
+        fs.freereg = r;
+        return r;
+    }
+    int base = call(fs, true);
+    if (base >= 0)
+        fs.freereg = base;
+    return base;
+}
+
+int CalleeExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    if (IsPipeline(fs, this))
+        return GenPipeline(fs, this, dst);
+    int base = call(fs, false, Scratch(fs, dst));
+    if (base < 0)
+        return -1;
+    if (dst >= 0 && dst != base)
+    {
+        fs.emitABC(vtex::OP_MOVE, dst, base);
+        fs.freereg = base;
+        return dst;
+    }
+    return base;
+}
+
+int ReturnExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    if (!Ret)
+    {
+        fs.emitABC(vtex::OP_RET, 0, 0);
+        return -1;
+    }
+    // return f(...) reuses the frame, so recursion through tail calls runs in constant stack
+    if (auto callee = dynamic_cast<CalleeExpr*>(Ret.get()))
+    {
+        callee->tailcall(fs);
+        return -1;
+    }
+    int r = Gen(Ret.get(), fs);
+    fs.emitABC(vtex::OP_RET, r, 1);
+    return -1;
+}
+
+int IfExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    std::vector<int> F;
+    if (!!Condition)
+        Condition->condjump(fs, false, F);
+    GenStatement(Next.get(), fs);
+    if (!!Else)
+    {
+        int J = fs.emitjump(vtex::OP_JMP);
+        fs.patchhere(F);
+        GenStatement(Else.get(), fs);
+        fs.patchhere(J);
+    } else
+        fs.patchhere(F);
+    return -1;
+}
+
+int ElseExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    GenStatement(Next.get(), fs);
+    return -1;
+}
+
+int BreakExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    if (fs.breaks.empty())
+    {
+        LogError(fs, "\"break\" outside of a loop");
+        return -1;
+    }
+    fs.breaks.back().push_back(fs.emitjump(vtex::OP_JMP));
+    return -1;
+}
+
+int WhileExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    int top = fs.here();
+    std::vector<int> F;
+    if (!!Condition)
+        Condition->condjump(fs, false, F);
+    fs.breaks.push_back({});
+    GenStatement(Next.get(), fs);
+    fs.emitloop(top);
+    fs.patchhere(F);
+    fs.patchhere(fs.breaks.back());
+    fs.breaks.pop_back();
+    return -1;
+}
+
+bool IsWhole(Expr *E, long double min)
+{
+    auto L = !!E ? E->literal() : nullptr;
+    if (!L || L->type() != vtex::number)
+        return false;
+    auto n = *(long double*)L->get();
+    return n >= min && n == floorl(n);
+}
+
+int ForExpr::inside(vtex::FuncState &fs, const std::string &name)
+{
+    // for (i = a, len(x), step) with whole numbers a >= 0 and step > 0 counts through x while nothing changes x or i.
+    // Scripts can still take len over later, so GETELEM and SETELEM compare i with the length anyway.
+    auto C = dynamic_cast<CalleeExpr*>(Iters.get());
+    if (!IsWhole(Start.get(), 0) || !IsWhole(Iter.get(), 1) || !C || C->args().size() != 1 || !IsBuiltin(fs, C, "len"))
+        return -1;
+    auto V = dynamic_cast<VariableExpr*>(C->args()[0].get());
+    if (!V || fs.boxed.count(V->name()))
+        return -1;
+    Scan s;
+    ScanNames(Next.get(), s);
+    if (s.assigned.count(V->name()) || s.assigned.count(name))
+        return -1;
+    return fs.findlocal(V->name());
+}
+
+// R[A] counts the trips, R[A+1] holds the end and then the number of trips, R[A+2] the start and R[A+3] the step.
+// The loop variable in R[A+4] is a number the loop sets from them on every trip, assigning it does not change the
+// count. Only a closure sharing it gets a box of its own per trip.
+int ForExpr::codegen(vtex::FuncState &fs, int dst)
+{
+    auto name = ((VariableExpr*)Var.get())->name();
+    fs.openblock();
+    int A = fs.nactive();
+    for (int r = 0; r < 5; ++r)
+        fs.allocreg();
+    Gen(Start.get(), fs, A + 2);
+    Gen(Iters.get(), fs, A + 1);
+    Gen(Iter.get(), fs, A + 3);
+    fs.freereg = A + 5;
+    int arr = inside(fs, name);
+    bool boxed = fs.boxed.count(name) > 0;
+    for (auto hidden : {"(for count)", "(for end)", "(for start)", "(for step)"})
+        fs.addlocal(hidden, fs.nactive());
+    fs.addlocal(boxed ? "(for variable)" : name, A + 4);
+
+    fs.line = Iter->Line;
+    int prep = fs.emitjump(vtex::OP_FORPREP, A);
+    int top = fs.here();
+    if (boxed)
+    {
+        int r = fs.allocreg();
+        fs.emitABC(vtex::OP_MOVE, r, A + 4);
+        fs.emitABC(vtex::OP_NEWBOX, r);
+        fs.addlocal(name, r);
+    }
+    // x[i] only compares i with the length in the loop, see IndexExpr
+    if (arr >= 0 && !boxed)
+        fs.inside.push_back({arr, A + 4});
+    fs.breaks.push_back({});
+    GenStatement(Next.get(), fs);
+    int loop = fs.emitjump(vtex::OP_FORLOOP, A);
+    fs.patch(loop, top);
+    if (arr >= 0 && !boxed)
+    {
+        // Unless something the loop calls could shrink the array
+        fs.inside.pop_back();
+        auto &code = fs.f->code;
+        bool calls = false;
+        for (int pc = top; pc < loop; ++pc)
+            calls |= vtex::GetOp(code[pc]) == vtex::OP_CALL || vtex::GetOp(code[pc]) == vtex::OP_CALLG || vtex::GetOp(code[pc]) == vtex::OP_TAILCALL;
+        for (int pc = top; pc < loop && calls; ++pc)
+        {
+            auto i = code[pc];
+            if (vtex::GetOp(i) == vtex::OP_GETELEM && vtex::GetB(i) == arr && vtex::GetC(i) == A + 4)
+                code[pc] = vtex::MakeABC(vtex::OP_GETINDEX, vtex::GetA(i), arr, A + 4);
+            else if (vtex::GetOp(i) == vtex::OP_SETELEM && vtex::GetA(i) == arr && vtex::GetB(i) == A + 4)
+                code[pc] = vtex::MakeABC(vtex::OP_SETINDEX, arr, A + 4, vtex::GetC(i));
+        }
+    }
+    fs.patchhere(prep);
+    fs.patchhere(fs.breaks.back());
+    fs.breaks.pop_back();
+    fs.closeblock();
+    return -1;
+}
+
+#pragma endregion // End IR generator region
+
+
+vtex::Proto* compile()
+{
+    auto f = vm.newproto("__main");
+    vtex::FuncState fs(f, nullptr, vm.heap);
+    while(!BREAK)
+    {
+        auto U = Optimize(ParseAny());
+        if (!!U)
+        {
+            LogStatus(stringf("Optimized: %s", U->tostring().c_str()));
+            FindBoxed(U.get(), fs);
+            GenStatement(U.get(), fs);
+        }
+    }
+    fs.line = line;
+    fs.emitABC(vtex::OP_RET, 0, 0);
+    if (fs.failed)
+        ErrorOccurred = true;
+    return f;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = argc > 1 ? argv[1] : "scripty.vtex";
+    std::ifstream f(path);
+    if (!f.is_open())
+    {
+        fprintf(stderr, "Could not open \"%s\"\n", path);
+        return -1;
+    }
+    std::stringstream stream;
+    stream << f.rdbuf();
+
+    newlevel(stream.str());
+    f.close();
+
+    vtex::openlibs(vm);
     
     auto start = c::high_resolution_clock::now();
-    compile();
+    auto main = compile();
     auto end = c::high_resolution_clock::now();
     if (ErrorOccurred)
     {
@@ -1429,6 +3351,78 @@ int main(int argc, char* argv[])
 
     if (ErrorOccurred)
     return -1;
+
+    if (verbose)
+        vtex::Disassemble(main);
+
+    #if defined(VTEX_TIERS)
+    // A threshold of 0 turns the tier off
+    if (auto threshold = getenv("VTEX_BASELINE_THRESHOLD"))
+        vm.baselinethreshold = atol(threshold) > 0 ? (uint32_t)atol(threshold) : UINT32_MAX;
+    if (auto threshold = getenv("VTEX_JIT_THRESHOLD"))
+        vm.jitthreshold = atol(threshold) > 0 ? (uint32_t)atol(threshold) : UINT32_MAX;
+    #endif
+
+    // Collector tuning: nursery size, a hard limit on the old generation and how far it may grow between major collections
+    if (auto kb = getenv("VTEX_NURSERY_KB"))
+        vm.heap.nurserysize = (size_t)atol(kb) << 10;
+    if (auto mb = getenv("VTEX_HEAP_LIMIT_MB"))
+        vm.heap.heaplimit = (size_t)atol(mb) << 20;
+    if (auto kb = getenv("VTEX_GC_MIN_KB"))
+        vm.heap.minheap = (size_t)atol(kb) << 10;
+    if (auto growth = getenv("VTEX_GC_GROWTH"))
+        vm.heap.growth = atof(growth) > 1 ? atof(growth) : vm.heap.growth;
+    // Major collections run in slices of this many microseconds, 0 runs each at once
+    if (auto slice = getenv("VTEX_GC_SLICE_US"))
+        vm.heap.slice = atof(slice);
+    #if defined(VTEX_GC_THREAD)
+    vm.heap.background = getenv("VTEX_GC_BACKGROUND") && atoi(getenv("VTEX_GC_BACKGROUND")) > 0;
+    #endif
+
+    // VTEX_SIMD=scalar or sse2 keeps the array kernels below what the CPU has
+    if (auto simd = getenv("VTEX_SIMD"))
+    {
+        for (auto l : {vtex::simd::scalar, vtex::simd::sse2})
+            if (!strcmp(simd, vtex::simd::levelname(l)) && l < vtex::simd::level)
+                vtex::simd::level = l;
+    }
+
+    start = c::high_resolution_clock::now();
+    bool ok = vm.run(main);
+    end = c::high_resolution_clock::now();
+    fprintf(stderr, "Run time took %0.2fus\n", c::duration<float, c::microseconds::period>(end-start).count());
+    // VTEX_RECURSION_REPORT=<calls> lists non tail recursive calls in functions called that often
+    if (auto report = getenv("VTEX_RECURSION_REPORT"))
+        vm.reportrecursion(atol(report) > 0 ? (uint64_t)atol(report) : 1);
+    if (getenv("VTEX_GC_STATS"))
+    {
+        auto &mem = vm.heap.memory();
+        fprintf(stderr, "GC: %zu minor (longest %0.2fus), %zu major in %zu slices (longest %0.2fus), %zu KB promoted, %zu KB old, %0.2fus total\n",
+            vm.heap.stats.minors, vm.heap.stats.minormax, vm.heap.stats.majors, vm.heap.stats.slices, vm.heap.stats.slicemax,
+            vm.heap.stats.promoted >> 10, vm.heap.oldbytes >> 10, vm.heap.stats.total);
+        fprintf(stderr, "Old generation: %zu allocations (%zu from free lists, %zu large), %zu frees, %zu KB in use of %zu KB in slabs\n",
+            mem.stats.allocs, mem.stats.reused, mem.stats.large, mem.stats.frees, mem.stats.inuse >> 10, mem.reserved() >> 10);
+    }
+    #if defined(VTEX_COUNT_OPS) || defined(VTEX_PROFILE_PAIRS)
+    fprintf(stderr, "Executed %llu instructions\n", (unsigned long long)vm.executed);
+    #endif
+    #if defined(VTEX_BASELINE)
+    fprintf(stderr, "Template compiled %zu functions\n", vm.baselined);
+    #endif
+    #if defined(VTEX_JIT)
+    fprintf(stderr, "JIT compiled %zu functions, %zu deoptimizations\n", vm.jitted, vm.deopts);
+    #endif
+    #if defined(VTEX_PROFILE_PAIRS)
+    auto profile = getenv("VTEX_PAIRS_OUT");
+    if (FILE* out = fopen(!!profile ? profile : "pairs.prof", "a"))
+    {
+        vm.dumppairs(out);
+        fclose(out);
+    }
+    #endif
+
+    if (!ok)
+    return -1;
     
     return 0;
 }
@@ -0,0 +1,722 @@
+#pragma once
+
+// Second tier of the Vjit build. Functions that got hot in the interpreter are translated from
+// bytecode to LLVM IR and compiled with the ORC JIT in JIT.h. The parameter types recorded by the
+// interpreter become guards at the entry, every operation has a fast path for numbers, and a failed
+// guard writes the registers back to the frame and lets the interpreter carry on from there.
+// Loops that got hot while their function was running are entered at their header instead,
+// guarded on the register types seen there.
+
+#include "IR.h"
+#include "JIT.h"
+#include "runtime.h"
+#include "vm.h"
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace vtex
+{
+    // Compiled code reads and writes registers by offset
+    static_assert(sizeof(Val) == 16 && offsetof(Val, tag) == 0 && offsetof(Val, n) == 8, "Unexpected Val layout");
+
+    namespace jit
+    {
+        // Runtime entry points of compiled code, everything that is not plain number crunching
+        inline void share(Obj* o)
+        {
+            o->shared = true;
+        }
+
+        class Compiler
+        {
+            VM &vm;
+            Proto* p;
+            llvm::LLVMContext &ctx;
+            llvm::Module &mod;
+            llvm::IRBuilder<> b;
+            llvm::Function* fn = nullptr;
+            llvm::Value* vmptr = nullptr;
+            llvm::Value* base = nullptr;
+            std::vector<llvm::AllocaInst*> tags; // Every register is a tag and the raw bits of its payload
+            std::vector<llvm::AllocaInst*> bits;
+            std::vector<llvm::BasicBlock*> blocks; // One per instruction, simplifycfg merges them
+
+            llvm::Type* i32() {return b.getInt32Ty();}
+            llvm::Type* i64() {return b.getInt64Ty();}
+            llvm::Type* f64() {return b.getDoubleTy();}
+            llvm::Value* tagk(int tag) {return b.getInt32(tag);}
+
+            // Address of the tag or payload of register r in the frame
+            llvm::Value* slot(int r, bool payload, llvm::Type* t)
+            {
+                auto at = b.CreateConstInBoundsGEP1_64(b.getInt8Ty(), base, (int64_t)r * (int64_t)sizeof(Val) + (payload ? 8 : 0));
+                return b.CreateBitCast(at, t->getPointerTo());
+            }
+            // Address of the tag or payload of a global variable, the table does not move while code runs
+            llvm::Value* global(int g, bool payload, llvm::Type* t)
+            {
+                return b.CreateIntToPtr(b.getInt64((uint64_t)&vm.globals[g] + (payload ? 8 : 0)), t->getPointerTo());
+            }
+            llvm::Value* tag(int r) {return b.CreateLoad(i32(), tags[r]);}
+            llvm::Value* num(int r) {return b.CreateBitCast(b.CreateLoad(i64(), bits[r]), f64());}
+            void set(int r, llvm::Value* tag, llvm::Value* payload)
+            {
+                b.CreateStore(tag, tags[r]);
+                b.CreateStore(payload->getType()->isDoubleTy() ? b.CreateBitCast(payload, i64()) : payload, bits[r]);
+            }
+            void setnum(int r, llvm::Value* n) {set(r, tagk(number), n);}
+            void setbool(int r, llvm::Value* c) {set(r, tagk(boolean), b.CreateZExt(c, i64()));}
+
+            void load(int r)
+            {
+                set(r, b.CreateLoad(i32(), slot(r, false, i32())), b.CreateLoad(i64(), slot(r, true, i64())));
+            }
+            void spill(int r)
+            {
+                b.CreateStore(tag(r), slot(r, false, i32()));
+                b.CreateStore(b.CreateLoad(i64(), bits[r]), slot(r, true, i64()));
+            }
+
+            // A collection may move objects, registers holding one get their payload back from the frame
+            void reload(int r)
+            {
+                auto t = tag(r);
+                set(r, t, b.CreateSelect(isobj(t), b.CreateLoad(i64(), slot(r, true, i64())), b.CreateLoad(i64(), bits[r])));
+            }
+
+            llvm::Value* isnum(int r) {return b.CreateICmpEQ(tag(r), tagk(number));}
+            llvm::Value* isobj(llvm::Value* t) {return b.CreateOr(b.CreateICmpEQ(t, tagk(string)), b.CreateICmpSGE(t, tagk(function)));}
+            llvm::Value* truthy(int r)
+            {
+                auto t = tag(r);
+                auto isbool = b.CreateICmpEQ(t, tagk(boolean));
+                auto set = b.CreateICmpNE(b.CreateLoad(i64(), bits[r]), b.getInt64(0));
+                auto some = b.CreateAnd(b.CreateICmpNE(t, tagk(nil)), b.CreateICmpNE(t, tagk(null)));
+                return b.CreateSelect(isbool, set, some);
+            }
+            // Same tolerance as vtex::equals
+            llvm::Value* equals(llvm::Value* x, llvm::Value* y)
+            {
+                auto e = llvm::ConstantFP::get(f64(), 0.0001);
+                return b.CreateAnd(b.CreateFCmpOGT(y, b.CreateFSub(x, e)), b.CreateFCmpOLT(y, b.CreateFAdd(x, e)));
+            }
+            llvm::Value* compare(OpCode op, llvm::Value* x, llvm::Value* y)
+            {
+                switch(op)
+                {
+                    case OP_EQ: return equals(x, y);
+                    case OP_NE: return b.CreateNot(equals(x, y));
+                    case OP_LT: return b.CreateFCmpOLT(x, y);
+                    case OP_LE: return b.CreateOr(b.CreateFCmpOLT(x, y), equals(x, y));
+                    case OP_GT: return b.CreateFCmpOGT(x, y);
+                    default: return b.CreateOr(b.CreateFCmpOGT(x, y), equals(x, y));
+                }
+            }
+            llvm::Value* arith(OpCode op, llvm::Value* x, llvm::Value* y)
+            {
+                switch(op)
+                {
+                    case OP_ADD: return b.CreateFAdd(x, y);
+                    case OP_SUB: return b.CreateFSub(x, y);
+                    case OP_MUL: return b.CreateFMul(x, y);
+                    case OP_DIV: return b.CreateFDiv(x, y);
+                    default: return helper((void*)&modulo, b.getDoubleTy(), {b.getDoubleTy(), b.getDoubleTy()}, {x, y});
+                }
+            }
+            double numberk(int k) {return p->k[k].n;}
+
+            // Continues in the interpreter at pc unless cond holds
+            void guard(llvm::Value* cond, int pc)
+            {
+                auto pass = llvm::BasicBlock::Create(ctx, "", fn);
+                auto fail = llvm::BasicBlock::Create(ctx, "deopt", fn);
+                b.CreateCondBr(cond, pass, fail, llvm::MDBuilder(ctx).createBranchWeights(1 << 20, 1));
+                b.SetInsertPoint(fail);
+                for (int r = 0; r < p->nregs; ++r)
+                    spill(r);
+                b.CreateRet(b.getInt64(pc));
+                b.SetInsertPoint(pass);
+            }
+
+            llvm::Value* helper(void* f, llvm::Type* ret, std::vector<llvm::Type*> params, std::vector<llvm::Value*> args)
+            {
+                auto ft = llvm::FunctionType::get(ret, params, false);
+                auto callee = b.CreateIntToPtr(b.getInt64((uint64_t)f), ft->getPointerTo());
+                return b.CreateCall(ft, callee, args);
+            }
+            llvm::Value* ptr(const void* p) {return b.CreateIntToPtr(b.getInt64((uint64_t)p), b.getInt8PtrTy());}
+            llvm::Value* reg(int r) {return b.CreateConstInBoundsGEP1_64(b.getInt8Ty(), base, (int64_t)r * (int64_t)sizeof(Val));}
+
+            // Operand types other than numbers were seen at pc, guarding for numbers would deoptimize
+            bool mixed(int pc) {return p->slots[pc] != 0 && p->slots[pc] != fb_numbers;}
+            // Runs the instruction at pc in the runtime, with its operand registers in the frame
+            llvm::Value* generic(int pc, const std::vector<int> &operands)
+            {
+                for (int r : operands)
+                    spill(r);
+                auto truth = helper((void*)&step, i64(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i32()}, {vmptr, base, b.getInt32(pc)});
+                load(GetA(p->code[pc]));
+                return truth;
+            }
+
+            // Leaves the function with a runtime error unless status is set
+            void checkstatus(llvm::Value* status)
+            {
+                auto ok = llvm::BasicBlock::Create(ctx, "", fn);
+                auto err = llvm::BasicBlock::Create(ctx, "error", fn);
+                b.CreateCondBr(b.CreateICmpNE(status, b.getInt32(0)), ok, err);
+                b.SetInsertPoint(err);
+                b.CreateRet(b.getInt64(-2));
+                b.SetInsertPoint(ok);
+            }
+
+            // Safepoint of the back edge at pc, the flag is read every time around the loop
+            void safepoint(int pc)
+            {
+                auto flag = b.CreateLoad(b.getInt8Ty(), ptr(&vm.heap.wantgc));
+                flag->setVolatile(true);
+                auto collect = llvm::BasicBlock::Create(ctx, "collect", fn);
+                auto back = llvm::BasicBlock::Create(ctx, "", fn);
+                b.CreateCondBr(b.CreateICmpNE(flag, b.getInt8(0)), collect, back, llvm::MDBuilder(ctx).createBranchWeights(1, 1 << 20));
+                b.SetInsertPoint(collect);
+                for (int r = 0; r < p->nregs; ++r)
+                    spill(r);
+                checkstatus(helper((void*)&nativesafepoint, i32(), {b.getInt8PtrTy(), i32()}, {vmptr, b.getInt32(pc)}));
+                for (int r = 0; r < p->nregs; ++r)
+                    reload(r);
+                b.CreateBr(back);
+                b.SetInsertPoint(back);
+            }
+
+            // Returns false for code the tier does not handle
+            bool emit(int pc)
+            {
+                auto i = p->code[pc];
+                auto op = GetOp(i);
+                int a = GetA(i);
+                auto next = [&](int at) {return blocks[at];};
+                switch(op)
+                {
+                    case OP_MOVE:
+                    {
+                        int r = GetB(i);
+                        set(a, tag(r), b.CreateLoad(i64(), bits[r]));
+                        // Objects are seen from two registers now, like OP_MOVE marks them
+                        auto mark = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto done = llvm::BasicBlock::Create(ctx, "", fn);
+                        b.CreateCondBr(isobj(tag(r)), mark, done);
+                        b.SetInsertPoint(mark);
+                        helper((void*)&share, b.getVoidTy(), {b.getInt8PtrTy()}, {b.CreateIntToPtr(b.CreateLoad(i64(), bits[r]), b.getInt8PtrTy())});
+                        b.CreateBr(done);
+                        b.SetInsertPoint(done);
+                        break;
+                    }
+                    case OP_LOADK:
+                    {
+                        auto &kv = p->k[GetBx(i)];
+                        uint64_t raw;
+                        memcpy(&raw, &kv.n, sizeof(raw));
+                        set(a, tagk(kv.tag), b.getInt64(raw));
+                        break;
+                    }
+                    case OP_LOADNIL:
+                        set(a, tagk(nil), b.getInt64(0));
+                        break;
+                    case OP_LOADBOOL:
+                        set(a, tagk(boolean), b.getInt64(GetB(i) != 0));
+                        break;
+                    case OP_GETGLOBAL:
+                    case OP_SETGLOBAL:
+                    {
+                        int g = GetBx(i);
+                        if (op == OP_GETGLOBAL)
+                            set(a, b.CreateLoad(i32(), global(g, false, i32())), b.CreateLoad(i64(), global(g, true, i64())));
+                        else
+                        {
+                            b.CreateStore(tag(a), global(g, false, i32()));
+                            b.CreateStore(b.CreateLoad(i64(), bits[a]), global(g, true, i64()));
+                        }
+                        // Both the register and the slot see an object now
+                        auto mark = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto done = llvm::BasicBlock::Create(ctx, "", fn);
+                        b.CreateCondBr(isobj(tag(a)), mark, done);
+                        b.SetInsertPoint(mark);
+                        helper((void*)&share, b.getVoidTy(), {b.getInt8PtrTy()}, {b.CreateIntToPtr(b.CreateLoad(i64(), bits[a]), b.getInt8PtrTy())});
+                        b.CreateBr(done);
+                        b.SetInsertPoint(done);
+                        break;
+                    }
+                    case OP_GETFUNC:
+                    case OP_SETFUNC:
+                        generic(pc, {a});
+                        break;
+                    case OP_ADDGLOBAL:
+                    {
+                        // Numbers add in the slot, strings and arrays are updated by step
+                        int g = GetBx(i);
+                        auto fast = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto slow = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto done = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto isnumber = b.CreateICmpEQ(b.CreateLoad(i32(), global(g, false, i32())), tagk(number));
+                        b.CreateCondBr(b.CreateAnd(isnumber, isnum(a)), fast, slow);
+                        b.SetInsertPoint(fast);
+                        b.CreateStore(b.CreateFAdd(b.CreateLoad(f64(), global(g, true, f64())), num(a)), global(g, true, f64()));
+                        b.CreateBr(done);
+                        b.SetInsertPoint(slow);
+                        generic(pc, {a});
+                        b.CreateBr(done);
+                        b.SetInsertPoint(done);
+                        break;
+                    }
+                    case OP_ADD:
+                    case OP_SUB:
+                    case OP_MUL:
+                    case OP_DIV:
+                    case OP_MOD:
+                        if (mixed(pc))
+                        {
+                            generic(pc, {GetB(i), GetC(i)});
+                            break;
+                        }
+                        guard(b.CreateAnd(isnum(GetB(i)), isnum(GetC(i))), pc);
+                        setnum(a, arith(op, num(GetB(i)), num(GetC(i))));
+                        break;
+                    case OP_ADDK:
+                    case OP_SUBK:
+                    case OP_MULK:
+                    case OP_DIVK:
+                    case OP_MODK:
+                        if (mixed(pc) || p->k[GetC(i)].tag != number)
+                        {
+                            generic(pc, {GetB(i)});
+                            break;
+                        }
+                        guard(isnum(GetB(i)), pc);
+                        setnum(a, arith((OpCode)(op - OP_ADDK + OP_ADD), num(GetB(i)), llvm::ConstantFP::get(f64(), numberk(GetC(i)))));
+                        break;
+                    case OP_EQ:
+                    case OP_NE:
+                    case OP_LT:
+                    case OP_LE:
+                    case OP_GT:
+                    case OP_GE:
+                        if (mixed(pc))
+                        {
+                            generic(pc, {GetB(i), GetC(i)});
+                            break;
+                        }
+                        guard(b.CreateAnd(isnum(GetB(i)), isnum(GetC(i))), pc);
+                        setbool(a, compare(op, num(GetB(i)), num(GetC(i))));
+                        break;
+                    case OP_NOT:
+                        setbool(a, b.CreateNot(truthy(GetB(i))));
+                        break;
+                    case OP_NEG:
+                        guard(isnum(GetB(i)), pc);
+                        setnum(a, b.CreateFNeg(num(GetB(i))));
+                        break;
+                    case OP_JMP:
+                        if (GetsBx(i) < 0)
+                            safepoint(pc);
+                        b.CreateBr(next(pc + 1 + GetsBx(i)));
+                        return true;
+                    case OP_JMPIF:
+                    case OP_JMPIFNOT:
+                    {
+                        auto c = truthy(a);
+                        if (op == OP_JMPIFNOT)
+                            c = b.CreateNot(c);
+                        b.CreateCondBr(c, next(pc + 1 + GetsBx(i)), next(pc + 1));
+                        return true;
+                    }
+                    case OP_JEQ:
+                    case OP_JLT:
+                    case OP_JLE:
+                    case OP_JEQK:
+                    case OP_JLTK:
+                    case OP_JLEK:
+                    case OP_JGTK:
+                    case OP_JGEK:
+                    {
+                        static const OpCode cmp[] = {OP_EQ, OP_LT, OP_LE, OP_EQ, OP_LT, OP_LE, OP_GT, OP_GE};
+                        int rb = GetB(i);
+                        bool konst = op >= OP_JEQK;
+                        llvm::Value* c;
+                        if (mixed(pc) || (konst && p->k[rb].tag != number))
+                            c = b.CreateICmpNE(konst ? generic(pc, {a}) : generic(pc, {a, rb}), b.getInt64(0));
+                        else
+                        {
+                            guard(konst ? isnum(a) : b.CreateAnd(isnum(a), isnum(rb)), pc);
+                            auto y = konst ? (llvm::Value*)llvm::ConstantFP::get(f64(), numberk(rb)) : num(rb);
+                            c = compare(cmp[op - OP_JEQ], num(a), y);
+                        }
+                        if (!GetC(i))
+                            c = b.CreateNot(c);
+                        b.CreateCondBr(c, next(pc + 2 + GetsBx(p->code[pc+1])), next(pc + 2));
+                        return true;
+                    }
+                    case OP_CLOSURE:
+                    {
+                        // The captured registers are read from the frame
+                        std::vector<int> captured;
+                        for (auto &uv : p->protos[GetBx(i)]->upvals)
+                            if (uv.local)
+                                captured.push_back(uv.index);
+                        generic(pc, captured);
+                        break;
+                    }
+                    case OP_GETUPVAL:
+                    case OP_GETUPBOX:
+                        generic(pc, {});
+                        break;
+                    case OP_SETUPBOX:
+                    case OP_NEWBOX:
+                        generic(pc, {a});
+                        break;
+                    case OP_GETBOX:
+                        generic(pc, {GetB(i)});
+                        break;
+                    case OP_SETBOX:
+                    case OP_ADDBOX:
+                        generic(pc, {a, GetB(i)});
+                        break;
+                    case OP_ADDUPBOX:
+                        generic(pc, {a});
+                        break;
+                    case OP_FORPREP:
+                    {
+                        // Checks the bounds and counts the trips in the runtime
+                        for (int r = a; r <= a + 3; ++r)
+                            spill(r);
+                        auto status = helper((void*)&nativeforprep, i32(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i32()}, {vmptr, base, b.getInt32(pc)});
+                        checkstatus(status);
+                        for (int r = a; r <= a + 4; ++r)
+                            load(r);
+                        b.CreateCondBr(b.CreateICmpEQ(status, b.getInt32(1)), next(pc + 1 + GetsBx(i)), next(pc + 1));
+                        return true;
+                    }
+                    case OP_FORLOOP:
+                    {
+                        // The counter and its bounds are numbers since OP_FORPREP
+                        auto n = b.CreateFAdd(num(a), llvm::ConstantFP::get(f64(), 1.0));
+                        auto more = llvm::BasicBlock::Create(ctx, "", fn);
+                        b.CreateCondBr(b.CreateFCmpOLT(n, num(a + 1)), more, next(pc + 1));
+                        b.SetInsertPoint(more);
+                        setnum(a, n);
+                        setnum(a + 4, b.CreateFAdd(num(a + 2), b.CreateFMul(n, num(a + 3))));
+                        safepoint(pc);
+                        b.CreateBr(next(pc + 1 + GetsBx(i)));
+                        return true;
+                    }
+                    case OP_GETELEM:
+                    case OP_SETELEM:
+                    {
+                        // Numbers of an unboxed array are read and written in place. The index is compared with
+                        // the length anyway, a script may have taken len() over.
+                        auto &l = arraylayout();
+                        if (l.nums < 0)
+                            goto arrayop;
+                        bool get = op == OP_GETELEM;
+                        int arr = get ? GetB(i) : a, index = get ? GetC(i) : GetB(i);
+                        auto check = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto inbounds = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto fast = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto slow = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto done = llvm::BasicBlock::Create(ctx, "", fn);
+                        auto isarray = b.CreateICmpEQ(tag(arr), tagk(array));
+                        b.CreateCondBr(get ? isarray : b.CreateAnd(isarray, isnum(GetC(i))), check, slow);
+                        b.SetInsertPoint(check);
+                        auto obj = b.CreateLoad(i64(), bits[arr]);
+                        auto field = [&](int32_t at, llvm::Type* t) {return b.CreateIntToPtr(b.CreateAdd(obj, b.getInt64(at)), t->getPointerTo());};
+                        auto boxed = b.CreateLoad(b.getInt8Ty(), field(l.boxed, b.getInt8Ty()));
+                        b.CreateCondBr(b.CreateICmpEQ(boxed, b.getInt8(0)), inbounds, slow);
+                        b.SetInsertPoint(inbounds);
+                        auto start = b.CreateLoad(i64(), field(l.nums, i64()));
+                        auto length = b.CreateLShr(b.CreateSub(b.CreateLoad(i64(), field(l.end, i64())), start), 3);
+                        auto idx = b.CreateFPToSI(num(index), i64());
+                        b.CreateCondBr(b.CreateICmpULT(idx, length), fast, slow);
+                        b.SetInsertPoint(fast);
+                        auto at = b.CreateGEP(f64(), b.CreateIntToPtr(start, f64()->getPointerTo()), idx);
+                        if (get)
+                            setnum(a, b.CreateLoad(f64(), at));
+                        else
+                            b.CreateStore(num(GetC(i)), at);
+                        b.CreateBr(done);
+                        b.SetInsertPoint(slow);
+                        for (int r : {a, GetB(i), GetC(i)})
+                            spill(r);
+                        checkstatus(helper((void*)&nativearrayop, i32(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i32()}, {vmptr, base, b.getInt32(pc)}));
+                        if (get)
+                            load(a);
+                        b.CreateBr(done);
+                        b.SetInsertPoint(done);
+                        break;
+                    }
+                    case OP_NEWARRAY:
+                    case OP_APPEND:
+                    case OP_GETINDEX:
+                    case OP_SETINDEX:
+                    case OP_NEWRECORD:
+                    case OP_GETFIELD:
+                    case OP_SETFIELD:
+                    arrayop:
+                    {
+                        // The elements and operands are read from the frame
+                        if (op == OP_NEWARRAY || op == OP_APPEND || op == OP_NEWRECORD)
+                            for (int r = a + (op != OP_APPEND); r <= a + GetB(i); ++r)
+                                spill(r);
+                        else if (op == OP_GETFIELD)
+                            spill(GetB(i));
+                        else if (op == OP_SETFIELD)
+                            for (int r : {a, GetC(i)})
+                                spill(r);
+                        else
+                            for (int r : {a, GetB(i), GetC(i)})
+                                spill(r);
+                        checkstatus(helper((void*)&nativearrayop, i32(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i32()}, {vmptr, base, b.getInt32(pc)}));
+                        if (op == OP_NEWARRAY || op == OP_GETINDEX || op == OP_GETELEM || op == OP_NEWRECORD || op == OP_GETFIELD)
+                            load(a);
+                        break;
+                    }
+                    case OP_CALL:
+                    case OP_CALLG:
+                    {
+                        // The callee works on the frames memory, whatever it leaves above R[A] is dead.
+                        // The registers below are spilled as roots for a collection during the call.
+                        int nargs = GetB(i);
+                        for (int r = 0; r <= a + nargs; ++r)
+                            if (r != a || op == OP_CALL)
+                                spill(r);
+                        llvm::Value* status;
+                        if (op == OP_CALL)
+                            status = helper((void*)&nativecall, i32(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i32(), i32()}, {vmptr, reg(a), b.getInt32(nargs), b.getInt32(pc)});
+                        else
+                            status = helper((void*)&nativecallfunction, i32(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i32(), i32(), i32()}, {vmptr, reg(a), b.getInt32(nargs), b.getInt32(pc), b.getInt32(GetC(i))});
+                        checkstatus(status);
+                        for (int r = 0; r < a; ++r)
+                            reload(r);
+                        load(a);
+                        // The copies above R[A] are stale, spilled later they would be roots to moved objects
+                        for (int r = a + 1; r < p->nregs; ++r)
+                            set(r, tagk(nil), b.getInt64(0));
+                        // Calls that always returned one type are guarded to, the interpreter goes on behind the call
+                        int t = result(p->slots[pc] >> 8);
+                        if (t != null)
+                        {
+                            guard(b.CreateICmpEQ(tag(a), tagk(t)), pc + 1);
+                            set(a, tagk(t), b.CreateLoad(i64(), bits[a]));
+                        }
+                        break;
+                    }
+                    case OP_RET:
+                    {
+                        if (GetB(i))
+                        {
+                            b.CreateStore(tag(a), slot(-1, false, i32()));
+                            b.CreateStore(b.CreateLoad(i64(), bits[a]), slot(-1, true, i64()));
+                        } else
+                        {
+                            b.CreateStore(tagk(nil), slot(-1, false, i32()));
+                            b.CreateStore(b.getInt64(0), slot(-1, true, i64()));
+                        }
+                        b.CreateRet(b.getInt64(-1));
+                        return true;
+                    }
+                    case OP_TAILCALL:
+                    {
+                        // Only the callee and its arguments survive, they move down to the frames base
+                        int nargs = GetB(i);
+                        for (int r = a; r <= a + nargs; ++r)
+                            spill(r);
+                        b.CreateRet(helper((void*)&nativetailcall, i64(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i32(), i32()}, {vmptr, reg(a), b.getInt32(nargs), b.getInt32(pc)}));
+                        return true;
+                    }
+                    default:
+                        return false;
+                }
+                if (pc + 1 >= (int)p->code.size())
+                    return false;
+                b.CreateBr(next(pc + 1));
+                return true;
+            }
+
+            // The only type in some feedback bits, or null
+            static int result(uint8_t feedback)
+            {
+                return feedback == fb_number ? number : feedback == fb_boolean ? boolean : feedback == fb_nil ? nil : null;
+            }
+            void specialize(const std::vector<uint8_t> &feedback, int n, int pc)
+            {
+                for (int r = 0; r < n && r < (int)feedback.size(); ++r)
+                {
+                    int t = result(feedback[r]);
+                    if (t != null)
+                    {
+                        guard(b.CreateICmpEQ(tag(r), tagk(t)), pc);
+                        set(r, tagk(t), b.CreateLoad(i64(), bits[r]));
+                    }
+                }
+            }
+
+        public:
+            Compiler(VM &vm, Proto* p, llvm::Module &mod) : vm(vm), p(p), ctx(mod.getContext()), mod(mod), b(mod.getContext()) {}
+
+            llvm::Function* compile(const std::string &name)
+            {
+                auto ft = llvm::FunctionType::get(i64(), {b.getInt8PtrTy(), b.getInt8PtrTy(), i64()}, false);
+                fn = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name, mod);
+                auto args = fn->arg_begin();
+                vmptr = &*args++;
+                base = &*args++;
+                llvm::Value* at = &*args;
+                fn->addParamAttr(1, llvm::Attribute::NoAlias);
+
+                auto entry = llvm::BasicBlock::Create(ctx, "entry", fn);
+                b.SetInsertPoint(entry);
+                for (int r = 0; r < p->nregs; ++r)
+                {
+                    tags.push_back(b.CreateAlloca(i32()));
+                    bits.push_back(b.CreateAlloca(i64()));
+                }
+                for (int r = 0; r < p->nregs; ++r)
+                    load(r);
+                for (size_t pc = 0; pc < p->code.size(); ++pc)
+                    blocks.push_back(llvm::BasicBlock::Create(ctx, stringf("pc%zu", pc), fn));
+
+                // Called at the start or, for on-stack replacement, at a loop header
+                auto start = llvm::BasicBlock::Create(ctx, "start", fn);
+                auto unknown = llvm::BasicBlock::Create(ctx, "unknown", fn);
+                auto entries = b.CreateSwitch(at, unknown);
+                entries->addCase(b.getInt64(0), start);
+                b.SetInsertPoint(unknown);
+                b.CreateRet(at);
+
+                // Parameters only ever seen with one type are guarded to have it,
+                // which lets the optimizer drop the checks on everything derived from them
+                b.SetInsertPoint(start);
+                specialize(p->feedback, p->nparams, 0);
+                b.CreateBr(blocks[0]);
+                // Same for the registers when a loop tiered up
+                for (int pc : LoopHeaders(p))
+                {
+                    if (pc == 0)
+                        continue;
+                    auto osr = llvm::BasicBlock::Create(ctx, stringf("osr%d", pc), fn);
+                    entries->addCase(b.getInt64(pc), osr);
+                    b.SetInsertPoint(osr);
+                    specialize(p->loopfeedback, p->nregs, pc);
+                    b.CreateBr(blocks[pc]);
+                }
+                for (size_t pc = 0; pc < p->code.size(); ++pc)
+                {
+                    b.SetInsertPoint(blocks[pc]);
+                    // The JMP behind a compare and jump is its operand and never runs by itself
+                    if (pc > 0 && GetOp(p->code[pc-1]) >= OP_JEQ && GetOp(p->code[pc-1]) <= OP_JGEK)
+                    {
+                        b.CreateUnreachable();
+                        continue;
+                    }
+                    if (!emit((int)pc))
+                    {
+                        fn->eraseFromParent();
+                        return nullptr;
+                    }
+                }
+                return fn;
+            }
+        };
+
+        inline std::unique_ptr<llvm::orc::JIT> &engine()
+        {
+            static std::unique_ptr<llvm::orc::JIT> TheJIT;
+            return TheJIT;
+        }
+    }
+
+    // Compiles p to native code, marks it as not compilable if that fails
+    bool jitcompile(VM &vm, Proto* p)
+    {
+        auto &TheJIT = jit::engine();
+        if (!TheJIT)
+        {
+            llvm::InitializeNativeTarget();
+            llvm::InitializeNativeTargetAsmPrinter();
+            auto J = llvm::orc::JIT::Create();
+            if (!J)
+            {
+                llvm::consumeError(J.takeError());
+                fprintf(stderr, "JIT: Could not create the LLVM JIT, staying in the interpreter\n");
+                vm.jitthreshold = UINT32_MAX;
+                p->nojit = true;
+                return false;
+            }
+            TheJIT = std::move(*J);
+        }
+
+        auto TheContext = std::make_unique<llvm::LLVMContext>();
+        auto TheModule = std::make_unique<llvm::Module>("Vortex JIT", *TheContext);
+        TheModule->setDataLayout(TheJIT->getDataLayout());
+
+        auto name = stringf("vtex_%zu_%s", vm.jitted, p->name.c_str());
+        jit::Compiler compiler(vm, p, *TheModule);
+        auto F = compiler.compile(name);
+        if (!F || llvm::verifyFunction(*F, &llvm::errs()))
+        {
+            p->nojit = true;
+            return false;
+        }
+
+        llvm::legacy::FunctionPassManager TheFPM(TheModule.get());
+        // Registers become SSA values, only the guards failure paths still write the frame
+        TheFPM.add(llvm::createPromoteMemoryToRegisterPass());
+        TheFPM.add(llvm::createInstructionCombiningPass());
+        TheFPM.add(llvm::createReassociatePass());
+        TheFPM.add(llvm::createGVNPass());
+        TheFPM.add(llvm::createCFGSimplificationPass());
+        TheFPM.add(llvm::createLICMPass());
+        TheFPM.add(llvm::createInstructionCombiningPass());
+        TheFPM.add(llvm::createCFGSimplificationPass());
+        TheFPM.doInitialization();
+        TheFPM.run(*F);
+
+        auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+        if (auto Err = TheJIT->addModule(llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT))
+        {
+            llvm::consumeError(std::move(Err));
+            p->nojit = true;
+            return false;
+        }
+        auto Sym = TheJIT->lookup(name);
+        if (!Sym)
+        {
+            llvm::consumeError(Sym.takeError());
+            p->nojit = true;
+            return false;
+        }
+        p->jit = (jitfn)Sym->getAddress();
+        return true;
+    }
+}
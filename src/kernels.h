@@ -0,0 +1,266 @@
+#pragma once
+
+#include "IR.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+// Vector loops use the vector extensions of GCC and Clang, the AVX2 ones are compiled
+// with a target attribute and picked at startup when the CPU has it
+#if defined(VTEX_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define VTEX_X86_SIMD
+#endif
+
+namespace vtex
+{
+namespace simd
+{
+    enum Level {scalar, sse2, avx2};
+
+    inline const char* levelname(Level l)
+    {
+        static const char* names[] = {"scalar", "sse2", "avx2"};
+        return names[l];
+    }
+
+    inline Level detect()
+    {
+        #if defined(VTEX_X86_SIMD)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? avx2 : sse2;
+        #else
+        return scalar;
+        #endif
+    }
+
+    // Widest loops the CPU runs, may be lowered to compare them
+    inline Level level = detect();
+
+    // One side of a kernel, n numbers or a single number used for every element
+    struct Operand
+    {
+        const double* p;
+        bool scalar;
+    };
+
+    #if defined(VTEX_X86_SIMD)
+    typedef double v2d __attribute__((vector_size(16)));
+    typedef double v4d __attribute__((vector_size(32)));
+    #endif
+
+    // V is double for the scalar loop or a vector of doubles, compares give 1 or 0 like the operators.
+    // Vectors go by reference, passing AVX ones by value would depend on the target.
+    template<OpCode op, typename V> inline void apply(V &r, const V &x, const V &y)
+    {
+        if constexpr (op == OP_ADD) r = x + y;
+        else if constexpr (op == OP_SUB) r = x - y;
+        else if constexpr (op == OP_MUL) r = x * y;
+        else if constexpr (op == OP_DIV) r = x / y;
+        else if constexpr (sizeof(V) == sizeof(double)) r = op == OP_LT ? x < y : x > y;
+        else
+        {
+            // Lanes of a compare are all ones or zeros, masking the bits of 1.0 with them gives 1 or 0
+            typedef decltype(x < y) M;
+            V one = {};
+            one += 1;
+            r = (V)((op == OP_LT ? x < y : x > y) & (M)one);
+        }
+    }
+
+    // Every lane set to a scalar operand, adding to zeros would turn -0 into 0
+    template<typename V> inline void broadcast(V &v, Operand x)
+    {
+        if (x.scalar)
+            for (size_t k = 0; k < sizeof(V) / sizeof(double); ++k)
+                memcpy((double*)&v + k, x.p, sizeof(double));
+    }
+
+    template<OpCode op, typename V, bool xs, bool ys> inline void loop(double* out, Operand x, Operand y, size_t n)
+    {
+        constexpr size_t w = sizeof(V) / sizeof(double);
+        V xv = {}, yv = {};
+        broadcast(xv, x);
+        broadcast(yv, y);
+        size_t i = 0;
+        // Two vectors a step keep both units busy, the tail goes one number at a time
+        for (; i + 2*w <= n; i += 2*w)
+        {
+            V a0 = xv, a1 = xv, b0 = yv, b1 = yv, r0, r1;
+            if (!xs)
+            {
+                memcpy(&a0, x.p + i, sizeof(V));
+                memcpy(&a1, x.p + i + w, sizeof(V));
+            }
+            if (!ys)
+            {
+                memcpy(&b0, y.p + i, sizeof(V));
+                memcpy(&b1, y.p + i + w, sizeof(V));
+            }
+            apply<op>(r0, a0, b0);
+            apply<op>(r1, a1, b1);
+            memcpy(out + i, &r0, sizeof(V));
+            memcpy(out + i + w, &r1, sizeof(V));
+        }
+        for (; i < n; ++i)
+            apply<op>(out[i], x.p[xs ? 0 : i], y.p[ys ? 0 : i]);
+    }
+
+    template<OpCode op, typename V> inline void run(double* out, Operand x, Operand y, size_t n)
+    {
+        if (x.scalar)
+            loop<op, V, true, false>(out, x, y, n);
+        else if (y.scalar)
+            loop<op, V, false, true>(out, x, y, n);
+        else
+            loop<op, V, false, false>(out, x, y, n);
+    }
+
+    template<typename V> inline void dispatch(OpCode op, double* out, Operand x, Operand y, size_t n)
+    {
+        switch(op)
+        {
+            case OP_ADD: return run<OP_ADD, V>(out, x, y, n);
+            case OP_SUB: return run<OP_SUB, V>(out, x, y, n);
+            case OP_MUL: return run<OP_MUL, V>(out, x, y, n);
+            case OP_DIV: return run<OP_DIV, V>(out, x, y, n);
+            case OP_LT: return run<OP_LT, V>(out, x, y, n);
+            case OP_GT: return run<OP_GT, V>(out, x, y, n);
+            default: return;
+        }
+    }
+
+    #if defined(VTEX_X86_SIMD)
+    // flatten pulls the templates into the AVX2 function, so they are compiled for it
+    __attribute__((target("avx2"), flatten)) inline void avx2kernel(OpCode op, double* out, Operand x, Operand y, size_t n)
+    {
+        dispatch<v4d>(op, out, x, y, n);
+    }
+    #endif
+
+    // out[i] = x[i] op y[i] for + - * / < >, out may be one of the operands
+    inline void elementwise(OpCode op, double* out, Operand x, Operand y, size_t n)
+    {
+        #if defined(VTEX_X86_SIMD)
+        if (level == avx2)
+            return avx2kernel(op, out, x, y, n);
+        if (level == sse2)
+            return dispatch<v2d>(op, out, x, y, n);
+        #endif
+        dispatch<double>(op, out, x, y, n);
+    }
+
+    // Sums add in the same order on every level, so they do not depend on the CPU: lanes interleaved
+    // partial sums over blocks of up to block numbers, folded as a fixed tree, and pairwise above that,
+    // which keeps the rounding error growing with log n instead of n
+    constexpr size_t lanes = 8, block = 128;
+
+    inline double fold(const double* l)
+    {
+        return ((l[0] + l[4]) + (l[2] + l[6])) + ((l[1] + l[5]) + (l[3] + l[7]));
+    }
+
+    // Sum of x[i], or of x[i]*y[i] for a dot product
+    template<typename V, bool product> inline double blocksum(const double* x, const double* y, size_t n)
+    {
+        constexpr size_t w = sizeof(V) / sizeof(double), k = lanes / w;
+        V acc[k] = {};
+        size_t i = 0;
+        for (; i + lanes <= n; i += lanes)
+            for (size_t j = 0; j < k; ++j)
+            {
+                V a;
+                memcpy(&a, x + i + j*w, sizeof(V));
+                if constexpr (product)
+                {
+                    V b;
+                    memcpy(&b, y + i + j*w, sizeof(V));
+                    a *= b;
+                }
+                acc[j] += a;
+            }
+        double l[lanes];
+        memcpy(l, acc, sizeof(l));
+        double s = fold(l);
+        for (; i < n; ++i)
+            s += product ? x[i] * y[i] : x[i];
+        return s;
+    }
+
+    template<typename V, bool product> inline double pairwise(const double* x, const double* y, size_t n)
+    {
+        if (n <= block)
+            return blocksum<V, product>(x, y, n);
+        size_t half = n / 2 / lanes * lanes;
+        return pairwise<V, product>(x, y, half) + pairwise<V, product>(x + half, product ? y + half : y, n - half);
+    }
+
+    // Smallest or biggest of n >= 1 numbers, NaN if there is one. Which of 0 and -0 comes out is up to the caller.
+    template<typename V, bool greater> inline double extreme(const double* x, size_t n)
+    {
+        constexpr size_t w = sizeof(V) / sizeof(double), k = lanes / w;
+        typedef decltype(V{} < V{}) M;
+        V m[k];
+        M nan[k] = {};
+        for (size_t j = 0; j < k; ++j)
+            broadcast(m[j], {x, true});
+        size_t i = 0;
+        for (; i + lanes <= n; i += lanes)
+            for (size_t j = 0; j < k; ++j)
+            {
+                V a;
+                memcpy(&a, x + i + j*w, sizeof(V));
+                nan[j] |= a != a;
+                m[j] = (greater ? a > m[j] : a < m[j]) ? a : m[j];
+            }
+        double l[lanes], r = x[0];
+        memcpy(l, m, sizeof(l));
+        bool bad = false;
+        M none = {};
+        for (size_t j = 0; j < k; ++j)
+            bad |= memcmp(&nan[j], &none, sizeof(M)) != 0;
+        for (double v : l)
+            r = (greater ? v > r : v < r) ? v : r;
+        for (; i < n; ++i)
+        {
+            bad |= x[i] != x[i];
+            r = (greater ? x[i] > r : x[i] < r) ? x[i] : r;
+        }
+        return bad ? NAN : r;
+    }
+
+    #if defined(VTEX_X86_SIMD)
+    __attribute__((target("avx2"), flatten)) inline double avx2sum(const double* x, const double* y, size_t n)
+    {
+        return y ? pairwise<v4d, true>(x, y, n) : pairwise<v4d, false>(x, y, n);
+    }
+    __attribute__((target("avx2"), flatten)) inline double avx2extreme(const double* x, size_t n, bool greater)
+    {
+        return greater ? extreme<v4d, true>(x, n) : extreme<v4d, false>(x, n);
+    }
+    #endif
+
+    // Sum of x[i], or of x[i]*y[i] when y is given
+    inline double sum(const double* x, const double* y, size_t n)
+    {
+        #if defined(VTEX_X86_SIMD)
+        if (level == avx2)
+            return avx2sum(x, y, n);
+        if (level == sse2)
+            return y ? pairwise<v2d, true>(x, y, n) : pairwise<v2d, false>(x, y, n);
+        #endif
+        return y ? pairwise<double, true>(x, y, n) : pairwise<double, false>(x, y, n);
+    }
+
+    inline double extreme(const double* x, size_t n, bool greater)
+    {
+        #if defined(VTEX_X86_SIMD)
+        if (level == avx2)
+            return avx2extreme(x, n, greater);
+        if (level == sse2)
+            return greater ? extreme<v2d, true>(x, n) : extreme<v2d, false>(x, n);
+        #endif
+        return greater ? extreme<double, true>(x, n) : extreme<double, false>(x, n);
+    }
+}
+}
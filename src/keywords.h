@@ -15,11 +15,13 @@ namespace vtex
         {"function", tok_func},
         {"true", tok_true},
         {"false", tok_false},
+        {"nil", tok_nil},
         {"if", tok_if},
         {"else", tok_else},
         {"while", tok_while},
         {"for", tok_for},
         {"break", tok_break},
+        {"record", tok_record},
         {"return", tok_ret}
     };
 }
\ No newline at end of file
@@ -0,0 +1,1725 @@
+#pragma once
+
+#include "types.h"
+#include "vstring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#if defined(VTEX_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(VTEX_GC_THREAD)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+namespace vtex
+{
+    struct Obj;
+    struct Proto;
+    class VM;
+
+    // Runtime value used by the VM. Numbers and booleans live inline,
+    // everything else is a pointer to a heap object. The tag is one of TypeTokens.
+    struct Val
+    {
+        int tag = nil;
+        union
+        {
+            double n;
+            bool b;
+            Obj* o;
+        };
+
+        Val() : n(0) {}
+        Val(double n) : tag(number), n(n) {}
+        Val(bool b) : tag(boolean) {this->n = 0; this->b = b;}
+        Val(Obj* o, int tag) : tag(tag), o(o) {}
+
+        bool isnil() const {return tag == nil;}
+        bool isnum() const {return tag == number;}
+        bool isobj() const {return tag == string || tag >= function;}
+    };
+
+    class Heap;
+
+    // Collector bits of an object, see Heap
+    enum GCBits : uint8_t
+    {
+        gc_remembered = 1, // Old and in the remembered set, it may point into the nursery
+        gc_forwarded = 2 // Left behind in the nursery, next is its promoted copy
+    };
+
+    struct Obj
+    {
+        int type = null;
+        bool shared = false; // Set once more than one place can see the object, so it may not be mutated in place
+        uint8_t gc = 0;
+        std::atomic<bool> marked{false}; // Reached by the running major collection, the background marker sets it too
+        Obj* next = nullptr; // Next object of the old generation, or where a promoted nursery object went
+
+        Obj(int type) : type(type) {}
+        // Copies leave the collectors state behind, see promote()
+        Obj(const Obj &o) : type(o.type), shared(o.shared) {}
+        virtual ~Obj() = default;
+
+        // Bytes the object takes up where it was allocated, the nursery gets walked by it
+        virtual size_t size() const = 0;
+        // Bytes it keeps alive, counted against the old generations budget
+        virtual size_t footprint() const {return size();}
+        // Moves the object out of the nursery into at, size() bytes the old generation allocated
+        virtual Obj* promote(void* at) = 0;
+        // Visits every value the object holds, see Heap::visit
+        virtual void trace(Heap &heap) {}
+        // Values can be overwritten after construction, the background marker leaves it to the VM thread
+        virtual bool mutates() const {return false;}
+    };
+
+    struct VString : public Obj
+    {
+        std::string str;
+        size_t hash = 0; // Of str once a map looked it up, 0 until then and after it changed
+        VString(std::string str) : Obj(string), str(std::move(str)) {}
+        size_t hashed();
+        size_t size() const override {return sizeof(VString);}
+        size_t footprint() const override {return sizeof(VString) + str.capacity();}
+        Obj* promote(void* at) override {return new (at) VString(std::move(*this));}
+    };
+
+    // A closure. Its upvalues sit right behind the object, copied in when it was created, see Heap::closure()
+    struct VFunction : public Obj
+    {
+        Proto* proto = nullptr;
+        int nupvals = 0;
+        VFunction(Proto* proto, int nupvals = 0) : Obj(function), proto(proto), nupvals(nupvals)
+        {
+            for (int u = 0; u < nupvals; ++u)
+                new (&upvals()[u]) Val();
+        }
+        Val* upvals() {return (Val*)(this+1);}
+        size_t size() const override {return sizeof(VFunction) + nupvals*sizeof(Val);}
+        Obj* promote(void* at) override
+        {
+            auto c = new (at) VFunction(proto, nupvals);
+            std::copy(upvals(), upvals() + nupvals, c->upvals());
+            c->shared = shared;
+            return c;
+        }
+        void trace(Heap &heap) override;
+    };
+
+    // Shared cell of a captured variable that is assigned after the capture
+    struct VBox : public Obj
+    {
+        Val v;
+        VBox(Val v) : Obj(box), v(v) {}
+        size_t size() const override {return sizeof(VBox);}
+        Obj* promote(void* at) override {return new (at) VBox(*this);}
+        void trace(Heap &heap) override;
+        bool mutates() const override {return true;}
+    };
+
+    typedef Val(*nativefn)(VM&, Val* args, int nargs);
+    struct VNative : public Obj
+    {
+        std::string name;
+        nativefn fn = nullptr;
+        VNative(std::string name, nativefn fn) : Obj(native), name(std::move(name)), fn(fn) {}
+        size_t size() const override {return sizeof(VNative);}
+        Obj* promote(void* at) override {return new (at) VNative(std::move(*this));}
+    };
+
+    // A growable array. Numbers are kept unboxed and contiguous while nothing else was stored,
+    // the first value of another type converts the elements to boxed values for good.
+    struct VArray : public Obj
+    {
+        std::vector<double> nums;
+        std::vector<Val> vals;
+        bool boxed = false;
+        VArray() : Obj(array) {}
+        size_t length() const {return boxed ? vals.size() : nums.size();}
+        Val get(size_t i) const {return boxed ? vals[i] : Val(nums[i]);}
+        // Stores and appends mark objects as shared, a register sees them as well
+        void reserve(Heap &heap, size_t n);
+        // Numbers of an unboxed array after sizing it to n, new ones are 0
+        double* numbers(Heap &heap, size_t n);
+        void set(Heap &heap, size_t i, const Val &v);
+        void push(Heap &heap, const Val &v);
+        Val pop(Heap &heap);
+        size_t size() const override {return sizeof(VArray);}
+        size_t footprint() const override {return sizeof(VArray) + nums.capacity()*sizeof(double) + vals.capacity()*sizeof(Val);}
+        Obj* promote(void* at) override {return new (at) VArray(std::move(*this));}
+        void trace(Heap &heap) override;
+        bool mutates() const override {return true;}
+
+        private:
+            void box();
+    };
+
+    // A hash map from numbers and strings to values with a Swiss table layout: every slot has a control
+    // byte holding 7 bits of the hash of its entry or marking it empty or deleted, and a lookup compares
+    // a group of 16 of them at once, only entries whose bits matched get their keys compared. Slots point
+    // into entries, which stay in insertion order for iteration. Removed entries leave a hole with a nil
+    // key behind until the next rehash, which reuses the hashes the entries keep.
+    struct VMap : public Obj
+    {
+        struct Entry
+        {
+            Val key, value;
+            size_t hash;
+        };
+        static constexpr size_t group = 16;
+        static constexpr uint8_t empty = 0x80, deleted = 0xfe;
+
+        std::vector<Entry> entries;
+        std::vector<uint8_t> ctrl; // A multiple of group bytes, or none before the first entry
+        std::vector<uint32_t> slots; // Entry of every full slot
+        size_t count = 0; // Entries that were not removed
+        size_t growthleft = 0; // Empty slots that may still be taken before the table is rebuilt
+
+        VMap() : Obj(map) {}
+        size_t length() const {return count;}
+        // Entries it holds before it has to grow
+        size_t capacity() const {return ctrl.size() / 8 * 7;}
+        // Numbers and strings, NaN is never equal to itself so it is none
+        static bool iskey(const Val &k) {return (k.tag == number && k.n == k.n) || k.tag == string;}
+        // Value of key, nil when it has none
+        Val get(const Val &key) const;
+        bool has(const Val &key) const {return find(key) >= 0;}
+        // Keys and values are marked as shared, the caller checked the key with iskey()
+        void set(Heap &heap, const Val &key, const Val &v);
+        bool remove(Heap &heap, const Val &key);
+        // Room for n entries without growing
+        void reserve(Heap &heap, size_t n);
+        size_t size() const override {return sizeof(VMap);}
+        size_t footprint() const override
+        {
+            return sizeof(VMap) + entries.capacity()*sizeof(Entry) + ctrl.capacity() + slots.capacity()*sizeof(uint32_t);
+        }
+        Obj* promote(void* at) override {return new (at) VMap(std::move(*this));}
+        void trace(Heap &heap) override;
+        bool mutates() const override {return true;}
+        // Hash and equality of keys, the persistent maps use them as well
+        static size_t hashof(const Val &key);
+        static bool samekey(const Val &a, const Val &b);
+
+        private:
+            static uint32_t match(const uint8_t* g, uint8_t b);
+            static uint32_t vacant(const uint8_t* g);
+            // Slot of key, -1 when it has none
+            int64_t find(const Val &key) const;
+            // Takes the first vacant slot along the probes of hash h for entry index
+            void place(size_t h, uint32_t index);
+            // Builds a table of nslots slots for the entries, dropping the holes
+            void rebuild(size_t nslots);
+    };
+
+    // A field name as the compiler resolved it: its id and the offset it expected the field at
+    struct FieldKey
+    {
+        int name;
+        int offset;
+    };
+
+    // Fields of a record type, in the order its records store them
+    struct Layout
+    {
+        std::string name;
+        std::vector<std::string> names;
+        std::vector<int> ids; // Of the names, see VM::fieldid()
+        // Offset of the field of key k, -1 when there is none. Only a type that has the field
+        // somewhere else than the compiler expected gets searched.
+        int offset(const FieldKey &k) const
+        {
+            if ((size_t)k.offset < ids.size() && ids[k.offset] == k.name)
+                return k.offset;
+            for (size_t f = 0; f < ids.size(); ++f)
+                if (ids[f] == k.name)
+                    return (int)f;
+            return -1;
+        }
+    };
+
+    // A value of a record type. The fields sit right behind the object, like the upvalues of a closure, see Heap::record()
+    struct VRecord : public Obj
+    {
+        const Layout* layout;
+        VRecord(const Layout* layout) : Obj(record), layout(layout)
+        {
+            for (size_t f = 0; f < length(); ++f)
+                new (&fields()[f]) Val();
+        }
+        size_t length() const {return layout->ids.size();}
+        Val* fields() {return (Val*)(this+1);}
+        size_t size() const override {return sizeof(VRecord) + length()*sizeof(Val);}
+        Obj* promote(void* at) override
+        {
+            auto r = new (at) VRecord(layout);
+            std::copy(fields(), fields() + length(), r->fields());
+            r->shared = shared;
+            return r;
+        }
+        void trace(Heap &heap) override;
+        bool mutates() const override {return true;}
+    };
+
+    // A node of the tries behind the persistent collections, shared by every version that reaches it. Its
+    // values sit right behind the object: the elements or children of a vector node, the keys and values
+    // of the entries a map node holds itself followed by its children. Nodes only change in place for the
+    // transient that created them, see VPVector.
+    struct VNode : public Obj
+    {
+        uint32_t n = 0; // Values in use
+        uint32_t cap; // Room for values
+        uint32_t datamap = 0, nodemap = 0; // Map nodes, which of the 32 hash fragments have an entry here or a child
+        uint32_t edit; // Transient allowed to change it in place, 0 for none
+        VNode(uint32_t cap, uint32_t edit) : Obj(pnode), cap(cap), edit(edit)
+        {
+            for (uint32_t v = 0; v < cap; ++v)
+                new (&vals()[v]) Val();
+        }
+        Val* vals() {return (Val*)(this+1);}
+        static VNode* of(const Val &v) {return (VNode*)v.o;}
+        size_t size() const override {return sizeof(VNode) + cap*sizeof(Val);}
+        Obj* promote(void* at) override
+        {
+            auto c = new (at) VNode(cap, edit);
+            c->n = n;
+            c->datamap = datamap;
+            c->nodemap = nodemap;
+            std::copy(vals(), vals() + n, c->vals());
+            return c;
+        }
+        void trace(Heap &heap) override;
+        bool mutates() const override {return true;}
+    };
+
+    // A persistent vector, the bitmapped trie of Clojure: 32 way nodes with the elements in the leaves and
+    // the last 1 to 32 of them in a tail node of its own, so appending mostly copies only the tail. A new
+    // version copies the path to the element it changes, log32 n nodes, and shares everything else. A
+    // transient has an edit token of its own, nodes it copied carry it and get changed in place after that.
+    struct VPVector : public Obj
+    {
+        Val root; // A node once there are more than 32 elements
+        Val tail; // A node once there are any
+        size_t count = 0;
+        int shift = 5; // Of an index, for the children of the root
+        uint32_t edit = 0; // Nonzero while transient
+
+        VPVector() : Obj(pvector) {}
+        size_t length() const {return count;}
+        Val get(size_t i) const {return leaf(i)->vals()[i & 31];}
+        // Element i < length() becomes v
+        void set(Heap &heap, size_t i, const Val &v);
+        void push(Heap &heap, const Val &v);
+        // A new version sharing every node with this one, transient with a new token or persistent
+        VPVector* version(Heap &heap, bool transient) const;
+        size_t size() const override {return sizeof(VPVector);}
+        Obj* promote(void* at) override {return new (at) VPVector(*this);}
+        void trace(Heap &heap) override;
+        bool mutates() const override {return true;}
+
+        private:
+            size_t tailoff() const {return count < 32 ? 0 : ((count - 1) >> 5) << 5;}
+            VNode* leaf(size_t i) const;
+            VNode* set(Heap &heap, int level, VNode* node, size_t i, const Val &v);
+            VNode* pushtail(Heap &heap, int level, VNode* parent, VNode* t);
+            VNode* path(Heap &heap, int level, VNode* node);
+    };
+
+    // A persistent map, a hash array mapped trie: every level takes 5 bits of the hash of a key to pick
+    // one of 32 places in a node, which holds the entry itself or a child node. Entries of keys whose
+    // hashes agree in all 64 bits share a collision node at the bottom that is searched. Versions and
+    // transients work like those of VPVector. Keys are the ones of VMap, iteration goes in hash order.
+    struct VPMap : public Obj
+    {
+        Val root; // A node once there was an entry
+        size_t count = 0;
+        uint32_t edit = 0;
+
+        VPMap() : Obj(pmap) {}
+        size_t length() const {return count;}
+        Val get(const Val &key) const;
+        bool has(const Val &key) const;
+        // The caller checked the key with VMap::iskey()
+        void set(Heap &heap, const Val &key, const Val &v);
+        bool remove(Heap &heap, const Val &key);
+        VPMap* version(Heap &heap, bool transient) const;
+        // Calls f(key, value) for every entry
+        template<typename F> void each(F&& f) const {if (!root.isnil()) each(VNode::of(root), f);}
+        size_t size() const override {return sizeof(VPMap);}
+        Obj* promote(void* at) override {return new (at) VPMap(*this);}
+        void trace(Heap &heap) override;
+        bool mutates() const override {return true;}
+
+        private:
+            const Val* find(const Val &key) const;
+            VNode* set(Heap &heap, VNode* node, int shift, size_t h, const Val &key, const Val &v, bool &added);
+            VNode* remove(Heap &heap, VNode* node, int shift, size_t h, const Val &key, bool &removed);
+            VNode* pair(Heap &heap, int shift, const Val &k1, const Val &v1, size_t h1, const Val &k2, const Val &v2, size_t h2);
+            template<typename F> static void each(VNode* node, F &f)
+            {
+                // Collision nodes have no bits, all their values are entries
+                uint32_t entries = node->datamap || node->nodemap ? 2 * __builtin_popcount(node->datamap) : node->n;
+                for (uint32_t v = 0; v < entries; v += 2)
+                    f(node->vals()[v], node->vals()[v+1]);
+                for (uint32_t v = entries; v < node->n; ++v)
+                    each(VNode::of(node->vals()[v]), f);
+            }
+    };
+
+    // A lazy sequence, a range of numbers or a map, filter or take over a collection or another sequence.
+    // Nothing runs until reduce() or collect() pull the elements through, see builtins.h.
+    struct VSeq : public Obj
+    {
+        enum Kind {range, mapped, filtered, taken};
+        Kind kind;
+        Val from; // Collection or sequence a stage takes its elements from
+        Val fn; // Of a map or filter
+        double start = 0, step = 1; // A range has the elements start + i*step for i < n
+        double n = 0; // Or how many elements a take lets through
+
+        VSeq(Kind kind) : Obj(seq), kind(kind) {}
+        size_t size() const override {return sizeof(VSeq);}
+        Obj* promote(void* at) override {return new (at) VSeq(*this);}
+        void trace(Heap &heap) override;
+    };
+
+    // Index of a number used to subscript n elements, -1 unless it is a whole number in [0, n)
+    inline int64_t position(double d, size_t n)
+    {
+        return d >= 0 && d < (double)n && (double)(int64_t)d == d ? (int64_t)d : -1;
+    }
+
+    // Elements of range(a, b, step), a + i*step for the i that stay below b, or above it for a negative step.
+    // -1 when the bounds are no numbers or the step is 0.
+    inline double trips(const Val &a, const Val &b, const Val &step)
+    {
+        if (a.tag != number || b.tag != number || step.tag != number || step.n == 0)
+            return -1;
+        double n = std::ceil((b.n - a.n) / step.n);
+        return n > 0 ? n : 0;
+    }
+
+    // Memory of the old generation. Blocks up to maxsmall bytes are bumped out of 64KB slabs and go onto
+    // a free list of their size class when freed, which later allocations of that size take first. Bigger
+    // blocks use operator new. Every heap has its own, only used from its VMs thread, so nothing is locked,
+    // and all slabs go back at once with the heap.
+    class Slabs
+    {
+        static constexpr size_t granule = 16, maxsmall = 1024, slabsize = 64 << 10; // maxsmall fits a full persistent collection node
+        struct Block {Block* next;};
+        Block* freelist[maxsmall / granule + 1] = {};
+        char* top = nullptr; // Rest of the newest slab
+        char* end = nullptr;
+        std::vector<char*> slabs;
+
+        public:
+            struct
+            {
+                size_t allocs = 0, reused = 0, large = 0, frees = 0;
+                size_t inuse = 0; // Bytes in blocks handed out
+            } stats;
+
+            Slabs() {}
+            Slabs(const Slabs&) = delete;
+            ~Slabs()
+            {
+                for (auto slab : slabs)
+                    ::operator delete(slab);
+            }
+
+            // bytes is a multiple of the granule
+            void* alloc(size_t bytes)
+            {
+                ++stats.allocs;
+                stats.inuse += bytes;
+                if (bytes > maxsmall)
+                {
+                    ++stats.large;
+                    return ::operator new(bytes);
+                }
+                auto &list = freelist[bytes / granule];
+                if (!!list)
+                {
+                    ++stats.reused;
+                    auto b = list;
+                    list = b->next;
+                    return b;
+                }
+                if ((size_t)(end - top) < bytes)
+                {
+                    // Less than maxsmall bytes of the last slab go unused
+                    top = (char*)::operator new(slabsize);
+                    end = top + slabsize;
+                    slabs.push_back(top);
+                }
+                auto b = top;
+                top += bytes;
+                return b;
+            }
+
+            void release(void* p, size_t bytes)
+            {
+                ++stats.frees;
+                stats.inuse -= bytes;
+                if (bytes > maxsmall)
+                {
+                    ::operator delete(p);
+                    return;
+                }
+                auto &list = freelist[bytes / granule];
+                auto b = (Block*)p;
+                b->next = list;
+                list = b;
+            }
+
+            size_t reserved() const {return slabs.size() * slabsize;}
+    };
+
+    // Owns every object the runtime creates. Generational: new objects are bumped into the nursery, a
+    // minor collection copies whatever the roots and the remembered set still reach out of it into the
+    // old generation and empties it. The old generation is a list of single allocations that a major
+    // collection marks and sweeps incrementally, a slice at a time. Marking starts from a snapshot of
+    // the roots and store() shades every value an object loses while it runs, so whatever was reachable
+    // when it started stays marked (snapshot at the beginning) and objects it did not reach are garbage.
+    // Collections only run when the VM asks for them at a safepoint, allocating just sets wantgc.
+    class Heap
+    {
+        Slabs slabs;
+        Obj* objects = nullptr; // The old generation
+        Obj* unswept = nullptr; // Old objects the running major collection has not swept yet
+        char* nursery = nullptr; // Young objects live in [nursery, top), the rest up to end is free
+        char* top = nullptr;
+        char* end = nullptr;
+        size_t youngbytes = 0; // Memory young objects took outside of the nursery since the last minor collection
+        uint32_t edits = 0; // Tokens handed out to transients so far
+        std::vector<Obj*> remembered;
+        std::vector<Obj*> promoted; // Copied out of the nursery, their values are still to be forwarded
+        std::vector<Obj*> gray; // Marked, their values are still to be marked
+        std::vector<Obj*> shaded; // Marked by store(), handed to gray at the next slice
+        bool minor = false; // Which collection visit() works for
+        #if defined(VTEX_GC_THREAD)
+        // The background marker owns gray between handover() and takeback()
+        struct
+        {
+            std::thread thread;
+            std::mutex lock;
+            std::condition_variable cv;
+            bool run = false, quit = false;
+            std::atomic<bool> pause{false};
+            std::vector<Obj*> deferred; // Objects that mutate, traced by the VM thread
+        } marker;
+        #endif
+
+        static size_t rounded(size_t bytes) {return (bytes + 15) & ~(size_t)15;}
+        using clock = std::chrono::steady_clock;
+
+        public:
+            enum Phase {idle, marking, sweeping};
+            Phase phase = idle;
+
+            size_t nurserysize = 256 << 10;
+            size_t heaplimit = 0; // Bytes the old generation may keep after a major collection, 0 for no limit
+            size_t minheap = 8 << 20; // Old generation bytes before the first major collection
+            double growth = 2; // The next major collection comes once the old generation grew by this factor
+            double slice = 500; // Microseconds of major collection work per safepoint, 0 for all of it at once
+            bool background = false; // Mark on a thread of its own, safepoints just hand the work over
+            size_t oldbytes = 0;
+            size_t nextmajor = minheap;
+            bool wantgc = false; // A collection is due, checked by the VM at its safepoints
+            struct
+            {
+                size_t minors = 0, majors = 0, slices = 0;
+                size_t promoted = 0; // Bytes copied out of the nursery
+                double minormax = 0, slicemax = 0, total = 0; // Pauses in microseconds
+            } stats;
+
+            Heap() {}
+            Heap(const Heap&) = delete;
+            ~Heap()
+            {
+                #if defined(VTEX_GC_THREAD)
+                if (marker.thread.joinable())
+                {
+                    takeback();
+                    {
+                        std::lock_guard<std::mutex> l(marker.lock);
+                        marker.quit = true;
+                    }
+                    marker.cv.notify_all();
+                    marker.thread.join();
+                }
+                #endif
+                // Only destructors run and blocks too big for a slab go back, the slabs are released as a whole
+                sweepnursery();
+                for (Obj* list : {objects, unswept})
+                    while (!!list)
+                    {
+                        auto next = list->next;
+                        size_t bytes = rounded(list->size());
+                        list->~Obj();
+                        slabs.release(list, bytes);
+                        list = next;
+                    }
+                ::operator delete(nursery);
+            }
+
+            // Young objects go to a nursery of nurserysize bytes from now on, everything before stays old
+            void startnursery()
+            {
+                if (!nursery && nurserysize >= 1024)
+                {
+                    nursery = top = (char*)::operator new(nurserysize);
+                    end = nursery + nurserysize;
+                }
+                nextmajor = std::max(minheap, (size_t)(oldbytes * growth));
+                if (heaplimit > 0)
+                    nextmajor = std::min(nextmajor, heaplimit);
+            }
+
+            template<typename T, typename ... Args>
+            T* alloc(Args&& ... args)
+            {
+                return place<T>(sizeof(T), std::forward<Args>(args)...);
+            }
+
+            // A function with room for nupvals upvalues in the same allocation
+            VFunction* closure(Proto* proto, int nupvals)
+            {
+                static_assert(sizeof(VFunction) % alignof(Val) == 0, "Upvalues would be misaligned");
+                return place<VFunction>(sizeof(VFunction) + nupvals*sizeof(Val), proto, nupvals);
+            }
+
+            // A record of layout with its fields in the same allocation, all nil
+            VRecord* record(const Layout* layout)
+            {
+                static_assert(sizeof(VRecord) % alignof(Val) == 0, "Fields would be misaligned");
+                return place<VRecord>(sizeof(VRecord) + layout->ids.size()*sizeof(Val), layout);
+            }
+
+            // A node of a persistent collection with room for cap values
+            VNode* node(uint32_t cap, uint32_t edit)
+            {
+                static_assert(sizeof(VNode) % alignof(Val) == 0, "Node values would be misaligned");
+                return place<VNode>(sizeof(VNode) + cap*sizeof(Val), cap, edit);
+            }
+
+            // Token of a new transient, never 0
+            uint32_t newedit()
+            {
+                if (++edits == 0)
+                    ++edits;
+                return edits;
+            }
+
+            Val string(std::string str)
+            {
+                return Val(alloc<VString>(std::move(str)), vtex::string);
+            }
+
+            // An object took bytes more memory outside of the heap, like an array growing. Young ones
+            // holding as much as the nursery again get it emptied, their memory goes with them.
+            void grew(const Obj* o, size_t bytes)
+            {
+                if (young(o))
+                {
+                    youngbytes += bytes;
+                    if (youngbytes >= nurserysize)
+                        wantgc = true;
+                    return;
+                }
+                oldbytes += bytes;
+                if (majordue() && nursery)
+                    wantgc = true;
+            }
+
+            bool young(const Obj* o) const {return (const char*)o >= nursery && (const char*)o < end;}
+
+            // Write barrier for values put into a new object
+            void barrier(Obj* owner, const Val &v)
+            {
+                if (v.isobj() && young(v.o) && !young(owner) && !(owner->gc & gc_remembered))
+                    remember(owner);
+            }
+            // Write barrier for overwriting field of owner with v
+            void store(Obj* owner, Val &field, const Val &v)
+            {
+                if (phase == marking && field.isobj() && !young(field.o) && !field.o->marked.load(std::memory_order_relaxed))
+                {
+                    field.o->marked.store(true, std::memory_order_relaxed);
+                    shaded.push_back(field.o);
+                }
+                field = v;
+                barrier(owner, v);
+            }
+
+            // Called by traced objects and the VMs roots for every value they hold
+            void visit(Val &v)
+            {
+                if (!v.isobj())
+                    return;
+                if (minor)
+                {
+                    if (young(v.o))
+                        v.o = forward(v.o);
+                } else if (!young(v.o) && !v.o->marked.load(std::memory_order_relaxed))
+                {
+                    v.o->marked.store(true, std::memory_order_relaxed);
+                    gray.push_back(v.o);
+                }
+            }
+
+            // Empties the nursery, roots() visits every value outside of the heap
+            template<typename Roots>
+            void collectminor(Roots roots)
+            {
+                auto start = clock::now();
+                #if defined(VTEX_GC_THREAD)
+                // Objects get moved and values forwarded, nothing may be marking meanwhile
+                takeback();
+                #endif
+                minor = true;
+                roots();
+                for (auto o : remembered)
+                {
+                    o->gc &= ~gc_remembered;
+                    o->trace(*this);
+                }
+                remembered.clear();
+                while (!promoted.empty())
+                {
+                    auto o = promoted.back();
+                    promoted.pop_back();
+                    o->trace(*this);
+                }
+                sweepnursery();
+                youngbytes = 0;
+                minor = false;
+                ++stats.minors;
+                stats.minormax = std::max(stats.minormax, pause(start));
+            }
+
+            const Slabs &memory() const {return slabs;}
+
+            bool majordue() const {return phase == idle && oldbytes >= nextmajor;}
+
+            // Marks the roots of a major collection, right after a minor one emptied the nursery.
+            // Everything old from now on is allocated marked.
+            template<typename Roots>
+            void startmajor(Roots roots)
+            {
+                auto start = clock::now();
+                phase = marking;
+                roots();
+                #if defined(VTEX_GC_THREAD)
+                if (background && !marker.thread.joinable())
+                    marker.thread = std::thread([this] {markloop();});
+                #endif
+                pause(start);
+            }
+
+            // One slice of the running major collection, all of it unless bounded
+            void advance(bool bounded = true)
+            {
+                auto start = clock::now();
+                if (phase == marking)
+                {
+                    bool threaded = false, done = true;
+                    #if defined(VTEX_GC_THREAD)
+                    takeback();
+                    threaded = bounded && marker.thread.joinable();
+                    // What the background marker left, the values of these go to gray
+                    done = drain(marker.deferred, start, bounded);
+                    #endif
+                    gray.insert(gray.end(), shaded.begin(), shaded.end());
+                    shaded.clear();
+                    if (threaded ? done && gray.empty() : done && drain(gray, start, bounded))
+                    {
+                        phase = sweeping;
+                        unswept = objects;
+                        objects = nullptr;
+                        oldbytes = 0;
+                    }
+                    #if defined(VTEX_GC_THREAD)
+                    else if (threaded)
+                        handover();
+                    #endif
+                }
+                if (phase == sweeping)
+                    sweep(start, bounded);
+                ++stats.slices;
+                stats.slicemax = std::max(stats.slicemax, pause(start));
+            }
+
+            // Runs the major collection in progress to its end
+            void finish()
+            {
+                while (phase != idle)
+                    advance(false);
+            }
+
+        private:
+            template<typename T, typename ... Args>
+            T* place(size_t bytes, Args&& ... args)
+            {
+                bytes = rounded(bytes);
+                if ((size_t)(end - top) >= bytes)
+                {
+                    auto o = new (top) T(std::forward<Args>(args)...);
+                    top += bytes;
+                    return o;
+                }
+                // The nursery is full until the next safepoint, whatever it could point to is remembered
+                auto o = link(new (slabs.alloc(bytes)) T(std::forward<Args>(args)...));
+                if (nursery)
+                {
+                    wantgc = true;
+                    remember(o);
+                }
+                return o;
+            }
+
+            template<typename T>
+            T* link(T* o)
+            {
+                o->next = objects;
+                objects = o;
+                // Marking does not look at new objects, everything they point to is in the snapshot or new as well
+                if (phase == marking)
+                    o->marked.store(true, std::memory_order_relaxed);
+                oldbytes += o->footprint();
+                if (majordue() && nursery)
+                    wantgc = true;
+                return o;
+            }
+
+            void remember(Obj* o)
+            {
+                o->gc |= gc_remembered;
+                remembered.push_back(o);
+            }
+
+            Obj* forward(Obj* o)
+            {
+                if (!(o->gc & gc_forwarded))
+                {
+                    auto c = o->promote(slabs.alloc(rounded(o->size())));
+                    link(c);
+                    stats.promoted += o->size();
+                    o->gc |= gc_forwarded;
+                    o->next = c;
+                    promoted.push_back(c);
+                }
+                return o->next;
+            }
+
+            // Whatever is still in the nursery is garbage or the husk of a promoted object
+            void sweepnursery()
+            {
+                for (char* at = nursery; at < top; )
+                {
+                    auto o = (Obj*)at;
+                    at += rounded(o->size());
+                    o->~Obj();
+                }
+                top = nursery;
+            }
+
+            bool over(clock::time_point start, bool bounded)
+            {
+                return bounded && slice > 0 && std::chrono::duration<double, std::micro>(clock::now() - start).count() >= slice;
+            }
+
+            // Marks until work runs empty, which it returns, or the slice is over
+            bool drain(std::vector<Obj*> &work, clock::time_point start, bool bounded)
+            {
+                for (size_t n = 1; !work.empty(); ++n)
+                {
+                    if (n % 256 == 0 && over(start, bounded))
+                        return false;
+                    auto o = work.back();
+                    work.pop_back();
+                    o->trace(*this);
+                }
+                return true;
+            }
+
+            void sweep(clock::time_point start, bool bounded)
+            {
+                for (size_t n = 1; !!unswept; ++n)
+                {
+                    if (n % 256 == 0 && over(start, bounded))
+                        return;
+                    auto o = unswept;
+                    unswept = o->next;
+                    if (o->marked.load(std::memory_order_relaxed))
+                    {
+                        o->marked.store(false, std::memory_order_relaxed);
+                        o->next = objects;
+                        objects = o;
+                        oldbytes += o->footprint();
+                    } else
+                    {
+                        size_t bytes = rounded(o->size());
+                        o->~Obj();
+                        slabs.release(o, bytes);
+                    }
+                }
+                phase = idle;
+                ++stats.majors;
+                nextmajor = std::max(minheap, (size_t)(oldbytes * growth));
+                if (heaplimit > 0)
+                    nextmajor = std::max(std::min(nextmajor, heaplimit), oldbytes);
+            }
+
+            #if defined(VTEX_GC_THREAD)
+            // Body of the background marker, mutating objects are left for the VM thread
+            void markloop()
+            {
+                std::unique_lock<std::mutex> l(marker.lock);
+                while (true)
+                {
+                    marker.cv.wait(l, [this] {return marker.quit || marker.run;});
+                    if (marker.quit)
+                        return;
+                    l.unlock();
+                    while (!gray.empty() && !marker.pause.load(std::memory_order_relaxed))
+                    {
+                        auto o = gray.back();
+                        gray.pop_back();
+                        if (o->mutates())
+                            marker.deferred.push_back(o);
+                        else
+                            o->trace(*this);
+                    }
+                    l.lock();
+                    marker.run = false;
+                    marker.cv.notify_all();
+                }
+            }
+            void handover()
+            {
+                {
+                    std::lock_guard<std::mutex> l(marker.lock);
+                    marker.run = true;
+                }
+                marker.cv.notify_all();
+            }
+            // Waits for the background marker to stop, gray belongs to the VM thread again
+            void takeback()
+            {
+                marker.pause.store(true);
+                std::unique_lock<std::mutex> l(marker.lock);
+                marker.cv.wait(l, [this] {return !marker.run;});
+                marker.pause.store(false);
+            }
+            #endif
+
+            double pause(clock::time_point start)
+            {
+                double us = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+                stats.total += us;
+                return us;
+            }
+    };
+
+    inline void VFunction::trace(Heap &heap)
+    {
+        for (int u = 0; u < nupvals; ++u)
+            heap.visit(upvals()[u]);
+    }
+    inline void VBox::trace(Heap &heap) {heap.visit(v);}
+
+    inline void VRecord::trace(Heap &heap)
+    {
+        for (size_t f = 0; f < length(); ++f)
+            heap.visit(fields()[f]);
+    }
+
+    inline void VArray::trace(Heap &heap)
+    {
+        for (auto &v : vals)
+            heap.visit(v);
+    }
+    inline void VArray::box()
+    {
+        vals.reserve(nums.capacity());
+        for (double n : nums)
+            vals.push_back(Val(n));
+        nums = std::vector<double>();
+        boxed = true;
+    }
+    inline void VArray::reserve(Heap &heap, size_t n)
+    {
+        size_t before = footprint();
+        if (boxed)
+            vals.reserve(n);
+        else
+            nums.reserve(n);
+        if (footprint() > before)
+            heap.grew(this, footprint() - before);
+    }
+    inline double* VArray::numbers(Heap &heap, size_t n)
+    {
+        size_t before = footprint();
+        nums.resize(n);
+        if (footprint() > before)
+            heap.grew(this, footprint() - before);
+        return nums.data();
+    }
+    inline void VArray::set(Heap &heap, size_t i, const Val &v)
+    {
+        if (!boxed)
+        {
+            if (v.tag == number)
+            {
+                nums[i] = v.n;
+                return;
+            }
+            size_t before = footprint();
+            box();
+            heap.grew(this, footprint() - before);
+        }
+        if (v.isobj())
+            v.o->shared = true;
+        heap.store(this, vals[i], v);
+    }
+    inline void VArray::push(Heap &heap, const Val &v)
+    {
+        size_t before = footprint();
+        if (!boxed && v.tag == number)
+            nums.push_back(v.n);
+        else
+        {
+            if (!boxed)
+                box();
+            if (v.isobj())
+                v.o->shared = true;
+            vals.push_back(v);
+            heap.barrier(this, v);
+        }
+        if (footprint() > before)
+            heap.grew(this, footprint() - before);
+    }
+    inline Val VArray::pop(Heap &heap)
+    {
+        if (!boxed)
+        {
+            if (nums.empty())
+                return Val();
+            double n = nums.back();
+            nums.pop_back();
+            return Val(n);
+        }
+        if (vals.empty())
+            return Val();
+        Val v = vals.back();
+        // Dropping the value is an overwrite to a running major collection
+        heap.store(this, vals.back(), Val());
+        vals.pop_back();
+        return v;
+    }
+
+    // Spreads the bits of a hash over all of them, maps take the group from the low ones and the control byte from the top 7
+    inline size_t mixhash(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    inline size_t VString::hashed()
+    {
+        if (hash == 0)
+            hash = std::max<size_t>(mixhash(std::hash<std::string>()(str)), 1);
+        return hash;
+    }
+
+    // Bit i set where byte i of the group at g is b
+    inline uint32_t VMap::match(const uint8_t* g, uint8_t b)
+    {
+        #if defined(VTEX_SIMD) && defined(__SSE2__)
+        auto bytes = _mm_loadu_si128((const __m128i*)g);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)b)));
+        #else
+        uint32_t m = 0;
+        for (size_t i = 0; i < group; ++i)
+            m |= (uint32_t)(g[i] == b) << i;
+        return m;
+        #endif
+    }
+    // Bit i set where slot i of the group at g is empty or deleted, which are the control bytes with the top bit
+    inline uint32_t VMap::vacant(const uint8_t* g)
+    {
+        #if defined(VTEX_SIMD) && defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g));
+        #else
+        uint32_t m = 0;
+        for (size_t i = 0; i < group; ++i)
+            m |= (uint32_t)(g[i] >> 7) << i;
+        return m;
+        #endif
+    }
+    inline size_t VMap::hashof(const Val &key)
+    {
+        if (key.tag == string)
+            return ((VString*)key.o)->hashed();
+        // 0 and -0 are the same key
+        double d = key.n == 0 ? 0 : key.n;
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return mixhash(bits);
+    }
+    inline bool VMap::samekey(const Val &a, const Val &b)
+    {
+        if (a.tag != b.tag)
+            return false;
+        if (a.tag == number)
+            return a.n == b.n;
+        return a.o == b.o || ((VString*)a.o)->str == ((VString*)b.o)->str;
+    }
+    // Groups are probed at triangular steps, which visits each of them once since there are a power of two
+    inline int64_t VMap::find(const Val &key) const
+    {
+        if (count == 0 || !iskey(key))
+            return -1;
+        size_t h = hashof(key), mask = ctrl.size() / group - 1;
+        for (size_t g = h & mask, step = 1; ; g = (g + step++) & mask)
+        {
+            const uint8_t* c = ctrl.data() + g*group;
+            for (uint32_t m = match(c, h >> 57); m != 0; m &= m - 1)
+            {
+                size_t s = g*group + __builtin_ctz(m);
+                auto &e = entries[slots[s]];
+                if (e.hash == h && samekey(e.key, key))
+                    return s;
+            }
+            // Inserts take the first vacant slot, so the key would be before an empty one
+            if (match(c, empty) != 0)
+                return -1;
+        }
+    }
+    inline void VMap::place(size_t h, uint32_t index)
+    {
+        size_t mask = ctrl.size() / group - 1;
+        for (size_t g = h & mask, step = 1; ; g = (g + step++) & mask)
+            if (uint32_t m = vacant(ctrl.data() + g*group))
+            {
+                size_t s = g*group + __builtin_ctz(m);
+                growthleft -= ctrl[s] == empty;
+                ctrl[s] = h >> 57;
+                slots[s] = index;
+                return;
+            }
+    }
+    inline void VMap::rebuild(size_t nslots)
+    {
+        size_t n = 0;
+        for (auto &e : entries)
+            if (!e.key.isnil())
+                entries[n++] = e;
+        entries.resize(n);
+        ctrl.assign(nslots, empty);
+        slots.resize(nslots);
+        growthleft = capacity();
+        for (size_t i = 0; i < n; ++i)
+            place(entries[i].hash, i);
+    }
+    inline Val VMap::get(const Val &key) const
+    {
+        int64_t s = find(key);
+        return s < 0 ? Val() : entries[slots[s]].value;
+    }
+    inline void VMap::set(Heap &heap, const Val &key, const Val &v)
+    {
+        if (v.isobj())
+            v.o->shared = true;
+        int64_t s = find(key);
+        if (s >= 0)
+        {
+            heap.store(this, entries[slots[s]].value, v);
+            return;
+        }
+        if (key.isobj())
+            key.o->shared = true;
+        // 0 and -0 are the same key, the one kept is 0
+        Val k = key.tag == number && key.n == 0 ? Val(0.0) : key;
+        size_t before = footprint();
+        // Full, twice the slots unless removals freed half of them. Mostly holes, the entries get packed.
+        if (growthleft == 0)
+            rebuild(ctrl.empty() ? group : count >= capacity() / 2 ? ctrl.size() * 2 : ctrl.size());
+        else if (entries.size() - count > count + group)
+            rebuild(ctrl.size());
+        size_t h = hashof(k);
+        entries.push_back({k, v, h});
+        heap.barrier(this, k);
+        heap.barrier(this, v);
+        place(h, entries.size() - 1);
+        ++count;
+        if (footprint() > before)
+            heap.grew(this, footprint() - before);
+    }
+    inline bool VMap::remove(Heap &heap, const Val &key)
+    {
+        int64_t s = find(key);
+        if (s < 0)
+            return false;
+        auto &e = entries[slots[s]];
+        heap.store(this, e.key, Val());
+        heap.store(this, e.value, Val());
+        // Probes stop at a group with an empty slot anyway, then this one may be empty as well
+        if (match(ctrl.data() + s / group * group, empty) != 0)
+        {
+            ctrl[s] = empty;
+            ++growthleft;
+        } else
+            ctrl[s] = deleted;
+        --count;
+        return true;
+    }
+    inline void VMap::reserve(Heap &heap, size_t n)
+    {
+        size_t before = footprint(), nslots = std::max(ctrl.size(), group);
+        while (nslots / 8 * 7 < n)
+            nslots *= 2;
+        entries.reserve(n);
+        if (nslots != ctrl.size())
+            rebuild(nslots);
+        if (footprint() > before)
+            heap.grew(this, footprint() - before);
+    }
+    inline void VMap::trace(Heap &heap)
+    {
+        for (auto &e : entries)
+        {
+            heap.visit(e.key);
+            heap.visit(e.value);
+        }
+    }
+
+    inline void VNode::trace(Heap &heap)
+    {
+        for (uint32_t v = 0; v < n; ++v)
+            heap.visit(vals()[v]);
+    }
+
+    // node itself when the transient edit owns it and it has room for cap values, a copy edit owns otherwise
+    inline VNode* editable(Heap &heap, VNode* node, uint32_t edit, uint32_t cap)
+    {
+        if (edit != 0 && node->edit == edit && node->cap >= cap)
+            return node;
+        auto c = heap.node(std::max(cap, node->n), edit);
+        c->n = node->n;
+        c->datamap = node->datamap;
+        c->nodemap = node->nodemap;
+        for (uint32_t v = 0; v < node->n; ++v)
+        {
+            c->vals()[v] = node->vals()[v];
+            heap.barrier(c, c->vals()[v]);
+        }
+        return c;
+    }
+    // A node for the n values at vals
+    inline VNode* newnode(Heap &heap, const Val* vals, uint32_t n, uint32_t datamap, uint32_t nodemap, uint32_t edit)
+    {
+        auto c = heap.node(n, edit);
+        c->n = n;
+        c->datamap = datamap;
+        c->nodemap = nodemap;
+        for (uint32_t v = 0; v < n; ++v)
+        {
+            c->vals()[v] = vals[v];
+            heap.barrier(c, vals[v]);
+        }
+        return c;
+    }
+
+    inline VNode* VPVector::leaf(size_t i) const
+    {
+        if (i >= tailoff())
+            return VNode::of(tail);
+        auto node = VNode::of(root);
+        for (int level = shift; level > 0; level -= 5)
+            node = VNode::of(node->vals()[(i >> level) & 31]);
+        return node;
+    }
+    // Transients copy nodes at full size, so later changes fit in place
+    inline VNode* VPVector::set(Heap &heap, int level, VNode* node, size_t i, const Val &v)
+    {
+        auto c = editable(heap, node, edit, edit ? 32 : node->n);
+        if (level == 0)
+            heap.store(c, c->vals()[i & 31], v);
+        else
+        {
+            auto &child = c->vals()[(i >> level) & 31];
+            heap.store(c, child, Val(set(heap, level - 5, VNode::of(child), i, v), pnode));
+        }
+        return c;
+    }
+    inline void VPVector::set(Heap &heap, size_t i, const Val &v)
+    {
+        if (v.isobj())
+            v.o->shared = true;
+        if (i >= tailoff())
+        {
+            auto t = editable(heap, VNode::of(tail), edit, edit ? 32 : VNode::of(tail)->n);
+            heap.store(t, t->vals()[i & 31], v);
+            heap.store(this, tail, Val(t, pnode));
+        } else
+            heap.store(this, root, Val(set(heap, shift, VNode::of(root), i, v), pnode));
+    }
+    // A chain of level / 5 nodes down to node
+    inline VNode* VPVector::path(Heap &heap, int level, VNode* node)
+    {
+        if (level == 0)
+            return node;
+        auto c = heap.node(edit ? 32 : 1, edit);
+        c->n = 1;
+        c->vals()[0] = Val(path(heap, level - 5, node), pnode);
+        heap.barrier(c, c->vals()[0]);
+        return c;
+    }
+    // Hangs the full tail t into the trie under parent, or under a new node when there is none
+    inline VNode* VPVector::pushtail(Heap &heap, int level, VNode* parent, VNode* t)
+    {
+        uint32_t at = ((count - 1) >> level) & 31;
+        auto c = !parent ? heap.node(edit ? 32 : 1, edit) : editable(heap, parent, edit, edit ? 32 : std::max(parent->n, at + 1));
+        Val insert;
+        if (level == 5)
+            insert = Val(t, pnode);
+        else if (at < c->n)
+            insert = Val(pushtail(heap, level - 5, VNode::of(c->vals()[at]), t), pnode);
+        else
+            insert = Val(path(heap, level - 5, t), pnode);
+        heap.store(c, c->vals()[at], insert);
+        c->n = std::max(c->n, at + 1);
+        return c;
+    }
+    inline void VPVector::push(Heap &heap, const Val &v)
+    {
+        if (v.isobj())
+            v.o->shared = true;
+        uint32_t intail = count - tailoff();
+        if (count > 0 && intail < 32)
+        {
+            auto t = editable(heap, VNode::of(tail), edit, edit ? 32 : intail + 1);
+            heap.store(t, t->vals()[intail], v);
+            t->n = intail + 1;
+            heap.store(this, tail, Val(t, pnode));
+            ++count;
+            return;
+        }
+        if (count > 0)
+        {
+            // The tail is full and goes into the trie, which gets a level more once the root is full
+            auto t = VNode::of(tail);
+            if ((count >> 5) > ((size_t)1 << shift))
+            {
+                auto r = heap.node(edit ? 32 : 2, edit);
+                r->n = 2;
+                r->vals()[0] = root;
+                r->vals()[1] = Val(path(heap, shift, t), pnode);
+                heap.barrier(r, r->vals()[0]);
+                heap.barrier(r, r->vals()[1]);
+                heap.store(this, root, Val(r, pnode));
+                shift += 5;
+            } else
+                heap.store(this, root, Val(pushtail(heap, shift, root.isnil() ? nullptr : VNode::of(root), t), pnode));
+        }
+        auto t = heap.node(edit ? 32 : 1, edit);
+        t->n = 1;
+        t->vals()[0] = v;
+        heap.barrier(t, v);
+        heap.store(this, tail, Val(t, pnode));
+        ++count;
+    }
+    inline VPVector* VPVector::version(Heap &heap, bool transient) const
+    {
+        auto c = heap.alloc<VPVector>(*this);
+        c->edit = transient ? heap.newedit() : 0;
+        heap.barrier(c, root);
+        heap.barrier(c, tail);
+        return c;
+    }
+    inline void VPVector::trace(Heap &heap)
+    {
+        heap.visit(root);
+        heap.visit(tail);
+    }
+
+    inline const Val* VPMap::find(const Val &key) const
+    {
+        if (root.isnil() || !VMap::iskey(key))
+            return nullptr;
+        size_t h = VMap::hashof(key);
+        auto node = VNode::of(root);
+        for (int shift = 0; ; shift += 5)
+        {
+            if (shift >= 64)
+            {
+                for (uint32_t v = 0; v < node->n; v += 2)
+                    if (VMap::samekey(node->vals()[v], key))
+                        return &node->vals()[v+1];
+                return nullptr;
+            }
+            uint32_t bit = 1u << ((h >> shift) & 31);
+            if (node->datamap & bit)
+            {
+                auto e = node->vals() + 2 * __builtin_popcount(node->datamap & (bit - 1));
+                return VMap::samekey(e[0], key) ? &e[1] : nullptr;
+            }
+            if (!(node->nodemap & bit))
+                return nullptr;
+            node = VNode::of(node->vals()[2 * __builtin_popcount(node->datamap) + __builtin_popcount(node->nodemap & (bit - 1))]);
+        }
+    }
+    inline Val VPMap::get(const Val &key) const
+    {
+        auto v = find(key);
+        return v ? *v : Val();
+    }
+    inline bool VPMap::has(const Val &key) const {return find(key) != nullptr;}
+    // A node at shift holding two entries whose hashes differ somewhere below it
+    inline VNode* VPMap::pair(Heap &heap, int shift, const Val &k1, const Val &v1, size_t h1, const Val &k2, const Val &v2, size_t h2)
+    {
+        if (shift >= 64)
+        {
+            Val vals[] = {k1, v1, k2, v2};
+            return newnode(heap, vals, 4, 0, 0, edit);
+        }
+        uint32_t b1 = 1u << ((h1 >> shift) & 31), b2 = 1u << ((h2 >> shift) & 31);
+        if (b1 == b2)
+        {
+            Val child(pair(heap, shift + 5, k1, v1, h1, k2, v2, h2), pnode);
+            return newnode(heap, &child, 1, 0, b1, edit);
+        }
+        Val vals[] = {k1, v1, k2, v2};
+        if (b2 < b1)
+        {
+            std::swap(vals[0], vals[2]);
+            std::swap(vals[1], vals[3]);
+        }
+        return newnode(heap, vals, 4, b1 | b2, 0, edit);
+    }
+    // Nodes other than collision nodes hold at most 64 values, 2 for each of the 32 fragments
+    inline VNode* VPMap::set(Heap &heap, VNode* node, int shift, size_t h, const Val &key, const Val &v, bool &added)
+    {
+        if (shift >= 64)
+        {
+            for (uint32_t e = 0; e < node->n; e += 2)
+                if (VMap::samekey(node->vals()[e], key))
+                {
+                    auto c = editable(heap, node, edit, node->n);
+                    heap.store(c, c->vals()[e+1], v);
+                    return c;
+                }
+            auto c = editable(heap, node, edit, node->n + 2);
+            heap.store(c, c->vals()[c->n], key);
+            heap.store(c, c->vals()[c->n + 1], v);
+            c->n += 2;
+            added = true;
+            return c;
+        }
+        uint32_t bit = 1u << ((h >> shift) & 31);
+        uint32_t entries = 2 * __builtin_popcount(node->datamap);
+        if (node->datamap & bit)
+        {
+            uint32_t e = 2 * __builtin_popcount(node->datamap & (bit - 1));
+            if (VMap::samekey(node->vals()[e], key))
+            {
+                auto c = editable(heap, node, edit, node->n);
+                heap.store(c, c->vals()[e+1], v);
+                return c;
+            }
+            // Two keys on one fragment, both go a level down
+            auto &k = node->vals()[e];
+            Val child(pair(heap, shift + 5, k, node->vals()[e+1], VMap::hashof(k), key, v, h), pnode);
+            uint32_t at = entries - 2 + __builtin_popcount(node->nodemap & (bit - 1));
+            Val vals[64];
+            std::copy(node->vals(), node->vals() + e, vals);
+            std::copy(node->vals() + e + 2, node->vals() + at + 2, vals + e);
+            vals[at] = child;
+            std::copy(node->vals() + at + 2, node->vals() + node->n, vals + at + 1);
+            added = true;
+            return newnode(heap, vals, node->n - 1, node->datamap ^ bit, node->nodemap | bit, edit);
+        }
+        if (node->nodemap & bit)
+        {
+            uint32_t at = entries + __builtin_popcount(node->nodemap & (bit - 1));
+            auto child = VNode::of(node->vals()[at]);
+            auto changed = set(heap, child, shift + 5, h, key, v, added);
+            if (changed == child)
+                return node;
+            auto c = editable(heap, node, edit, node->n);
+            heap.store(c, c->vals()[at], Val(changed, pnode));
+            return c;
+        }
+        uint32_t e = 2 * __builtin_popcount(node->datamap & (bit - 1));
+        Val vals[64];
+        std::copy(node->vals(), node->vals() + e, vals);
+        vals[e] = key;
+        vals[e+1] = v;
+        std::copy(node->vals() + e, node->vals() + node->n, vals + e + 2);
+        added = true;
+        return newnode(heap, vals, node->n + 2, node->datamap | bit, node->nodemap, edit);
+    }
+    inline void VPMap::set(Heap &heap, const Val &key, const Val &v)
+    {
+        if (v.isobj())
+            v.o->shared = true;
+        if (key.isobj())
+            key.o->shared = true;
+        Val k = key.tag == number && key.n == 0 ? Val(0.0) : key;
+        if (root.isnil())
+            heap.store(this, root, Val(heap.node(0, edit), pnode));
+        bool added = false;
+        heap.store(this, root, Val(set(heap, VNode::of(root), 0, VMap::hashof(k), k, v, added), pnode));
+        count += added;
+    }
+    // An emptied node comes back with no values. Children left with a single entry give it to their parent.
+    inline VNode* VPMap::remove(Heap &heap, VNode* node, int shift, size_t h, const Val &key, bool &removed)
+    {
+        Val vals[64];
+        if (shift >= 64)
+        {
+            for (uint32_t e = 0; e < node->n; e += 2)
+                if (VMap::samekey(node->vals()[e], key))
+                {
+                    auto c = newnode(heap, node->vals(), node->n, 0, 0, edit);
+                    std::copy(c->vals() + e + 2, c->vals() + c->n, c->vals() + e);
+                    c->n -= 2;
+                    c->vals()[c->n] = c->vals()[c->n + 1] = Val();
+                    removed = true;
+                    return c;
+                }
+            return node;
+        }
+        uint32_t bit = 1u << ((h >> shift) & 31);
+        uint32_t entries = 2 * __builtin_popcount(node->datamap);
+        if (node->datamap & bit)
+        {
+            uint32_t e = 2 * __builtin_popcount(node->datamap & (bit - 1));
+            if (!VMap::samekey(node->vals()[e], key))
+                return node;
+            std::copy(node->vals(), node->vals() + e, vals);
+            std::copy(node->vals() + e + 2, node->vals() + node->n, vals + e);
+            removed = true;
+            return newnode(heap, vals, node->n - 2, node->datamap ^ bit, node->nodemap, edit);
+        }
+        if (!(node->nodemap & bit))
+            return node;
+        uint32_t at = entries + __builtin_popcount(node->nodemap & (bit - 1));
+        auto child = VNode::of(node->vals()[at]);
+        auto changed = remove(heap, child, shift + 5, h, key, removed);
+        if (changed == child)
+            return node;
+        if (changed->n == 0)
+        {
+            std::copy(node->vals(), node->vals() + at, vals);
+            std::copy(node->vals() + at + 1, node->vals() + node->n, vals + at);
+            return newnode(heap, vals, node->n - 1, node->datamap, node->nodemap ^ bit, edit);
+        }
+        if (changed->n == 2 && changed->nodemap == 0)
+        {
+            // The last entry below moves up into this node
+            uint32_t e = 2 * __builtin_popcount(node->datamap & (bit - 1));
+            std::copy(node->vals(), node->vals() + e, vals);
+            vals[e] = changed->vals()[0];
+            vals[e+1] = changed->vals()[1];
+            std::copy(node->vals() + e, node->vals() + at, vals + e + 2);
+            std::copy(node->vals() + at + 1, node->vals() + node->n, vals + at + 2);
+            return newnode(heap, vals, node->n + 1, node->datamap | bit, node->nodemap ^ bit, edit);
+        }
+        auto c = editable(heap, node, edit, node->n);
+        heap.store(c, c->vals()[at], Val(changed, pnode));
+        return c;
+    }
+    inline bool VPMap::remove(Heap &heap, const Val &key)
+    {
+        if (root.isnil() || !VMap::iskey(key))
+            return false;
+        Val k = key.tag == number && key.n == 0 ? Val(0.0) : key;
+        bool removed = false;
+        heap.store(this, root, Val(remove(heap, VNode::of(root), 0, VMap::hashof(k), k, removed), pnode));
+        count -= removed;
+        return removed;
+    }
+    inline VPMap* VPMap::version(Heap &heap, bool transient) const
+    {
+        auto c = heap.alloc<VPMap>(*this);
+        c->edit = transient ? heap.newedit() : 0;
+        heap.barrier(c, root);
+        return c;
+    }
+    inline void VPMap::trace(Heap &heap) {heap.visit(root);}
+
+    inline void VSeq::trace(Heap &heap)
+    {
+        heap.visit(from);
+        heap.visit(fn);
+    }
+
+    inline std::string &tostr(const Val &v) {return ((VString*)v.o)->str;}
+    // Text of a string about to change in place, which forgets its hash
+    inline std::string &mutstr(const Val &v)
+    {
+        ((VString*)v.o)->hash = 0;
+        return ((VString*)v.o)->str;
+    }
+    inline Val &unbox(const Val &v) {return ((VBox*)v.o)->v;}
+    inline Val* upvals(const Val &fn) {return ((VFunction*)fn.o)->upvals();}
+
+    inline bool truthy(const Val &v)
+    {
+        if (v.tag == boolean)
+            return v.b;
+        return v.tag != nil && v.tag != null;
+    }
+
+    // Numbers compare with the same tolerance LFloat uses
+    inline bool numequals(double a, double b) {return b > a-0.0001 && b < a+0.0001;}
+    inline bool equals(const Val &a, const Val &b)
+    {
+        if (a.tag != b.tag)
+            return false;
+        switch(a.tag)
+        {
+            case number:
+                return numequals(a.n, b.n);
+            case boolean:
+                return a.b == b.b;
+            case string:
+                return a.o == b.o || tostr(a) == tostr(b);
+            case nil:
+            case null:
+                return true;
+            default:
+                return a.o == b.o;
+        }
+    }
+
+    inline std::string tostring(const Val &v, int depth = 0)
+    {
+        switch(v.tag)
+        {
+            case array:
+            {
+                // Arrays holding themselves stop somewhere
+                if (depth > 8)
+                    return "[...]";
+                auto a = (VArray*)v.o;
+                std::string str = "[";
+                for (size_t i = 0; i < a->length(); ++i)
+                {
+                    if (i > 0)
+                        str += ", ";
+                    str += tostring(a->get(i), depth + 1);
+                }
+                return str + "]";
+            }
+            case map:
+            {
+                if (depth > 8)
+                    return "{...}";
+                auto m = (VMap*)v.o;
+                std::string str = "{";
+                for (auto &e : m->entries)
+                    if (!e.key.isnil())
+                    {
+                        if (str.size() > 1)
+                            str += ", ";
+                        str += tostring(e.key, depth + 1) + ": " + tostring(e.value, depth + 1);
+                    }
+                return str + "}";
+            }
+            case pvector:
+            {
+                if (depth > 8)
+                    return "[...]";
+                auto p = (VPVector*)v.o;
+                std::string str = "[";
+                for (size_t i = 0; i < p->length(); ++i)
+                {
+                    if (i > 0)
+                        str += ", ";
+                    str += tostring(p->get(i), depth + 1);
+                }
+                return str + "]";
+            }
+            case pmap:
+            {
+                if (depth > 8)
+                    return "{...}";
+                std::string str = "{";
+                ((VPMap*)v.o)->each([&](const Val &k, const Val &e)
+                {
+                    if (str.size() > 1)
+                        str += ", ";
+                    str += tostring(k, depth + 1) + ": " + tostring(e, depth + 1);
+                });
+                return str + "}";
+            }
+            case record:
+            {
+                auto r = (VRecord*)v.o;
+                if (depth > 8)
+                    return r->layout->name + "(...)";
+                std::string str = r->layout->name + "(";
+                for (size_t f = 0; f < r->length(); ++f)
+                {
+                    if (f > 0)
+                        str += ", ";
+                    str += r->layout->names[f] + ": " + tostring(r->fields()[f], depth + 1);
+                }
+                return str + ")";
+            }
+            case number:
+                return stringf("%.14g", v.n);
+            case boolean:
+                return v.b ? "true" : "false";
+            case string:
+                return tostr(v);
+            case function:
+                return "function";
+            case native:
+                return stringf("function: %s", ((VNative*)v.o)->name.c_str());
+            case seq:
+                return "sequence";
+            default:
+                return "nil";
+        }
+    }
+
+    inline const char* typname(const Val &v)
+    {
+        switch(v.tag)
+        {
+            case number: return "number";
+            case boolean: return "boolean";
+            case string: return "string";
+            case function:
+            case native: return "function";
+            case array: return "array";
+            case map: return "map";
+            case record: return ((VRecord*)v.o)->layout->name.c_str();
+            case pvector: return "pvector";
+            case pmap: return "pmap";
+            case seq: return "sequence";
+            default: return "nil";
+        }
+    }
+}
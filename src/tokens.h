@@ -9,11 +9,13 @@ enum Tokens
     tok_ret,
     tok_true,
     tok_false,
+    tok_nil,
     tok_if,
     tok_else,
     tok_while,
     tok_for,
     tok_break,
+    tok_record,
     tok_scope,
     tok_extern,
     tok_number, // start Identity stuff
@@ -16,7 +16,17 @@ namespace vtex
         nan,
         number,
         string,
-        boolean
+        boolean,
+        function,
+        native,
+        box, // A captured variable that gets assigned, only ever seen in registers and upvalues
+        array,
+        map,
+        record,
+        pvector,
+        pmap,
+        seq,
+        pnode // A node of a persistent collection, only ever seen inside one
     };
 
     class Type
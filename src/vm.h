@@ -0,0 +1,1548 @@
+#pragma once
+
+#include "IR.h"
+#include "kernels.h"
+#include "runtime.h"
+#include "vstring.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Threaded dispatch needs the labels as values extension of GCC and Clang,
+// everything else uses the portable switch loop
+#if defined(VTEX_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define VTEX_THREADED
+#endif
+
+// The template JIT emits x86-64 System V code into mmaped memory
+#if defined(VTEX_BASELINE_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define VTEX_BASELINE
+#endif
+
+// Any native tier, functions get counted and entered through VM::enter
+#if defined(VTEX_BASELINE) || defined(VTEX_JIT)
+#define VTEX_TIERS
+#endif
+
+namespace vtex
+{
+    #if defined(VTEX_BASELINE)
+    // Copies machine code templates for a function, see baseline.h
+    bool baselinecompile(VM &vm, Proto* p);
+    #endif
+    #if defined(VTEX_JIT)
+    // Compiles a hot function with LLVM, see jitcompiler.h
+    bool jitcompile(VM &vm, Proto* p);
+    #endif
+
+    struct CallFrame
+    {
+        Proto* proto = nullptr;
+        const Instr* pc = nullptr;
+        Val* base = nullptr; // R[0] of the frame, the called function sits in base[-1]
+    };
+
+    // Creates a closure of p in ra, copying its upvalues out of the frame at base. A closure
+    // capturing the register it is created in captures itself, so local functions can recurse.
+    inline void closure(Heap &heap, Proto* p, Val* base, Val* ra)
+    {
+        auto c = heap.closure(p, (int)p->upvals.size());
+        *ra = Val(c, function);
+        auto up = c->upvals();
+        for (int u = 0; u < c->nupvals; ++u)
+        {
+            auto &uv = p->upvals[u];
+            up[u] = uv.local ? base[uv.index] : upvals(base[-1])[uv.index];
+            if (up[u].isobj())
+                up[u].o->shared = true;
+            heap.barrier(c, up[u]);
+        }
+    }
+
+    // fmod is a slow library loop, whole numbers that a double holds exactly can use the integer divide
+    inline double modulo(double b, double c)
+    {
+        const double exact = 9007199254740992.0;
+        if (std::fabs(b) < exact && std::fabs(c) < exact && c != 0 && (double)(int64_t)b == b && (double)(int64_t)c == c)
+        {
+            auto r = (double)((int64_t)b % (int64_t)c);
+            return r == 0 && b < 0 ? -0.0 : r;
+        }
+        return std::fmod(b, c);
+    }
+
+    inline Val elementwise(Heap &heap, OpCode op, const Val &b, const Val &c, bool into);
+
+    // Generic operator semantics, the interpreter handles number op number inline
+    // and falls back to this for everything else. Mismatched types produce nil.
+    // into says the result replaces b, an array nobody else sees is then updated in place.
+    inline Val arith(Heap &heap, OpCode op, const Val &b, const Val &c, bool into = false)
+    {
+        if ((b.tag == array || c.tag == array) && b.tag != string && ((op >= OP_ADD && op <= OP_MOD) || op == OP_LT || op == OP_GT))
+            return elementwise(heap, op, b, c, into);
+        switch(op)
+        {
+            case OP_ADD:
+                if (b.tag == number && c.tag == number)
+                    return Val(b.n + c.n);
+                if (b.tag == number && c.tag == boolean)
+                    return Val(b.n + (double)c.b);
+                if (b.tag == boolean && c.tag == boolean)
+                    return Val(b.b || c.b);
+                if (b.tag == string)
+                    return heap.string(tostr(b) + tostring(c));
+                return Val();
+            case OP_SUB:
+                if (b.tag == number && c.tag == number)
+                    return Val(b.n - c.n);
+                if (b.tag == number && c.tag == boolean)
+                    return Val(b.n - (double)c.b);
+                return Val();
+            case OP_MUL:
+                return b.tag == number && c.tag == number ? Val(b.n * c.n) : Val();
+            case OP_DIV:
+                return b.tag == number && c.tag == number ? Val(b.n / c.n) : Val();
+            case OP_MOD:
+                return b.tag == number && c.tag == number ? Val(modulo(b.n, c.n)) : Val();
+            case OP_EQ:
+                return Val(equals(b, c));
+            case OP_NE:
+                return Val(!equals(b, c));
+            case OP_LT:
+                return b.tag == number && c.tag == number ? Val(b.n < c.n) : Val();
+            case OP_GT:
+                return b.tag == number && c.tag == number ? Val(b.n > c.n) : Val();
+            case OP_LE:
+                return b.tag == number && c.tag == number ? Val(b.n < c.n || equals(b, c)) : Val();
+            case OP_GE:
+                return b.tag == number && c.tag == number ? Val(b.n > c.n || equals(b, c)) : Val();
+            default:
+                return Val();
+        }
+    }
+
+    // x += y on a global or a box: a string or array nothing but the slot holds is updated in place
+    inline Val addinto(Heap &heap, const Val &x, const Val &y)
+    {
+        if (x.tag == string && !x.o->shared)
+        {
+            mutstr(x) += tostring(y);
+            return x;
+        }
+        return arith(heap, OP_ADD, x, y, true);
+    }
+
+    // Arithmetic and < > with an array side apply to every element, arrays must have the same length
+    // or the result is nil. Number arrays and numbers run the vector kernels, anything else goes
+    // through arith one element at a time into a boxed array.
+    inline Val elementwise(Heap &heap, OpCode op, const Val &b, const Val &c, bool into)
+    {
+        auto x = b.tag == array ? (VArray*)b.o : nullptr;
+        auto y = c.tag == array ? (VArray*)c.o : nullptr;
+        size_t n = x ? x->length() : y->length();
+        if (x && y && y->length() != n)
+            return Val();
+        if ((x ? !x->boxed : b.tag == number) && (y ? !y->boxed : c.tag == number))
+        {
+            Val result = into && x && !x->shared ? b : Val(heap.alloc<VArray>(), array);
+            auto out = ((VArray*)result.o)->numbers(heap, n);
+            simd::Operand xs = {x ? x->nums.data() : &b.n, !x}, ys = {y ? y->nums.data() : &c.n, !y};
+            if (op == OP_MOD)
+            {
+                for (size_t i = 0; i < n; ++i)
+                    out[i] = modulo(xs.p[xs.scalar ? 0 : i], ys.p[ys.scalar ? 0 : i]);
+            } else
+                simd::elementwise(op, out, xs, ys, n);
+            return result;
+        }
+        auto out = heap.alloc<VArray>();
+        Val result(out, array);
+        out->reserve(heap, n);
+        for (size_t i = 0; i < n; ++i)
+            out->push(heap, arith(heap, op, x ? x->get(i) : b, y ? y->get(i) : c));
+        return result;
+    }
+
+    class VM
+    {
+        public:
+            // Record types, by the number NEWRECORD has. Before the heap, whose records need them until it is gone.
+            std::vector<std::unique_ptr<Layout>> layouts;
+            Heap heap;
+            std::vector<std::unique_ptr<Proto>> protos;
+            std::vector<Val> globals; // Global variables, loads and stores index them by slot
+            std::unordered_map<std::string, int> globalslots; // Slot of every global name, for the compiler and embedders
+            std::vector<Val> functions; // Global functions and natives, calls index them by slot
+            std::unordered_map<std::string, int> functionslots; // Slot of every function name, for the compiler
+            std::unordered_map<std::string, int> layoutids; // Record type of every name, for the compiler
+            std::vector<std::string> fieldnames; // Field names of all record types, by id
+            std::unordered_map<std::string, int> fieldids;
+            std::vector<FieldKey> fieldkeys; // Fields as GETFIELD and SETFIELD name them
+            std::vector<Val> stack; // One contiguous value stack shared by every frame, never reallocated
+            Val* stackhigh = nullptr; // End of the highest frame since the last collection
+            std::vector<CallFrame> frames;
+            size_t maxframes = 200000;
+            bool nativefailed = false; // A function a native called back ran into a runtime error, see callnative()
+            int callbacks = 0; // Natives calling script functions back, nested on the C stack
+            int maxcallbacks = 1000;
+            uint64_t executed = 0; // Dispatched instructions, counted with VTEX_COUNT_OPS
+            #if defined(VTEX_PROFILE_PAIRS)
+            uint64_t pairs[OP_COUNT][OP_COUNT] = {}; // How often each opcode was directly followed by another
+            int lastop = OP_COUNT;
+            #endif
+            #if defined(VTEX_TIERS)
+            uint32_t baselinethreshold = 1; // Calls plus loop back edges before a function gets template compiled
+            uint32_t jitthreshold = 1000; // And before it gets optimized
+            int maxdeopts = 10; // Failed guards before a function stays out of the optimizing tier
+            int nativedepth = 0; // Compiled code and interpreter loops nested on the C stack
+            int maxnativedepth = 2000;
+            size_t baselined = 0;
+            size_t jitted = 0;
+            size_t deopts = 0;
+            #endif
+
+            VM(size_t stacksize = 1 << 20) : stack(stacksize) {}
+
+            Proto* newproto(std::string name)
+            {
+                protos.push_back(std::make_unique<Proto>());
+                protos.back()->name = name;
+                return protos.back().get();
+            }
+
+            // Slot of the global function name, names seen for the first time get an empty one
+            int functionslot(const std::string &name)
+            {
+                auto itr = functionslots.find(name);
+                if (itr != functionslots.end())
+                    return itr->second;
+                functions.push_back(Val());
+                return functionslots[name] = (int)functions.size()-1;
+            }
+
+            // Slot of the global variable name, handed out at compile time. Compiled code keeps the
+            // address of its slots, so new names can only come in before run()
+            int globalslot(const std::string &name)
+            {
+                auto itr = globalslots.find(name);
+                if (itr != globalslots.end())
+                    return itr->second;
+                globals.push_back(Val());
+                return globalslots[name] = (int)globals.size()-1;
+            }
+
+            int fieldid(const std::string &name)
+            {
+                auto itr = fieldids.find(name);
+                if (itr != fieldids.end())
+                    return itr->second;
+                fieldnames.push_back(name);
+                return fieldids[name] = (int)fieldnames.size()-1;
+            }
+
+            // Index of the key for a field name expected at offset
+            int fieldkey(int name, int offset)
+            {
+                for (size_t k = 0; k < fieldkeys.size(); ++k)
+                    if (fieldkeys[k].name == name && fieldkeys[k].offset == offset)
+                        return (int)k;
+                fieldkeys.push_back({name, offset});
+                return (int)fieldkeys.size()-1;
+            }
+
+            // Declares a record type with the given fields, -1 if the name is taken
+            int deflayout(const std::string &name, const std::vector<std::string> &fields)
+            {
+                if (layoutids.count(name))
+                    return -1;
+                auto l = std::make_unique<Layout>();
+                l->name = name;
+                l->names = fields;
+                for (auto &f : fields)
+                    l->ids.push_back(fieldid(f));
+                layouts.push_back(std::move(l));
+                return layoutids[name] = (int)layouts.size()-1;
+            }
+
+            // Name keyed access for embedding and debugging, unknown names read as nil
+            Val getglobal(const std::string &name)
+            {
+                auto itr = globalslots.find(name);
+                return itr != globalslots.end() ? globals[itr->second] : Val();
+            }
+            void setglobal(const std::string &name, Val v)
+            {
+                globals[globalslot(name)] = v;
+            }
+
+            // Natives live in the function table next to user functions
+            void defnative(const std::string &name, nativefn fn)
+            {
+                functions[functionslot(name)] = Val(heap.alloc<VNative>(name, fn), native);
+            }
+
+            // Runs a top level chunk, returns false if a runtime error occurred
+            bool run(Proto* main)
+            {
+                frames.clear();
+                if ((size_t)main->nregs+1 > stack.size())
+                    return runtimeerror("Stack overflow");
+                // stack[0] stands in for the called function so base[-1] always exists
+                frames.push_back({main, main->code.data(), stack.data()+1});
+                stackhigh = std::max(stackhigh, stack.data()+1 + main->nregs);
+                heap.startnursery();
+                #if defined(VTEX_TIERS)
+                switch(enter())
+                {
+                    case 1: return true;
+                    case -1: return false;
+                }
+                #endif
+                return execute(0);
+            }
+
+            // Calls fn with the nargs values behind it and leaves the result in *fn, for
+            // callers outside of the interpreter loop. Returns false if a runtime error occurred.
+            bool call(Val* fn, int nargs)
+            {
+                if (fn->tag == native)
+                    return callnative(fn, nargs, *fn);
+                if (fn->tag != function)
+                    return runtimeerror(stringf("Attempt to call a %s value", typname(*fn)));
+                size_t depth = frames.size();
+                if (!pushframe(fn, nargs))
+                    return false;
+                #if defined(VTEX_TIERS)
+                switch(enter())
+                {
+                    case 1: return true;
+                    case -1: return false;
+                }
+                ++nativedepth;
+                bool ok = execute(depth);
+                --nativedepth;
+                return ok;
+                #else
+                return execute(depth);
+                #endif
+            }
+
+            #if defined(VTEX_PROFILE_PAIRS)
+            // Appends "<first> <second> <count>" lines, so runs over a corpus accumulate in one file
+            void dumppairs(FILE* out)
+            {
+                for (int a = 0; a < OP_COUNT; ++a)
+                    for (int b = 0; b < OP_COUNT; ++b)
+                        if (pairs[a][b] > 0)
+                            fprintf(out, "%s %s %llu\n", opnames[a], opnames[b], (unsigned long long)pairs[a][b]);
+            }
+            #endif
+
+            // Tail call of fn with the nargs values behind it from the newest frame. A script function
+            // takes the frame over with its arguments moved down to the frames base. Returns 0 then, 1
+            // once a native returned its result to base[-1] and -1 on a runtime error.
+            int tailcall(Val* fn, int nargs)
+            {
+                Val* base = frames.back().base;
+                if (fn->tag == native)
+                    return callnative(fn, nargs, base[-1]) ? 1 : -1;
+                if (fn->tag != function)
+                {
+                    runtimeerror(stringf("Attempt to call a %s value", typname(*fn)));
+                    return -1;
+                }
+                Proto* p = ((VFunction*)fn->o)->proto;
+                if (base + p->nregs > stack.data() + stack.size())
+                {
+                    runtimeerror("Stack overflow");
+                    return -1;
+                }
+                std::copy(fn, fn + 1 + nargs, base - 1);
+                for (int a = nargs; a < p->nparams; ++a)
+                    base[a] = Val();
+                frames.back() = {p, p->code.data(), base};
+                stackhigh = std::max(stackhigh, base + p->nregs);
+                ++p->calls;
+                return 0;
+            }
+
+            // Sets up the counting loop at r for OP_FORPREP, 1 if it makes any trips, 0 if none and -1 on a runtime error
+            int forprep(Val* r)
+            {
+                for (int b : {2, 1, 3})
+                    if (r[b].tag != number)
+                    {
+                        runtimeerror(stringf("Attempt to count a for loop with a %s value", typname(r[b])));
+                        return -1;
+                    }
+                if (r[3].n == 0)
+                {
+                    runtimeerror("For loop step is 0");
+                    return -1;
+                }
+                r[0] = Val(0.0);
+                r[1] = Val(trips(r[2], r[1], r[3]));
+                r[4] = r[2];
+                return r[1].n > 0;
+            }
+
+            // Runs the array or record instruction i of the frame at base, the interpreter only inlines the
+            // number case of the element accesses and the fields at the offset the compiler expected them.
+            // Subscripts of maps look up and store keys. Returns false after a runtime error.
+            bool arrayop(Instr i, Val* base)
+            {
+                auto &ra = base[GetA(i)];
+                switch(GetOp(i))
+                {
+                    case OP_NEWARRAY:
+                    {
+                        auto a = heap.alloc<VArray>();
+                        a->reserve(heap, GetC(i));
+                        ra = Val(a, array);
+                        for (int e = 1; e <= GetB(i); ++e)
+                            a->push(heap, (&ra)[e]);
+                        return true;
+                    }
+                    case OP_APPEND:
+                        for (int e = 1; e <= GetB(i); ++e)
+                            ((VArray*)ra.o)->push(heap, (&ra)[e]);
+                        return true;
+                    case OP_GETINDEX:
+                    case OP_GETELEM:
+                    {
+                        auto &rb = base[GetB(i)];
+                        if (rb.tag == map)
+                            ra = ((VMap*)rb.o)->get(base[GetC(i)]);
+                        else if (rb.tag == pmap)
+                            ra = ((VPMap*)rb.o)->get(base[GetC(i)]);
+                        else
+                        {
+                            int64_t at = element(rb, base[GetC(i)]);
+                            if (at < 0)
+                                return false;
+                            ra = rb.tag == array ? ((VArray*)rb.o)->get(at) : ((VPVector*)rb.o)->get(at);
+                        }
+                        if (ra.isobj())
+                            ra.o->shared = true;
+                        return true;
+                    }
+                    case OP_NEWRECORD:
+                    {
+                        auto r = heap.record(layouts[GetC(i)].get());
+                        for (int f = 0; f < GetB(i); ++f)
+                        {
+                            auto &v = (&ra)[1 + f];
+                            if (v.isobj())
+                                v.o->shared = true;
+                            r->fields()[f] = v;
+                            heap.barrier(r, v);
+                        }
+                        ra = Val(r, record);
+                        return true;
+                    }
+                    case OP_GETFIELD:
+                    {
+                        auto &rb = base[GetB(i)];
+                        int f = field(rb, GetC(i));
+                        if (f < 0)
+                            return false;
+                        ra = ((VRecord*)rb.o)->fields()[f];
+                        if (ra.isobj())
+                            ra.o->shared = true;
+                        return true;
+                    }
+                    case OP_SETFIELD:
+                    {
+                        int f = field(ra, GetB(i));
+                        if (f < 0)
+                            return false;
+                        auto &v = base[GetC(i)];
+                        if (v.isobj())
+                            v.o->shared = true;
+                        heap.store(ra.o, ((VRecord*)ra.o)->fields()[f], v);
+                        return true;
+                    }
+                    case OP_SETINDEX:
+                    case OP_SETELEM:
+                    {
+                        // Persistent collections only change while transient
+                        if ((ra.tag == pvector && !((VPVector*)ra.o)->edit) || (ra.tag == pmap && !((VPMap*)ra.o)->edit))
+                            return runtimeerror(stringf("Attempt to change a %s, use with() or a transient", typname(ra)));
+                        if (ra.tag == map || ra.tag == pmap)
+                        {
+                            auto &key = base[GetB(i)];
+                            if (!VMap::iskey(key))
+                                return runtimeerror(key.tag == number ? "Attempt to use NaN as a map key" : stringf("Attempt to use a %s value as a map key", typname(key)));
+                            if (ra.tag == map)
+                                ((VMap*)ra.o)->set(heap, key, base[GetC(i)]);
+                            else
+                                ((VPMap*)ra.o)->set(heap, key, base[GetC(i)]);
+                            return true;
+                        }
+                        int64_t at = element(ra, base[GetB(i)]);
+                        if (at < 0)
+                            return false;
+                        if (ra.tag == array)
+                            ((VArray*)ra.o)->set(heap, at, base[GetC(i)]);
+                        else
+                            ((VPVector*)ra.o)->set(heap, at, base[GetC(i)]);
+                        return true;
+                    }
+                    default:
+                        return runtimeerror(stringf("Bad opcode %i", GetOp(i)));
+                }
+            }
+
+            // Lists the recursive calls that are no tail calls in functions called at least mincalls times,
+            // each of them keeps a frame alive per level
+            void reportrecursion(uint64_t mincalls, FILE* out = stderr)
+            {
+                for (const auto &p : protos)
+                    if (p->calls >= mincalls)
+                        for (size_t c = 0; c < p->selfcalls.size(); ++c)
+                            if (c == 0 || p->lines[p->selfcalls[c]] != p->lines[p->selfcalls[c-1]])
+                                fprintf(out, "%s [Ln %zu]: recursive call is not a tail call, %s was called %llu times\n",
+                                    p->name.c_str(), p->lines[p->selfcalls[c]], p->name.c_str(), (unsigned long long)p->calls);
+            }
+
+            // Runs the collection the heap asked for, at a safepoint: every register that may hold an
+            // object is in the frames up to the newest ones registers. A major collection in progress
+            // goes on for a slice. Returns false past the heap limit.
+            bool collect()
+            {
+                heap.wantgc = false;
+                Val* top = frames.back().base + frames.back().proto->nregs;
+                auto roots = [&](bool constants)
+                {
+                    for (Val* v = stack.data(); v < top; ++v)
+                        heap.visit(*v);
+                    for (auto &global : globals)
+                        heap.visit(global);
+                    for (auto &fn : functions)
+                        heap.visit(fn);
+                    if (constants)
+                        for (auto &p : protos)
+                            for (auto &kv : p->k)
+                                heap.visit(kv);
+                };
+                heap.collectminor([&] {roots(false);});
+                // What returned frames left above the top is dead, the next frames must not see it
+                std::fill(top, std::max(top, stackhigh), Val());
+                stackhigh = top;
+                if (heap.majordue())
+                    heap.startmajor([&] {roots(true);});
+                if (heap.phase != Heap::idle)
+                    heap.advance();
+                if (heap.heaplimit == 0 || heap.oldbytes <= heap.heaplimit)
+                    return true;
+                // Over the limit, only a complete collection tells whether it really is
+                heap.finish();
+                heap.startmajor([&] {roots(true);});
+                heap.finish();
+                if (heap.oldbytes > heap.heaplimit)
+                    return runtimeerror(stringf("Out of memory, %zu KB live exceed the heap limit of %zu KB", heap.oldbytes >> 10, heap.heaplimit >> 10));
+                return true;
+            }
+
+            bool runtimeerror(const std::string &msg)
+            {
+                fprintf(stderr, "RUNTIME ERROR: %s\n", msg.c_str());
+                size_t shown = 0;
+                for (auto i = frames.rbegin(); i != frames.rend(); ++i, ++shown)
+                {
+                    if (shown == 10)
+                    {
+                        fprintf(stderr, "\t... %zu more\n", frames.size()-shown);
+                        break;
+                    }
+                    auto pc = i->pc - i->proto->code.data();
+                    if (pc > 0)
+                        --pc;
+                    fprintf(stderr, "\tin %s [Ln %zu]\n", i->proto->name.c_str(), i->proto->lines.empty() ? 0 : i->proto->lines[pc]);
+                }
+                return false;
+            }
+
+        private:
+            // Position of the element of a subscripted at index, -1 after a runtime error
+            int64_t element(const Val &a, const Val &index)
+            {
+                if (a.tag != array && a.tag != pvector)
+                {
+                    runtimeerror(stringf("Attempt to index a %s value", typname(a)));
+                    return -1;
+                }
+                size_t n = a.tag == array ? ((VArray*)a.o)->length() : ((VPVector*)a.o)->length();
+                int64_t at = index.tag == number ? position(index.n, n) : -1;
+                if (at < 0)
+                    runtimeerror(stringf("%s index %s is out of range, the %s has %zu elements", a.tag == array ? "Array" : "Vector",
+                        tostring(index).c_str(), typname(a), n));
+                return at;
+            }
+
+            // Offset of the field of key k in the record r, -1 after a runtime error
+            int field(const Val &r, int k)
+            {
+                auto &name = fieldnames[fieldkeys[k].name];
+                if (r.tag != record)
+                {
+                    runtimeerror(stringf("Attempt to access field \"%s\" of a %s value", name.c_str(), typname(r)));
+                    return -1;
+                }
+                int f = ((VRecord*)r.o)->layout->offset(fieldkeys[k]);
+                if (f < 0)
+                    runtimeerror(stringf("Record %s has no field \"%s\"", typname(r), name.c_str()));
+                return f;
+            }
+
+            // Runs the native in fn with the nargs values behind it. Natives that call script functions back
+            // set nativefailed when one of them ran into a runtime error, which the caller of the native stops on.
+            bool callnative(Val* fn, int nargs, Val &result)
+            {
+                result = ((VNative*)fn->o)->fn(*this, fn+1, nargs);
+                if (!nativefailed)
+                    return true;
+                nativefailed = false;
+                return false;
+            }
+
+            // Pushes the frame of the script function in fn, with nargs arguments behind it
+            bool pushframe(Val* fn, int nargs)
+            {
+                Proto* p = ((VFunction*)fn->o)->proto;
+                Val* nbase = fn+1;
+                if (nbase + p->nregs > stack.data() + stack.size() || frames.size() >= maxframes)
+                    return runtimeerror("Stack overflow");
+                // Missing arguments are nil, extra ones are ignored
+                for (int a = nargs; a < p->nparams; ++a)
+                    nbase[a] = Val();
+                frames.push_back({p, p->code.data(), nbase});
+                stackhigh = std::max(stackhigh, nbase + p->nregs);
+                ++p->calls;
+                return true;
+            }
+
+            #if defined(VTEX_TIERS)
+            // Compiles p for the best tier its hotness reached
+            void tierup(Proto* p)
+            {
+                #if defined(VTEX_BASELINE)
+                if (p->tier == 0 && !p->nobaseline && p->hotness >= baselinethreshold && baselinecompile(*this, p))
+                {
+                    p->jit = p->baseline;
+                    p->tier = 1;
+                    ++baselined;
+                }
+                #endif
+                #if defined(VTEX_JIT)
+                if (p->tier < 2 && !p->nojit && p->hotness >= jitthreshold && jitcompile(*this, p))
+                {
+                    p->tier = 2;
+                    ++jitted;
+                }
+                #endif
+                // Slower code still running in a loop of p leaves it once hotness gets here
+                uint32_t next = UINT32_MAX;
+                #if defined(VTEX_JIT)
+                if (!p->nojit)
+                    next = p->tier == 2 ? 0 : jitthreshold;
+                #endif
+                #if defined(VTEX_BASELINE)
+                if (p->tier == 0 && !p->nobaseline && baselinethreshold < next)
+                    next = baselinethreshold;
+                #endif
+                p->tierup = next;
+            }
+
+            // Runs the newest frame as native code from pc, 0 or a loop header. Returns 1 if
+            // the function returned, 0 to interpret it from its pc and -1 on a runtime error.
+            int runnative(int64_t pc)
+            {
+                Proto* p = frames.back().proto;
+                Val* nbase = frames.back().base;
+                while (p->jit && nativedepth < maxnativedepth)
+                {
+                    jitfn code = p->jit;
+                    ++nativedepth;
+                    int64_t r = code(this, nbase, pc);
+                    --nativedepth;
+                    if (r == -1)
+                    {
+                        frames.pop_back();
+                        return 1;
+                    }
+                    if (r == -2)
+                        return -1;
+                    if (r == -3)
+                    {
+                        // A tail call replaced the function of the frame, which starts over
+                        p = frames.back().proto;
+                        entered(p, nbase);
+                        pc = 0;
+                        continue;
+                    }
+                    frames.back().pc = p->code.data() + r;
+                    if (code == p->baseline)
+                    {
+                        // Template code left a hot loop at its header, go on there in whatever is best now
+                        loopfeedback(p, nbase);
+                        tierup(p);
+                        pc = r;
+                        continue;
+                    }
+                    // A guard failed, the registers are back in the frame. The code goes, the interpreter
+                    // records the types that failed and p gets optimized again once it is hot again.
+                    // Template code has no guards that could fail.
+                    ++deopts;
+                    p->jit = p->baseline;
+                    p->tier = !!p->baseline;
+                    p->hotness = 0;
+                    if (++p->deopts >= maxdeopts)
+                        p->nojit = true;
+                    tierup(p);
+                    return 0;
+                }
+                return 0;
+            }
+
+            void loopfeedback(Proto* p, const Val* nbase)
+            {
+                p->loopfeedback.resize(p->nregs);
+                for (int r = 0; r < p->nregs; ++r)
+                    p->loopfeedback[r] |= typebit(nbase[r]);
+            }
+
+            // Called for the newest frame when it gets called, see runnative()
+            int enter()
+            {
+                entered(frames.back().proto, frames.back().base);
+                return runnative(0);
+            }
+
+            void entered(Proto* p, const Val* nbase)
+            {
+                if (p->tier < 2)
+                {
+                    p->feedback.resize(p->nparams);
+                    for (int a = 0; a < p->nparams; ++a)
+                        p->feedback[a] |= typebit(nbase[a]);
+                    ++p->hotness;
+                    tierup(p);
+                }
+            }
+
+            // On-stack replacement, called for the newest frame when a back edge to the loop header
+            // at its pc reached tierup. The registers stay where they are, the native code picks them
+            // up from the frame, see runnative()
+            int osr()
+            {
+                auto &frame = frames.back();
+                Proto* p = frame.proto;
+                loopfeedback(p, frame.base);
+                tierup(p);
+                return runnative(frame.pc - p->code.data());
+            }
+            #endif
+
+            // Interprets until the frame count drops back to depth
+            bool execute(size_t depth)
+            {
+                CallFrame* frame = &frames.back();
+                const Instr* pc = frame->pc;
+                Val* base = frame->base;
+                const Val* k = frame->proto->k.data();
+                const Instr* code = frame->proto->code.data();
+                Instr i;
+
+                #define SAVEPC() (frame->pc = pc)
+                #if defined(VTEX_JIT)
+                uint16_t* slots = frame->proto->slots.data();
+                #define RELOAD() (frame = &frames.back(), pc = frame->pc, base = frame->base, k = frame->proto->k.data(), \
+                    code = frame->proto->code.data(), slots = frame->proto->slots.data())
+                // Type feedback of the running instruction, only the LLVM tier reads it
+                #define FEEDBACK(bits) (slots[pc - code - 1] |= (bits))
+                #else
+                #define RELOAD() (frame = &frames.back(), pc = frame->pc, base = frame->base, k = frame->proto->k.data(), \
+                    code = frame->proto->code.data())
+                #define FEEDBACK(bits) ((void)0)
+                #endif
+                // Calls and loop back edges collect when the heap asks for it
+                #define SAFEPOINT() if (heap.wantgc && (SAVEPC(), !collect())) return false
+                #if defined(VTEX_TIERS)
+                // A hot loop goes on in native code, also if p is compiled but this frame got deoptimized
+                #define BACKEDGE() \
+                { \
+                    SAFEPOINT(); \
+                    if (++frame->proto->hotness >= frame->proto->tierup || frame->proto->jit) \
+                    { \
+                        SAVEPC(); \
+                        switch(osr()) \
+                        { \
+                            case 1: \
+                                if (frames.size() == depth) \
+                                    return true; \
+                                break; \
+                            case -1: \
+                                return false; \
+                        } \
+                        RELOAD(); \
+                    } \
+                }
+                #else
+                #define BACKEDGE() {SAFEPOINT();}
+                #endif
+
+                #if defined(VTEX_PROFILE_PAIRS)
+                #define vmfetch() (i = *pc++, ++executed, lastop < OP_COUNT ? ++pairs[lastop][GetOp(i)] : 0, lastop = GetOp(i))
+                #elif defined(VTEX_COUNT_OPS)
+                #define vmfetch() (i = *pc++, ++executed)
+                #else
+                #define vmfetch() (i = *pc++)
+                #endif
+
+                #if defined(VTEX_THREADED)
+                // Direct threading: every handler ends in its own indirect jump, so the branch
+                // predictor learns per opcode which handler usually follows
+                #define VTEX_OPLABEL(name) &&L_OP_##name,
+                static const void* const disptab[OP_COUNT] = {VTEX_OPCODES(VTEX_OPLABEL)};
+                #undef VTEX_OPLABEL
+                #define vmdispatch(o) goto *disptab[o];
+                #define vmcase(l) L_##l:
+                #define vmbreak vmfetch(); vmdispatch(GetOp(i))
+                #else
+                #define vmdispatch(o) switch(o)
+                #define vmcase(l) case l:
+                #define vmbreak break
+                #endif
+
+                while (true)
+                {
+                    vmfetch();
+                    vmdispatch(GetOp(i))
+                    {
+                        vmcase(OP_MOVE)
+                        {
+                            auto &ra = base[GetA(i)];
+                            ra = base[GetB(i)];
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            vmbreak;
+                        }
+                        vmcase(OP_LOADK)
+                        {
+                            base[GetA(i)] = k[GetBx(i)];
+                            vmbreak;
+                        }
+                        vmcase(OP_LOADNIL)
+                        {
+                            base[GetA(i)] = Val();
+                            vmbreak;
+                        }
+                        vmcase(OP_LOADBOOL)
+                        {
+                            base[GetA(i)] = Val(GetB(i) != 0);
+                            vmbreak;
+                        }
+                        vmcase(OP_GETGLOBAL)
+                        {
+                            auto &ra = base[GetA(i)];
+                            ra = globals[GetBx(i)];
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            vmbreak;
+                        }
+                        vmcase(OP_SETGLOBAL)
+                        {
+                            auto &ra = base[GetA(i)];
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            globals[GetBx(i)] = ra;
+                            vmbreak;
+                        }
+                        vmcase(OP_GETFUNC)
+                        {
+                            base[GetA(i)] = functions[GetBx(i)];
+                            vmbreak;
+                        }
+                        vmcase(OP_SETFUNC)
+                        {
+                            functions[GetBx(i)] = base[GetA(i)];
+                            vmbreak;
+                        }
+                        vmcase(OP_ADD)
+                        {
+                            auto &ra = base[GetA(i)];
+                            auto &rb = base[GetB(i)];
+                            auto &rc = base[GetC(i)];
+                            if (rb.tag == number && rc.tag == number)
+                            {
+                                FEEDBACK(fb_numbers);
+                                ra.n = rb.n + rc.n;
+                                ra.tag = number;
+                                vmbreak;
+                            }
+                            FEEDBACK(typepair(rb, rc));
+                            if (&ra == &rb && rb.tag == string && !rb.o->shared)
+                            {
+                                // x += y on a string nobody else sees, append in place
+                                mutstr(rb) += tostring(rc);
+                            } else
+                                ra = arith(heap, OP_ADD, rb, rc, &ra == &rb);
+                            vmbreak;
+                        }
+
+                        // Binary operators with their number case inline, y is a register or a constant
+                        #define vmbinop(op, y, result) \
+                        { \
+                            auto &rb = base[GetB(i)]; \
+                            auto &rc = y[GetC(i)]; \
+                            if (rb.tag == number && rc.tag == number) \
+                            { \
+                                FEEDBACK(fb_numbers); \
+                                base[GetA(i)] = Val(result); \
+                            } else \
+                            { \
+                                FEEDBACK(typepair(rb, rc)); \
+                                base[GetA(i)] = arith(heap, op, rb, rc, &base[GetA(i)] == &rb); \
+                            } \
+                            vmbreak; \
+                        }
+                        vmcase(OP_SUB) vmbinop(OP_SUB, base, rb.n - rc.n)
+                        vmcase(OP_MUL) vmbinop(OP_MUL, base, rb.n * rc.n)
+                        vmcase(OP_DIV) vmbinop(OP_DIV, base, rb.n / rc.n)
+                        vmcase(OP_MOD) vmbinop(OP_MOD, base, modulo(rb.n, rc.n))
+                        vmcase(OP_EQ) vmbinop(OP_EQ, base, numequals(rb.n, rc.n))
+                        vmcase(OP_NE) vmbinop(OP_NE, base, !numequals(rb.n, rc.n))
+                        vmcase(OP_LT) vmbinop(OP_LT, base, rb.n < rc.n)
+                        vmcase(OP_LE) vmbinop(OP_LE, base, rb.n < rc.n || numequals(rb.n, rc.n))
+                        vmcase(OP_GT) vmbinop(OP_GT, base, rb.n > rc.n)
+                        vmcase(OP_GE) vmbinop(OP_GE, base, rb.n > rc.n || numequals(rb.n, rc.n))
+                        vmcase(OP_NOT)
+                        {
+                            base[GetA(i)] = Val(!truthy(base[GetB(i)]));
+                            vmbreak;
+                        }
+                        vmcase(OP_NEG)
+                        {
+                            auto &rb = base[GetB(i)];
+                            base[GetA(i)] = rb.tag == number ? Val(-rb.n) : Val();
+                            vmbreak;
+                        }
+                        vmcase(OP_JMP)
+                        {
+                            pc += GetsBx(i);
+                            if (GetsBx(i) < 0)
+                                BACKEDGE();
+                            vmbreak;
+                        }
+                        vmcase(OP_JMPIF)
+                        {
+                            if (truthy(base[GetA(i)]))
+                                pc += GetsBx(i);
+                            vmbreak;
+                        }
+                        vmcase(OP_JMPIFNOT)
+                        {
+                            if (!truthy(base[GetA(i)]))
+                                pc += GetsBx(i);
+                            vmbreak;
+                        }
+                        vmcase(OP_CLOSURE)
+                        {
+                            closure(heap, frame->proto->protos[GetBx(i)], base, base + GetA(i));
+                            vmbreak;
+                        }
+                        // Upvalues of the running closure, which sits in base[-1]
+                        vmcase(OP_GETUPVAL)
+                        {
+                            auto &ra = base[GetA(i)];
+                            ra = upvals(base[-1])[GetB(i)];
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            vmbreak;
+                        }
+                        vmcase(OP_GETUPBOX)
+                        {
+                            auto &ra = base[GetA(i)];
+                            ra = unbox(upvals(base[-1])[GetB(i)]);
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            vmbreak;
+                        }
+                        vmcase(OP_SETUPBOX)
+                        {
+                            auto &ra = base[GetA(i)];
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            auto &b = upvals(base[-1])[GetB(i)];
+                            heap.store(b.o, unbox(b), ra);
+                            vmbreak;
+                        }
+                        vmcase(OP_NEWBOX)
+                        {
+                            auto &ra = base[GetA(i)];
+                            ra = Val(heap.alloc<VBox>(ra), box);
+                            vmbreak;
+                        }
+                        vmcase(OP_GETBOX)
+                        {
+                            auto &ra = base[GetA(i)];
+                            ra = unbox(base[GetB(i)]);
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            vmbreak;
+                        }
+                        vmcase(OP_SETBOX)
+                        {
+                            auto &ra = base[GetA(i)];
+                            if (ra.isobj())
+                                ra.o->shared = true;
+                            heap.store(base[GetB(i)].o, unbox(base[GetB(i)]), ra);
+                            vmbreak;
+                        }
+                        vmcase(OP_CALL)
+                        call:
+                        {
+                            Val* fn = base + GetA(i);
+                            int nargs = GetB(i);
+                            SAVEPC();
+                            SAFEPOINT();
+                            FEEDBACK(typebit(*fn));
+                            if (fn->tag == function)
+                            {
+                                if (!pushframe(fn, nargs))
+                                    return false;
+                                #if defined(VTEX_TIERS)
+                                switch(enter())
+                                {
+                                    case 1:
+                                        FEEDBACK(typebit(*fn) << 8);
+                                        break;
+                                    case -1:
+                                        return false;
+                                }
+                                #endif
+                                RELOAD();
+                            } else if (fn->tag == native)
+                            {
+                                if (!callnative(fn, nargs, *fn))
+                                    return false;
+                                // Natives that called script functions back may have grown the frames
+                                frame = &frames.back();
+                                FEEDBACK(typebit(*fn) << 8);
+                            } else
+                                return runtimeerror(stringf("Attempt to call a %s value", typname(*fn)));
+                            vmbreak;
+                        }
+                        vmcase(OP_RET)
+                        {
+                            base[-1] = GetB(i) ? base[GetA(i)] : Val();
+                            frames.pop_back();
+                            returned:
+                            if (frames.size() == depth)
+                                return true;
+                            RELOAD();
+                            // The caller is behind its call now
+                            FEEDBACK(typebit(base[GetA(pc[-1])]) << 8);
+                            vmbreak;
+                        }
+                        vmcase(OP_TAILCALL)
+                        {
+                            Val* fn = base + GetA(i);
+                            SAVEPC();
+                            SAFEPOINT();
+                            FEEDBACK(typebit(*fn));
+                            switch(tailcall(fn, GetB(i)))
+                            {
+                                case 1:
+                                    frames.pop_back();
+                                    goto returned;
+                                case -1:
+                                    return false;
+                            }
+                            #if defined(VTEX_TIERS)
+                            switch(enter())
+                            {
+                                case 1:
+                                    goto returned;
+                                case -1:
+                                    return false;
+                            }
+                            #endif
+                            RELOAD();
+                            vmbreak;
+                        }
+                        vmcase(OP_GETINDEX)
+                        {
+                            auto &rb = base[GetB(i)];
+                            auto &rc = base[GetC(i)];
+                            if (rb.tag == array && rc.tag == number && !((VArray*)rb.o)->boxed)
+                            {
+                                auto &nums = ((VArray*)rb.o)->nums;
+                                int64_t at = position(rc.n, nums.size());
+                                if (at >= 0)
+                                {
+                                    base[GetA(i)] = Val(nums[at]);
+                                    vmbreak;
+                                }
+                            }
+                            SAVEPC();
+                            if (!arrayop(i, base))
+                                return false;
+                            vmbreak;
+                        }
+                        vmcase(OP_SETINDEX)
+                        {
+                            auto &ra = base[GetA(i)];
+                            auto &rb = base[GetB(i)];
+                            auto &rc = base[GetC(i)];
+                            if (ra.tag == array && rb.tag == number && rc.tag == number && !((VArray*)ra.o)->boxed)
+                            {
+                                auto &nums = ((VArray*)ra.o)->nums;
+                                int64_t at = position(rb.n, nums.size());
+                                if (at >= 0)
+                                {
+                                    nums[at] = rc.n;
+                                    vmbreak;
+                                }
+                            }
+                            SAVEPC();
+                            if (!arrayop(i, base))
+                                return false;
+                            vmbreak;
+                        }
+                        vmcase(OP_GETFIELD)
+                        {
+                            auto &rb = base[GetB(i)];
+                            int f = rb.tag == record ? ((VRecord*)rb.o)->layout->offset(fieldkeys[GetC(i)]) : -1;
+                            if (f >= 0)
+                            {
+                                auto &ra = base[GetA(i)];
+                                ra = ((VRecord*)rb.o)->fields()[f];
+                                if (ra.isobj())
+                                    ra.o->shared = true;
+                                vmbreak;
+                            }
+                            SAVEPC();
+                            if (!arrayop(i, base))
+                                return false;
+                            vmbreak;
+                        }
+                        vmcase(OP_SETFIELD)
+                        {
+                            auto &ra = base[GetA(i)];
+                            int f = ra.tag == record ? ((VRecord*)ra.o)->layout->offset(fieldkeys[GetB(i)]) : -1;
+                            if (f >= 0)
+                            {
+                                auto &rc = base[GetC(i)];
+                                if (rc.isobj())
+                                    rc.o->shared = true;
+                                heap.store(ra.o, ((VRecord*)ra.o)->fields()[f], rc);
+                                vmbreak;
+                            }
+                            SAVEPC();
+                            if (!arrayop(i, base))
+                                return false;
+                            vmbreak;
+                        }
+                        vmcase(OP_NEWRECORD)
+                        vmcase(OP_NEWARRAY)
+                        vmcase(OP_APPEND)
+                        {
+                            SAVEPC();
+                            if (!arrayop(i, base))
+                                return false;
+                            vmbreak;
+                        }
+                        vmcase(OP_ADDK)
+                        {
+                            auto &ra = base[GetA(i)];
+                            auto &rb = base[GetB(i)];
+                            auto &kc = k[GetC(i)];
+                            if (rb.tag == number && kc.tag == number)
+                            {
+                                FEEDBACK(fb_numbers);
+                                ra.n = rb.n + kc.n;
+                                ra.tag = number;
+                                vmbreak;
+                            }
+                            FEEDBACK(typepair(rb, kc));
+                            if (&ra == &rb && rb.tag == string && !rb.o->shared)
+                                mutstr(rb) += tostring(kc);
+                            else
+                                ra = arith(heap, OP_ADD, rb, kc, &ra == &rb);
+                            vmbreak;
+                        }
+                        vmcase(OP_SUBK) vmbinop(OP_SUB, k, rb.n - rc.n)
+                        vmcase(OP_MULK) vmbinop(OP_MUL, k, rb.n * rc.n)
+                        vmcase(OP_DIVK) vmbinop(OP_DIV, k, rb.n / rc.n)
+                        vmcase(OP_MODK) vmbinop(OP_MOD, k, modulo(rb.n, rc.n))
+                        #undef vmbinop
+
+                        // Compare and jump: the JMP that follows holds the offset
+                        #define vmcondjump(res) \
+                            if ((res) == (GetC(i) != 0)) \
+                                pc += GetsBx(*pc) + 1; \
+                            else \
+                                ++pc; \
+                            vmbreak;
+                        #define vmcompare(y, result, op) \
+                        { \
+                            auto &ra = base[GetA(i)]; \
+                            auto &rb = y[GetB(i)]; \
+                            if (ra.tag == number && rb.tag == number) \
+                            { \
+                                FEEDBACK(fb_numbers); \
+                                vmcondjump(result); \
+                            } \
+                            FEEDBACK(typepair(ra, rb)); \
+                            vmcondjump(truthy(arith(heap, op, ra, rb))); \
+                        }
+
+                        vmcase(OP_JEQ) vmcompare(base, numequals(ra.n, rb.n), OP_EQ)
+                        vmcase(OP_JLT) vmcompare(base, ra.n < rb.n, OP_LT)
+                        vmcase(OP_JLE) vmcompare(base, ra.n < rb.n || numequals(ra.n, rb.n), OP_LE)
+                        vmcase(OP_JEQK) vmcompare(k, numequals(ra.n, rb.n), OP_EQ)
+                        vmcase(OP_JLTK) vmcompare(k, ra.n < rb.n, OP_LT)
+                        vmcase(OP_JLEK) vmcompare(k, ra.n < rb.n || numequals(ra.n, rb.n), OP_LE)
+                        vmcase(OP_JGTK) vmcompare(k, ra.n > rb.n, OP_GT)
+                        vmcase(OP_JGEK) vmcompare(k, ra.n > rb.n || numequals(ra.n, rb.n), OP_GE)
+                        #undef vmcondjump
+                        #undef vmcompare
+
+                        vmcase(OP_CALLG)
+                        {
+                            // Loads the called function late, after the arguments, then calls it
+                            base[GetA(i)] = functions[GetC(i)];
+                            goto call;
+                        }
+                        vmcase(OP_FORPREP)
+                        {
+                            SAVEPC();
+                            int trips = forprep(base + GetA(i));
+                            if (trips < 0)
+                                return false;
+                            if (!trips)
+                                pc += GetsBx(i);
+                            vmbreak;
+                        }
+                        vmcase(OP_FORLOOP)
+                        {
+                            // The counter and its bounds are numbers since OP_FORPREP
+                            auto r = base + GetA(i);
+                            double n = r[0].n + 1;
+                            if (n < r[1].n)
+                            {
+                                r[0].n = n;
+                                r[4] = Val(r[2].n + n*r[3].n);
+                                pc += GetsBx(i);
+                                BACKEDGE();
+                            }
+                            vmbreak;
+                        }
+                        vmcase(OP_GETELEM)
+                        {
+                            // The index may still be past the end when len() was taken over by a script
+                            auto &rb = base[GetB(i)];
+                            auto at = (size_t)base[GetC(i)].n;
+                            if (rb.tag == array && !((VArray*)rb.o)->boxed && at < ((VArray*)rb.o)->nums.size())
+                            {
+                                base[GetA(i)] = Val(((VArray*)rb.o)->nums[at]);
+                                vmbreak;
+                            }
+                            SAVEPC();
+                            if (!arrayop(i, base))
+                                return false;
+                            vmbreak;
+                        }
+                        vmcase(OP_SETELEM)
+                        {
+                            auto &ra = base[GetA(i)];
+                            auto &rc = base[GetC(i)];
+                            auto at = (size_t)base[GetB(i)].n;
+                            if (ra.tag == array && rc.tag == number && !((VArray*)ra.o)->boxed && at < ((VArray*)ra.o)->nums.size())
+                            {
+                                ((VArray*)ra.o)->nums[at] = rc.n;
+                                vmbreak;
+                            }
+                            SAVEPC();
+                            if (!arrayop(i, base))
+                                return false;
+                            vmbreak;
+                        }
+                        vmcase(OP_ADDGLOBAL)
+                        {
+                            auto &g = globals[GetBx(i)];
+                            auto &ra = base[GetA(i)];
+                            if (g.tag == number && ra.tag == number)
+                                g.n += ra.n;
+                            else
+                                g = addinto(heap, g, ra);
+                            vmbreak;
+                        }
+                        vmcase(OP_ADDBOX)
+                        {
+                            auto &b = base[GetB(i)];
+                            heap.store(b.o, unbox(b), addinto(heap, unbox(b), base[GetA(i)]));
+                            vmbreak;
+                        }
+                        vmcase(OP_ADDUPBOX)
+                        {
+                            auto &b = upvals(base[-1])[GetB(i)];
+                            heap.store(b.o, unbox(b), addinto(heap, unbox(b), base[GetA(i)]));
+                            vmbreak;
+                        }
+                        #if !defined(VTEX_THREADED)
+                        default:
+                            SAVEPC();
+                            return runtimeerror(stringf("Bad opcode %i", GetOp(i)));
+                        #endif
+                    }
+                }
+
+                #undef vmdispatch
+                #undef vmcase
+                #undef vmbreak
+                #undef vmfetch
+                #undef SAVEPC
+                #undef RELOAD
+                #undef FEEDBACK
+                #undef SAFEPOINT
+                #undef BACKEDGE
+            }
+    };
+
+    #if defined(VTEX_TIERS)
+    // Runs the instruction at pc the generic way, for native code without a fast path for it.
+    // Compare and jumps return whether their comparison held.
+    inline int64_t step(VM* vm, Val* base, int32_t pc)
+    {
+        auto p = vm->frames.back().proto;
+        auto k = p->k.data();
+        auto i = p->code[pc];
+        auto op = GetOp(i);
+        auto &ra = base[GetA(i)];
+        switch(op)
+        {
+            case OP_MOVE:
+                ra = base[GetB(i)];
+                if (ra.isobj())
+                    ra.o->shared = true;
+                break;
+            case OP_GETGLOBAL:
+                ra = vm->globals[GetBx(i)];
+                if (ra.isobj())
+                    ra.o->shared = true;
+                break;
+            case OP_SETGLOBAL:
+                if (ra.isobj())
+                    ra.o->shared = true;
+                vm->globals[GetBx(i)] = ra;
+                break;
+            case OP_GETFUNC:
+                ra = vm->functions[GetBx(i)];
+                break;
+            case OP_SETFUNC:
+                vm->functions[GetBx(i)] = ra;
+                break;
+            case OP_ADD:
+            case OP_ADDK:
+            {
+                auto &rb = base[GetB(i)];
+                auto &rc = op == OP_ADD ? base[GetC(i)] : k[GetC(i)];
+                p->slots[pc] |= typepair(rb, rc);
+                if (&ra == &rb && rb.tag == string && !rb.o->shared)
+                    mutstr(rb) += tostring(rc);
+                else
+                    ra = arith(vm->heap, OP_ADD, rb, rc, &ra == &rb);
+                break;
+            }
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_EQ:
+            case OP_NE:
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE:
+                p->slots[pc] |= typepair(base[GetB(i)], base[GetC(i)]);
+                ra = arith(vm->heap, op, base[GetB(i)], base[GetC(i)], &ra == &base[GetB(i)]);
+                break;
+            case OP_SUBK:
+            case OP_MULK:
+            case OP_DIVK:
+            case OP_MODK:
+                p->slots[pc] |= typepair(base[GetB(i)], k[GetC(i)]);
+                ra = arith(vm->heap, (OpCode)(op - OP_ADDK + OP_ADD), base[GetB(i)], k[GetC(i)], &ra == &base[GetB(i)]);
+                break;
+            case OP_NOT:
+                ra = Val(!truthy(base[GetB(i)]));
+                break;
+            case OP_NEG:
+            {
+                auto &rb = base[GetB(i)];
+                ra = rb.tag == number ? Val(-rb.n) : Val();
+                break;
+            }
+            case OP_CLOSURE:
+                closure(vm->heap, p->protos[GetBx(i)], base, &ra);
+                break;
+            case OP_GETUPVAL:
+                ra = upvals(base[-1])[GetB(i)];
+                if (ra.isobj())
+                    ra.o->shared = true;
+                break;
+            case OP_GETUPBOX:
+                ra = unbox(upvals(base[-1])[GetB(i)]);
+                if (ra.isobj())
+                    ra.o->shared = true;
+                break;
+            case OP_SETUPBOX:
+            {
+                if (ra.isobj())
+                    ra.o->shared = true;
+                auto &b = upvals(base[-1])[GetB(i)];
+                vm->heap.store(b.o, unbox(b), ra);
+                break;
+            }
+            case OP_NEWBOX:
+                ra = Val(vm->heap.alloc<VBox>(ra), box);
+                break;
+            case OP_GETBOX:
+                ra = unbox(base[GetB(i)]);
+                if (ra.isobj())
+                    ra.o->shared = true;
+                break;
+            case OP_SETBOX:
+                if (ra.isobj())
+                    ra.o->shared = true;
+                vm->heap.store(base[GetB(i)].o, unbox(base[GetB(i)]), ra);
+                break;
+            case OP_ADDGLOBAL:
+                vm->globals[GetBx(i)] = addinto(vm->heap, vm->globals[GetBx(i)], ra);
+                break;
+            case OP_ADDBOX:
+            {
+                auto &b = base[GetB(i)];
+                vm->heap.store(b.o, unbox(b), addinto(vm->heap, unbox(b), ra));
+                break;
+            }
+            case OP_ADDUPBOX:
+            {
+                auto &b = upvals(base[-1])[GetB(i)];
+                vm->heap.store(b.o, unbox(b), addinto(vm->heap, unbox(b), ra));
+                break;
+            }
+            case OP_JEQ:
+            case OP_JLT:
+            case OP_JLE:
+            case OP_JEQK:
+            case OP_JLTK:
+            case OP_JLEK:
+            case OP_JGTK:
+            case OP_JGEK:
+            {
+                static const OpCode cmp[] = {OP_EQ, OP_LT, OP_LE, OP_EQ, OP_LT, OP_LE, OP_GT, OP_GE};
+                auto &rb = op < OP_JEQK ? base[GetB(i)] : k[GetB(i)];
+                p->slots[pc] |= typepair(ra, rb);
+                return truthy(arith(vm->heap, cmp[op - OP_JEQ], ra, rb));
+            }
+            default:
+                break;
+        }
+        return 0;
+    }
+
+    // Collects if the heap asks for it, for loop back edges in native code. The code has all
+    // registers in the frame and reloads its objects, which may have moved, afterwards.
+    inline int32_t nativesafepoint(VM* vm, int32_t pc)
+    {
+        auto &frame = vm->frames.back();
+        frame.pc = frame.proto->code.data() + pc + 1;
+        return !vm->heap.wantgc || vm->collect();
+    }
+
+    // Calls from native code, pc is the calling instruction so error traces show the right line
+    inline int32_t nativecall(VM* vm, Val* fn, int32_t nargs, int32_t pc)
+    {
+        if (!nativesafepoint(vm, pc))
+            return false;
+        auto &frame = vm->frames.back();
+        frame.pc = frame.proto->code.data() + pc + 1;
+        auto &slot = frame.proto->slots[pc];
+        slot |= typebit(*fn);
+        if (!vm->call(fn, nargs))
+            return false;
+        slot |= typebit(*fn) << 8;
+        return true;
+    }
+    // Returns what the native code of the tail calling function returns, see jitfn
+    inline int64_t nativetailcall(VM* vm, Val* fn, int32_t nargs, int32_t pc)
+    {
+        if (!nativesafepoint(vm, pc))
+            return -2;
+        auto &frame = vm->frames.back();
+        frame.pc = frame.proto->code.data() + pc + 1;
+        frame.proto->slots[pc] |= typebit(*fn);
+        switch(vm->tailcall(fn, nargs))
+        {
+            case 0:
+                return -3;
+            case 1:
+                return -1;
+        }
+        return -2;
+    }
+    // Array instructions from native code, see VM::arrayop
+    inline int32_t nativearrayop(VM* vm, Val* base, int32_t pc)
+    {
+        auto &frame = vm->frames.back();
+        frame.pc = frame.proto->code.data() + pc + 1;
+        return vm->arrayop(frame.proto->code[pc], base);
+    }
+    // Where native code finds the flag of an array and the pointer to its numbers, nums is -1 if
+    // std::vector does not keep that pointer up front and the elements have to go through arrayop
+    struct ArrayLayout
+    {
+        int32_t boxed, nums, end;
+    };
+    inline const ArrayLayout &arraylayout()
+    {
+        static const ArrayLayout layout = []
+        {
+            VArray a;
+            a.nums.resize(1);
+            int32_t nums = (int32_t)((char*)&a.nums - (char*)&a);
+            ArrayLayout l = {(int32_t)((char*)&a.boxed - (char*)&a), nums, nums + (int32_t)sizeof(double*)};
+            double* first, *end;
+            memcpy(&first, (char*)&a + l.nums, sizeof(first));
+            memcpy(&end, (char*)&a + l.end, sizeof(end));
+            if (first != a.nums.data() || end != a.nums.data() + a.nums.size())
+                l.nums = -1;
+            return l;
+        }();
+        return layout;
+    }
+
+    // OP_FORPREP from native code, 0 on a runtime error, 1 for a loop without trips and 2 to enter it
+    inline int32_t nativeforprep(VM* vm, Val* base, int32_t pc)
+    {
+        auto &frame = vm->frames.back();
+        frame.pc = frame.proto->code.data() + pc + 1;
+        return vm->forprep(base + GetA(frame.proto->code[pc])) + 1;
+    }
+    inline int32_t nativecallfunction(VM* vm, Val* fn, int32_t nargs, int32_t pc, int32_t slot)
+    {
+        *fn = vm->functions[slot];
+        return nativecall(vm, fn, nargs, pc);
+    }
+    #endif
+}
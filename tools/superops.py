@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+# Ranks the opcode pairs recorded by a VTEX_PROFILE_PAIRS build.
+#
+#   VTEX_PAIRS_OUT=corpus.prof Vnew script.vtex   (once per script of the corpus)
+#   python3 tools/superops.py corpus.prof [top]
+#
+# Prints the hottest pairs with their share of all executed pairs. These are the
+# candidates for superinstructions fused by the bytecode compiler (see IR.h).
+
+import sys
+from collections import Counter
+
+def main():
+    if len(sys.argv) < 2:
+        print("usage: superops.py <profile> [top]")
+        return 1
+    top = int(sys.argv[2]) if len(sys.argv) > 2 else 15
+    pairs = Counter()
+    with open(sys.argv[1]) as f:
+        for line in f:
+            first, second, count = line.split()
+            pairs[(first, second)] += int(count)
+    total = sum(pairs.values())
+    if total == 0:
+        return 0
+    covered = 0
+    print("%-22s %14s %7s %7s" % ("pair", "count", "share", "total"))
+    for (first, second), count in pairs.most_common(top):
+        covered += count
+        print("%-22s %14d %6.2f%% %6.2f%%" % (first + " " + second, count, 100.0 * count / total, 100.0 * covered / total))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())